@@ -0,0 +1,331 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for individual emulator kernels.
+ *
+ * The measured kernels are mostly static functions. In order to call them in
+ * isolation, their translation units are included here directly rather than
+ * being linked in.
+ *
+ * Each kernel is measured in two conditions:
+ *   warm : the kernel is invoked BATCH times back to back; a sample is the
+ *          average time of one invocation in the batch
+ *   cold : the data cache is flushed by streaming over a buffer larger than
+ *          the LLC before each sample; a sample is a single invocation
+ * Reported values are the median and 99th percentile over all samples, with
+ * the cost of reading the clock subtracted.
+ */
+
+#include <stdio.h>      /* printf           */
+#include <stdlib.h>     /* qsort            */
+#include <string.h>     /* strstr           */
+
+#include "../src/system.c"
+#include "../src/display.c"
+#include "../src/sound.c"
+
+#define WARM_SAMPLES    1000        /* number of warm samples        */
+#define COLD_SAMPLES    200         /* number of cold samples        */
+#define BATCH           64          /* invocations per warm sample   */
+#define EVICT_SZ        (32 << 20)  /* cache eviction buffer size    */
+#define AUDIO_BUF       1024        /* samples per audio buffer      */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+static uint64_t   samples[WARM_SAMPLES];    /* sample buffer             */
+static uint8_t    *evict_buf;               /* cache eviction buffer     */
+static double     clock_overhead;           /* cost of reading the clock */
+static const char *filter;                  /* benchmark name filter     */
+static float      audio_buf[AUDIO_BUF];     /* audio generator output    */
+
+/* sprite data (8 lines of 0xff) */
+static uint8_t sprite[16] = { [ 0 ... 15 ] = 0xff };
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* cmp_u64 - qsort comparator for uint64_t
+ */
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t _a = *(uint64_t *) a;
+    uint64_t _b = *(uint64_t *) b;
+
+    return (_a > _b) - (_a < _b);
+}
+
+/* evict_cache - pushes everything else out of the data cache
+ */
+static void
+evict_cache(void)
+{
+    for (size_t i = 0; i < EVICT_SZ; i += 64)
+        ((volatile uint8_t *) evict_buf)[i]++;
+}
+
+/* summarize - sorts samples and determines median / p99
+ *  @n     : number of samples
+ *  @scale : divisor applied to each sample
+ *  @med   : median [ns]
+ *  @p99   : 99th percentile [ns]
+ */
+static void
+summarize(size_t n, double scale, double *med, double *p99)
+{
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+
+    *med = samples[n / 2] / scale - clock_overhead / scale;
+    *p99 = samples[n * 99 / 100] / scale - clock_overhead / scale;
+
+    if (*med < 0)
+        *med = 0;
+    if (*p99 < 0)
+        *p99 = 0;
+}
+
+/* BENCH - measures a kernel in both warm and cold conditions
+ *  @name : benchmark name
+ *  @prep : statement executed before each invocation (included in timing)
+ *  @body : kernel invocation
+ */
+#define BENCH(name, prep, body)                                             \
+    do {                                                                    \
+        double   w_med, w_p99, c_med, c_p99;                                \
+        uint64_t t;                                                         \
+                                                                            \
+        if (filter && !strstr(name, filter))                                \
+            break;                                                          \
+                                                                            \
+        for (size_t s = 0; s < WARM_SAMPLES; s++) {                         \
+            t = tsc_ns();                                                   \
+            for (size_t b = 0; b < BATCH; b++) {                            \
+                prep;                                                       \
+                body;                                                       \
+                asm volatile("" ::: "memory");  /* no hoisting */           \
+            }                                                               \
+            samples[s] = tsc_ns() - t;                                      \
+        }                                                                   \
+        summarize(WARM_SAMPLES, BATCH, &w_med, &w_p99);                     \
+                                                                            \
+        for (size_t s = 0; s < COLD_SAMPLES; s++) {                         \
+            evict_cache();                                                  \
+            t = tsc_ns();                                                   \
+            prep;                                                           \
+            body;                                                           \
+            samples[s] = tsc_ns() - t;                                      \
+        }                                                                   \
+        summarize(COLD_SAMPLES, 1, &c_med, &c_p99);                         \
+                                                                            \
+        printf("%-36s %10.1f %10.1f %10.1f %10.1f\n",                       \
+               name, w_med, w_p99, c_med, c_p99);                           \
+    } while (0)
+
+/* calibrate - determines the cost of two back to back clock reads
+ */
+static void
+calibrate(void)
+{
+    uint64_t t;
+
+    for (size_t s = 0; s < WARM_SAMPLES; s++) {
+        t = tsc_ns();
+        samples[s] = tsc_ns() - t;
+    }
+
+    qsort(samples, WARM_SAMPLES, sizeof(*samples), cmp_u64);
+    clock_overhead = samples[WARM_SAMPLES / 2];
+}
+
+/* fill_pixels - sets the collision density of the framebuffer
+ *  @pct : percentage of active pixels
+ */
+static void
+fill_pixels(uint8_t pct)
+{
+    srandom(0);
+    for (size_t i = 0; i < sizeof(main_vm.pixels); i++)
+        main_vm.pixels[i] = (random() % 100) < pct;
+}
+
+/******************************************************************************
+ ******************************** BENCHMARKS **********************************
+ ******************************************************************************/
+
+/* bench_display - display_sprite() and refresh_display()
+ */
+static void
+bench_display(void)
+{
+    static const uint8_t heights[]  = { 1, 5, 15 };
+    static const uint8_t density[]  = { 0, 50, 100 };
+    static const struct {
+        const char *name;
+        uint8_t    x, y;
+    } pos[] = {
+        { "nowrap", 10, 10 },
+        { "xwrap",  60, 10 },
+        { "ywrap",  10, 28 },
+        { "xywrap", 60, 28 },
+    };
+    char name[64];
+
+    for (size_t d = 0; d < sizeof(density); d++) {
+        for (size_t h = 0; h < sizeof(heights); h++) {
+            for (size_t p = 0; p < sizeof(pos) / sizeof(*pos); p++) {
+                snprintf(name, sizeof(name), "display_sprite/h%hhu/%s/%hhu%%",
+                         heights[h], pos[p].name, density[d]);
+
+                /* BATCH is even, so each warm sample ends with the initial *
+                 * framebuffer contents; cold samples alternate between two */
+                fill_pixels(density[d]);
+                BENCH(name, ,
+                      display_sprite(main_vm.pixels, pos[p].x, pos[p].y,
+                                     sprite, heights[h]));
+            }
+        }
+
+        snprintf(name, sizeof(name), "refresh_display/%hhu%%", density[d]);
+        fill_pixels(density[d]);
+        BENCH(name, , refresh_display(main_vm.pixels));
+    }
+}
+
+/* bench_sound - audio sample generators per buffer
+ */
+static void
+bench_sound(void)
+{
+    static const uint8_t pattern[16] = { [ 0 ... 15 ] = 0xa5 };
+
+    tone_freq = 440.0f;
+
+    BENCH("sin_samplegen/1024", ,
+          sin_samplegen(NULL, audio_buf, AUDIO_BUF, NULL, 0, NULL));
+
+    set_audio_pattern(pattern);
+    set_audio_pitch(PATTERN_PITCH);
+
+    BENCH("pattern_samplegen/1024", ,
+          pattern_samplegen(audio_buf, AUDIO_BUF));
+}
+
+/* bench_ins - individual instruction handlers
+ *
+ * Operands are fixed; state that would otherwise drift out of range (SP, I)
+ * is reset in the preparation step.
+ */
+static void
+bench_ins(void)
+{
+    struct chip8_vm *vm = &main_vm;     /* benchmarked machine */
+
+    BENCH("update_keystate", , update_keystate(vm));
+
+    BENCH("ins_00E0", , ins_00E0(vm));
+    BENCH("ins_00EE", vm->regs.SP = 1, ins_00EE(vm));
+    BENCH("ins_1NNN", , ins_1NNN(vm, 0x200));
+    BENCH("ins_2NNN", vm->regs.SP = 0, ins_2NNN(vm, 0x200));
+    BENCH("ins_3XKK", , ins_3XKK(vm, 1, 0x12));
+    BENCH("ins_4XKK", , ins_4XKK(vm, 1, 0x12));
+    BENCH("ins_5XY0", , ins_5XY0(vm, 1, 2));
+    BENCH("ins_6XKK", , ins_6XKK(vm, 1, 0x12));
+    BENCH("ins_7XKK", , ins_7XKK(vm, 1, 0x12));
+    BENCH("ins_8XY0", , ins_8XY0(vm, 1, 2));
+    BENCH("ins_8XY1", , ins_8XY1(vm, 1, 2));
+    BENCH("ins_8XY2", , ins_8XY2(vm, 1, 2));
+    BENCH("ins_8XY3", , ins_8XY3(vm, 1, 2));
+    BENCH("ins_8XY4", , ins_8XY4(vm, 1, 2));
+    BENCH("ins_8XY5", , ins_8XY5(vm, 1, 2));
+    BENCH("ins_8XY6", , ins_8XY6(vm, 1, 2));
+    BENCH("ins_8XY7", , ins_8XY7(vm, 1, 2));
+    BENCH("ins_8XYE", , ins_8XYE(vm, 1, 2));
+    BENCH("ins_9XY0", , ins_9XY0(vm, 1, 2));
+    BENCH("ins_ANNN", , ins_ANNN(vm, 0x300));
+    BENCH("ins_BNNN", , ins_BNNN(vm, 0x300));
+    BENCH("ins_CXKK", , ins_CXKK(vm, 1, 0xff));
+    BENCH("ins_DXYN", vm->regs.I = 0x300, ins_DXYN(vm, 1, 2, 5));
+    BENCH("ins_EX9E", , ins_EX9E(vm, 1));
+    BENCH("ins_EXA1", , ins_EXA1(vm, 1));
+    BENCH("ins_FX07", , ins_FX07(vm, 1));
+    BENCH("ins_FX0A", , ins_FX0A(vm, 1));
+    BENCH("ins_FX15", , ins_FX15(vm, 1));
+    /* NOTE: FX18 is omitted; its cost is dominated by portaudio */
+    BENCH("ins_FX1E", vm->regs.I = 0x300, ins_FX1E(vm, 1));
+    BENCH("ins_F002", vm->regs.I = 0x300, ins_F002(vm));
+    BENCH("ins_FX3A", , ins_FX3A(vm, 1));
+    BENCH("ins_FX29", , ins_FX29(vm, 1));
+    BENCH("ins_FX33", vm->regs.I = 0x300, ins_FX33(vm, 1));
+    BENCH("ins_FX55", vm->regs.I = 0x300, ins_FX55(vm, 15));
+    BENCH("ins_FX65", vm->regs.I = 0x300, ins_FX65(vm, 15));
+}
+
+/******************************************************************************
+ ******************************** ENTRY POINT *********************************
+ ******************************************************************************/
+
+int32_t main(int32_t argc, char *argv[])
+{
+    SDL_Surface     *surface;       /* offscreen render target */
+    struct sigevent ev = {          /* no timer notification   */
+        .sigev_notify = SIGEV_NONE,
+    };
+    int32_t         ans;            /* answer                  */
+
+    /* optional substring filter for benchmark names */
+    filter = argc > 1 ? argv[1] : NULL;
+
+    evict_buf = malloc(EVICT_SZ);
+    DIE(!evict_buf, "unable to allocate cache eviction buffer");
+    memset(evict_buf, 0, EVICT_SZ);
+
+    /* emulated system state; timers and audio as in interactive mode */
+    ans = vm_init(&main_vm, 200, 0x50, 0, 0, 0);
+    DIE(ans, "unable to initialize machine");
+    main_vm.headless  = 0;
+    main_vm.regs.V[1] = 0x12;
+    main_vm.regs.V[2] = 0x0a;
+
+    ans = timer_create(CLOCK_MONOTONIC, &ev, &delay_timerid);
+    DIE(ans, "unable to create delay timer (%s)", strerror(errno));
+
+    /* null renderer: software rendering into an offscreen surface */
+    surface = SDL_CreateRGBSurfaceWithFormat(0, 64, 32, 32,
+                                             SDL_PIXELFORMAT_ARGB8888);
+    DIE(!surface, "unable to create surface (%s)", SDL_GetError());
+    render = SDL_CreateSoftwareRenderer(surface);
+    DIE(!render, "unable to create renderer (%s)", SDL_GetError());
+
+    /* kernels take tens of ns; clock_gettime() would dominate them */
+    tsc_init();
+    calibrate();
+
+    printf("clock: %s\n", tsc_hz() ? "calibrated TSC" : "clock_gettime");
+    printf("%-36s %10s %10s %10s %10s\n", "kernel [ns]",
+           "warm p50", "warm p99", "cold p50", "cold p99");
+
+    bench_display();
+    bench_sound();
+    bench_ins();
+
+    return 0;
+}
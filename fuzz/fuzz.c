@@ -0,0 +1,189 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Persistent-mode fuzzing harness for the emulator core.
+ *
+ * Implements the libFuzzer entry point; AFL++ can drive it as well when
+ * built with afl-clang-fast -fsanitize=fuzzer. Machines are created once and
+ * rolled back to a checkpoint before each execution, so that no timers,
+ * mappings or files are created per input and only the RAM written by the
+ * previous input is copied.
+ *
+ * Input layout:
+ *   [0]          : ENGINE_* flags of an alternative engine (lower 2 bits)
+ *   [1]          : number of input events (N)
+ *   [2 .. 2N+1]  : input events; { frame delta, key | down << 7 }
+ *   [2N+2 .. ]   : ROM, loaded at 0x200
+ *
+ * Each input runs for a fixed number of frames. If an alternative engine is
+ * selected, the input also runs on it and the final states must match those
+ * of the switch interpreter.
+ */
+
+#include <stdio.h>      /* fopen, fread, fprintf */
+#include <stdlib.h>     /* abort                 */
+
+#include "system.h"
+#include "input.h"
+#include "util.h"
+
+#define FUZZ_FREQ       600     /* CPU frequency (10 cycles per frame)  */
+#ifndef FUZZ_FRAMES
+#define FUZZ_FRAMES     60      /* frames executed per input            */
+#endif
+#define FUZZ_ROM_OFF    0x200   /* ROM map offset into RAM              */
+#define FUZZ_FONT_OFF   0x50    /* font sprites offset into RAM         */
+#define FUZZ_ENGINES    4       /* all combinations of ENGINE_* flags   */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+static uint8_t         ready = 0;                   /* machines created     */
+static struct chip8_vm machines[FUZZ_ENGINES];      /* indexed by engines   */
+static struct chip8_vm checkpoints[FUZZ_ENGINES];   /* reset state of each  */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* fuzz_init - creates one machine per engine set and its reset checkpoint
+ */
+static void
+fuzz_init(void)
+{
+    int32_t ans;    /* answer */
+
+    for (size_t i = 0; i < FUZZ_ENGINES; i++) {
+        ans = vm_init(&machines[i], FUZZ_FREQ, FUZZ_FONT_OFF, 0, i, 0);
+        DIE(ans, "unable to initialize machine");
+
+        ans = vm_init(&checkpoints[i], FUZZ_FREQ, FUZZ_FONT_OFF, 0, 0, 0);
+        DIE(ans, "unable to initialize checkpoint");
+
+        vm_checkpoint(&machines[i], &checkpoints[i]);
+    }
+
+    ready = 1;
+}
+
+/* fuzz_run - executes one input on a machine
+ *  @vm   : machine
+ *  @cp   : reset checkpoint of @vm
+ *  @data : fuzz input
+ *  @size : size of fuzz input
+ *
+ *  @return : hash of final machine state
+ */
+static uint64_t
+fuzz_run(struct chip8_vm       *vm,
+         const struct chip8_vm *cp,
+         const uint8_t         *data,
+         size_t                size)
+{
+    size_t   n     = data[1];   /* number of input events */
+    uint64_t frame = 0;         /* input event frame      */
+    size_t   rom_len;           /* ROM size               */
+
+    vm_rollback(vm, cp);
+
+    /* truncate event list to available data */
+    if (2 + 2 * n > size)
+        n = (size - 2) / 2;
+
+    for (size_t i = 0; i < n; i++) {
+        frame += data[2 + 2 * i];
+        input_push(&vm->input_q, frame * vm->batch_cycles,
+                   data[3 + 2 * i] & 0x0f, data[3 + 2 * i] >> 7);
+    }
+
+    /* load whatever fits as ROM */
+    rom_len = size - 2 - 2 * n;
+    if (rom_len > RAM_SZ - FUZZ_ROM_OFF)
+        rom_len = RAM_SZ - FUZZ_ROM_OFF;
+
+    vm_load(vm, data + 2 + 2 * n, rom_len, FUZZ_ROM_OFF);
+    vm_run(vm, FUZZ_FRAMES * vm->batch_cycles);
+
+    return vm_hash(vm);
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* LLVMFuzzerTestOneInput - libFuzzer entry point
+ *  @data : fuzz input
+ *  @size : size of fuzz input
+ *
+ *  @return : 0 (input may be added to corpus)
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t  engines;       /* alternative engine */
+    uint64_t ref;           /* reference hash     */
+
+    if (unlikely(!ready))
+        fuzz_init();
+
+    if (size < 2)
+        return 0;
+
+    engines = data[0] % FUZZ_ENGINES;
+    ref     = fuzz_run(&machines[0], &checkpoints[0], data, size);
+
+    /* any difference from the reference is a bug in the other engine */
+    if (engines && fuzz_run(&machines[engines], &checkpoints[engines],
+                            data, size) != ref) {
+        fprintf(stderr, "engine %hhu diverges from switch interpreter\n",
+                engines);
+        abort();
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/* main - replays fuzz inputs (e.g.: crashes) without a fuzzing engine
+ *  @argc : number of arguments
+ *  @argv : paths to fuzz inputs
+ *
+ *  @return : 0 if everything went well
+ */
+int32_t main(int32_t argc, char *argv[])
+{
+    static uint8_t buf[2 + 2 * 255 + RAM_SZ];   /* largest relevant input */
+    FILE           *f;                          /* input file             */
+    size_t         size;                        /* input size             */
+
+    for (int32_t i = 1; i < argc; i++) {
+        f = fopen(argv[i], "rb");
+        RET(!f, -1, "unable to open %s", argv[i]);
+
+        size = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+
+        LLVMFuzzerTestOneInput(buf, size);
+        fprintf(stderr, "%s: ok\n", argv[i]);
+    }
+
+    return 0;
+}
+#endif /* FUZZ_STANDALONE */
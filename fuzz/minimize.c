@@ -0,0 +1,549 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Delta debugging minimizer for failing fuzz inputs.
+ *
+ * Shrinks an input (see fuzz.c for its layout) while it keeps failing in the
+ * same way, using ddmin: first over its key events, then over the non-zero
+ * instruction words of its ROM. Removed events are dropped; removed ROM
+ * words are zeroed rather than cut out, so that the addresses of the rest of
+ * the code stay the same (0000 has no effect other than being counted as an
+ * undecodable instruction). Both passes are repeated until neither makes
+ * progress, then trailing zeros are trimmed off the ROM.
+ *
+ * All candidates of a ddmin round are evaluated in parallel, one worker
+ * thread per CPU, each with its own machines that are rolled back to a
+ * checkpoint before every run. The first failing candidate in ddmin order
+ * is picked, so the result does not depend on thread timing.
+ *
+ * Failure conditions (-p):
+ *   diverge : the selected engine and the switch interpreter reach
+ *             different final states (default)
+ *   screen  : the final screen is the same as that of the original input
+ *   crash   : the fuzzing harness crashes, aborts or hangs; each candidate
+ *             runs in a child process
+ *
+ * The harness translation unit is included directly, so that candidates are
+ * run exactly like the fuzzer runs its inputs.
+ */
+
+#include <pthread.h>    /* pthread_*                */
+#include <unistd.h>     /* fork, getopt             */
+#include <sys/wait.h>   /* waitpid                  */
+#include <string.h>     /* memcpy, memcmp, strcmp   */
+
+#include "fuzz.c"
+#include "tsc.h"
+
+#define MAX_WORKERS     64      /* upper bound on evaluation threads    */
+#define MAX_EVENTS      255     /* events that fit in an input          */
+#define MAX_INPUT       (2 + 2 * MAX_EVENTS + RAM_SZ - FUZZ_ROM_OFF)
+#define HANG_SECS       10      /* candidate run time considered a hang */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* failure conditions */
+enum {
+    PRED_DIVERGE = 0,   /* engines reach different states  */
+    PRED_SCREEN,        /* same final screen as original    */
+    PRED_CRASH,         /* harness crashes, aborts or hangs */
+};
+
+/* decoded fuzz input */
+struct input {
+    uint8_t  engines;               /* alternative engine selector */
+    uint16_t n_ev;                  /* number of key events        */
+    uint64_t frame[MAX_EVENTS];     /* absolute event frames       */
+    uint8_t  key[MAX_EVENTS];       /* key | down << 7             */
+    uint16_t rom_len;               /* ROM size [bytes]            */
+    uint8_t  rom[RAM_SZ];           /* ROM contents                */
+};
+
+/* encoded candidate and its evaluation result */
+struct cand {
+    uint8_t data[MAX_INPUT];        /* fuzz input  */
+    size_t  size;                   /* input size  */
+    uint8_t fails;                  /* result      */
+};
+
+/* evaluation thread state */
+struct worker {
+    pthread_t       tid;                        /* thread id           */
+    struct chip8_vm vm[FUZZ_ENGINES];           /* indexed by engines  */
+    struct chip8_vm cp[FUZZ_ENGINES];           /* reset checkpoints   */
+};
+
+static uint8_t       pred = PRED_DIVERGE;       /* failure condition   */
+static uint8_t       target[32 * 64];           /* PRED_SCREEN target  */
+static struct worker workers[MAX_WORKERS];      /* evaluation threads  */
+static long          n_workers;                 /* number of workers   */
+
+static struct cand   *cands;                    /* current round       */
+static uint32_t      n_cands;                   /* candidates in round */
+static uint32_t      next_cand;                 /* next to evaluate    */
+static uint32_t      first_fail;                /* earliest failing    */
+static uint64_t      n_runs;                    /* candidates run      */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* decode - unpacks a fuzz input
+ *  @data : fuzz input
+ *  @size : size of fuzz input
+ *  @in   : decoded input (output)
+ *
+ * Mirrors the truncation rules of fuzz_run().
+ */
+static void
+decode(const uint8_t *data, size_t size, struct input *in)
+{
+    uint64_t frame = 0;     /* event frame */
+
+    in->engines = data[0];
+    in->n_ev    = data[1];
+
+    if (2 + 2 * in->n_ev > size)
+        in->n_ev = (size - 2) / 2;
+
+    for (size_t i = 0; i < in->n_ev; i++) {
+        frame        += data[2 + 2 * i];
+        in->frame[i]  = frame;
+        in->key[i]    = data[3 + 2 * i];
+    }
+
+    in->rom_len = size - 2 - 2 * in->n_ev;
+    if (in->rom_len > RAM_SZ - FUZZ_ROM_OFF)
+        in->rom_len = RAM_SZ - FUZZ_ROM_OFF;
+
+    memcpy(in->rom, data + 2 + 2 * in->n_ev, in->rom_len);
+}
+
+/* encode - packs a fuzz input
+ *  @in : decoded input
+ *  @c  : candidate (output)
+ *
+ * Dropping events may merge frame deltas past 255; those are saturated.
+ * The candidate is evaluated as encoded, so this can only cost progress.
+ */
+static void
+encode(const struct input *in, struct cand *c)
+{
+    uint64_t prev = 0;      /* previous event frame */
+    uint64_t delta;         /* frame delta          */
+
+    c->data[0] = in->engines;
+    c->data[1] = in->n_ev;
+
+    for (size_t i = 0; i < in->n_ev; i++) {
+        delta = in->frame[i] - prev;
+        prev  = in->frame[i];
+
+        c->data[2 + 2 * i] = delta < 0xff ? delta : 0xff;
+        c->data[3 + 2 * i] = in->key[i];
+    }
+
+    memcpy(c->data + 2 + 2 * in->n_ev, in->rom, in->rom_len);
+    c->size = 2 + 2 * in->n_ev + in->rom_len;
+}
+
+/* fails - checks whether an input reproduces the failure
+ *  @w : worker
+ *  @c : candidate
+ *
+ *  @return : 1 if the failure condition holds
+ */
+static uint8_t
+fails(struct worker *w, const struct cand *c)
+{
+    uint8_t  engines = c->data[0] % FUZZ_ENGINES;   /* alternative engine */
+    uint64_t ref;                                   /* reference hash     */
+    pid_t    pid;                                   /* child process      */
+    int      status;                                /* child exit status  */
+
+    switch (pred) {
+        case PRED_DIVERGE:
+            if (!engines)
+                return 0;
+            ref = fuzz_run(&w->vm[0], &w->cp[0], c->data, c->size);
+            return fuzz_run(&w->vm[engines], &w->cp[engines],
+                            c->data, c->size) != ref;
+        case PRED_SCREEN:
+            fuzz_run(&w->vm[0], &w->cp[0], c->data, c->size);
+            return !memcmp(w->vm[0].pixels, target, sizeof(target));
+        case PRED_CRASH:
+            pid = fork();
+            RET(pid == -1, 0, "unable to fork (%s)", strerror(errno));
+
+            if (!pid) {
+                alarm(HANG_SECS);
+                LLVMFuzzerTestOneInput(c->data, c->size);
+                _exit(0);
+            }
+
+            RET(waitpid(pid, &status, 0) == -1, 0, "unable to wait (%s)",
+                strerror(errno));
+            return !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+
+    return 0;
+}
+
+/* worker_main - evaluates candidates of the current round
+ *  @arg : struct worker
+ *
+ *  @return : NULL
+ *
+ * Candidates past the earliest known failure are skipped; they cannot be
+ * picked anymore.
+ */
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;     /* own machines        */
+    uint32_t      i;            /* candidate index     */
+    uint32_t      first;        /* earliest failing    */
+
+    while ((i = __atomic_fetch_add(&next_cand, 1, __ATOMIC_RELAXED))
+           < n_cands)
+    {
+        if (i > __atomic_load_n(&first_fail, __ATOMIC_RELAXED))
+            break;
+
+        __atomic_add_fetch(&n_runs, 1, __ATOMIC_RELAXED);
+
+        cands[i].fails = fails(w, &cands[i]);
+        if (!cands[i].fails)
+            continue;
+
+        first = __atomic_load_n(&first_fail, __ATOMIC_RELAXED);
+        while (i < first && !__atomic_compare_exchange_n(&first_fail, &first,
+                    i, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    return NULL;
+}
+
+/* eval_round - evaluates candidates in parallel
+ *  @n : number of candidates (in cands)
+ *
+ *  @return : index of first failing candidate or n if none fails
+ */
+static uint32_t
+eval_round(uint32_t n)
+{
+    long    started = 0;    /* workers started */
+    int32_t ans;            /* answer          */
+
+    n_cands    = n;
+    next_cand  = 0;
+    first_fail = n;
+
+    for (; started < n_workers; started++) {
+        ans = pthread_create(&workers[started].tid, NULL, worker_main,
+                             &workers[started]);
+        if (ans) {
+            WAR("unable to create worker (%s)", strerror(ans));
+            break;
+        }
+    }
+
+    if (!started)
+        worker_main(&workers[0]);
+
+    for (long i = 0; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    return first_fail;
+}
+
+/* apply - builds an input that keeps only some units of another
+ *  @base  : input being minimized
+ *  @out   : reduced input (output)
+ *  @rom   : 1 if units are ROM words, 0 if they are key events
+ *  @units : indices of units to keep (increasing)
+ *  @n     : number of units to keep
+ *
+ * Units that are not kept are dropped (events) or zeroed (ROM words).
+ */
+static void
+apply(const struct input *base, struct input *out, uint8_t rom,
+      const uint16_t *units, uint32_t n)
+{
+    memcpy(out, base, sizeof(*out));
+
+    if (!rom) {
+        for (uint32_t i = 0; i < n; i++) {
+            out->frame[i] = base->frame[units[i]];
+            out->key[i]   = base->key[units[i]];
+        }
+        out->n_ev = n;
+        return;
+    }
+
+    memset(out->rom, 0, sizeof(out->rom));
+    for (uint32_t i = 0; i < n; i++)
+        memcpy(out->rom + 2 * units[i], base->rom + 2 * units[i], 2);
+}
+
+/* ddmin - minimizes the set of events or non-zero ROM words of an input
+ *  @in  : input (updated in place)
+ *  @rom : 1 to minimize ROM words, 0 to minimize key events
+ *
+ *  @return : 1 if the input was reduced
+ *
+ * Each round tests, in order, every one of the g chunks of the current unit
+ * set and every complement of a chunk. The first failing subset restarts
+ * the search with g = 2; the first failing complement with g - 1 chunks.
+ * Otherwise, the granularity is doubled until chunks are single units.
+ */
+static uint8_t
+ddmin(struct input *in, uint8_t rom)
+{
+    static uint16_t units[RAM_SZ / 2];          /* units kept so far    */
+    static uint16_t tmp[RAM_SZ / 2];            /* candidate unit set   */
+    static struct input cand;                   /* candidate input      */
+    uint32_t        n = 0;                      /* units kept so far    */
+    uint32_t        n0;                         /* units at start       */
+    uint32_t        g = 2;                      /* granularity          */
+    uint32_t        n_tests;                    /* candidates in round  */
+    uint32_t        hit;                        /* first failing        */
+    uint32_t        lo, hi;                     /* chunk bounds         */
+    uint32_t        k;                          /* candidate unit count */
+
+    /* collect units */
+    if (!rom) {
+        for (uint32_t i = 0; i < in->n_ev; i++)
+            units[n++] = i;
+    } else {
+        for (uint32_t i = 0; i < (in->rom_len + 1u) / 2; i++)
+            if (in->rom[2 * i] || in->rom[2 * i + 1])
+                units[n++] = i;
+    }
+    n0 = n;
+
+    while (n >= 1) {
+        g       = g < n ? g : n;
+        n_tests = g == 1 ? 1 : g > 2 ? 2 * g : g;
+
+        /* subsets first, then complements (for g == 2, those coincide); *
+         * the last subset of the g == 1 round is the empty unit set     */
+        for (uint32_t t = 0; t < n_tests; t++) {
+            uint32_t c = t % g;     /* chunk index */
+
+            lo = (uint64_t) n * c / g;
+            hi = (uint64_t) n * (c + 1) / g;
+            k  = 0;
+
+            if (g == 1) {
+                /* k = 0: try removing everything */
+            } else if (t < g) {
+                for (uint32_t i = lo; i < hi; i++)
+                    tmp[k++] = units[i];
+            } else {
+                for (uint32_t i = 0; i < n; i++)
+                    if (i < lo || i >= hi)
+                        tmp[k++] = units[i];
+            }
+
+            apply(in, &cand, rom, tmp, k);
+            encode(&cand, &cands[t]);
+        }
+
+        hit = eval_round(n_tests);
+
+        if (hit == n_tests) {
+            if (g >= n)
+                break;
+            g = 2 * g < n ? 2 * g : n;
+            continue;
+        }
+
+        /* rebuild the unit set of the failing candidate */
+        {
+            uint32_t c = hit % g;   /* chunk index */
+
+            lo = (uint64_t) n * c / g;
+            hi = (uint64_t) n * (c + 1) / g;
+            k  = 0;
+
+            if (g == 1) {
+                /* nothing kept */
+            } else if (hit < g) {
+                for (uint32_t i = lo; i < hi; i++)
+                    tmp[k++] = units[i];
+                g = 2;
+            } else {
+                for (uint32_t i = 0; i < n; i++)
+                    if (i < lo || i >= hi)
+                        tmp[k++] = units[i];
+                g = g - 1 > 2 ? g - 1 : 2;
+            }
+        }
+
+        /* units are indices into the original input; apply only at the end */
+        memcpy(units, tmp, k * sizeof(*units));
+        n = k;
+
+        if (!n)
+            break;
+    }
+
+    apply(in, &cand, rom, units, n);
+    memcpy(in, &cand, sizeof(*in));
+
+    return n < n0;
+}
+
+/* rom_words - counts the non-zero instruction words of a ROM
+ *  @in : input
+ *
+ *  @return : number of non-zero words
+ */
+static uint32_t
+rom_words(const struct input *in)
+{
+    uint32_t n = 0;     /* non-zero words */
+
+    for (uint32_t i = 0; i < (in->rom_len + 1u) / 2; i++)
+        n += in->rom[2 * i] || in->rom[2 * i + 1];
+
+    return n;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* main - minimizes one failing fuzz input
+ *  @argc : number of arguments
+ *  @argv : [-p diverge|screen|crash] [-j THREADS] IN OUT
+ *
+ *  @return : 0 if everything went well
+ */
+int32_t main(int32_t argc, char *argv[])
+{
+    static struct input in;                 /* input being minimized */
+    static struct cand  orig;               /* original input        */
+    FILE                *f;                 /* input / output file   */
+    uint64_t            t0;                 /* start time            */
+    uint32_t            words0, events0;    /* original unit counts  */
+    size_t              size0;              /* original input size   */
+    uint8_t             progress;           /* last pass reduced     */
+    int32_t             ans;                /* answer                */
+    int                 opt;                /* CLI option            */
+
+    tsc_init();
+    t0        = tsc_ns();
+    n_workers = 0;
+
+    while ((opt = getopt(argc, argv, "p:j:")) != -1) {
+        switch (opt) {
+            case 'p':
+                pred = !strcmp(optarg, "diverge") ? PRED_DIVERGE
+                     : !strcmp(optarg, "screen")  ? PRED_SCREEN
+                     : !strcmp(optarg, "crash")   ? PRED_CRASH
+                     : 0xff;
+                RET(pred == 0xff, -1, "unknown failure condition: %s",
+                    optarg);
+                break;
+            case 'j':
+                n_workers = atol(optarg);
+                break;
+            default:
+                RET(1, -1, "usage: %s [-p diverge|screen|crash] "
+                    "[-j THREADS] IN OUT", argv[0]);
+        }
+    }
+    RET(argc - optind != 2, -1, "usage: %s [-p diverge|screen|crash] "
+        "[-j THREADS] IN OUT", argv[0]);
+
+    n_workers = worker_count(n_workers, MAX_WORKERS);
+
+    /* read original input */
+    f = fopen(argv[optind], "rb");
+    RET(!f, -1, "unable to open %s (%s)", argv[optind], strerror(errno));
+    orig.size = fread(orig.data, 1, sizeof(orig.data), f);
+    fclose(f);
+    RET(orig.size < 2, -1, "input is too short");
+
+    decode(orig.data, orig.size, &in);
+    encode(&in, &orig);
+
+    /* each round has at most two candidates per unit */
+    cands = calloc(RAM_SZ, sizeof(*cands));
+    RET(!cands, -1, "unable to allocate candidates (%s)", strerror(errno));
+
+    for (long i = 0; i < n_workers; i++) {
+        for (size_t j = 0; j < FUZZ_ENGINES; j++) {
+            ans  = vm_init(&workers[i].vm[j], FUZZ_FREQ, FUZZ_FONT_OFF, 0,
+                           j, 0);
+            ans |= vm_init(&workers[i].cp[j], FUZZ_FREQ, FUZZ_FONT_OFF, 0,
+                           0, 0);
+            DIE(ans, "unable to initialize machines");
+
+            vm_checkpoint(&workers[i].vm[j], &workers[i].cp[j]);
+        }
+    }
+
+    /* set up the harness machines; forked children inherit them, so *
+     * they never need to take the RAM allocator lock                 */
+    if (pred == PRED_CRASH)
+        fuzz_init();
+
+    if (pred == PRED_SCREEN) {
+        fuzz_run(&workers[0].vm[0], &workers[0].cp[0], orig.data, orig.size);
+        memcpy(target, workers[0].vm[0].pixels, sizeof(target));
+    }
+
+    RET(!fails(&workers[0], &orig), -1, "original input does not fail");
+
+    size0   = orig.size;
+    events0 = in.n_ev;
+    words0  = rom_words(&in);
+
+    do {
+        progress  = ddmin(&in, 0);
+        progress |= ddmin(&in, 1);
+    } while (progress);
+
+    /* zeroed words at the end of the ROM need not be stored at all */
+    while (in.rom_len && !in.rom[in.rom_len - 1])
+        in.rom_len--;
+
+    encode(&in, &orig);
+    RET(!fails(&workers[0], &orig), -1, "trimmed input no longer fails");
+
+    f = fopen(argv[optind + 1], "wb");
+    RET(!f, -1, "unable to open %s (%s)", argv[optind + 1], strerror(errno));
+    fwrite(orig.data, 1, orig.size, f);
+    fclose(f);
+
+    INFO("%lu -> %lu bytes, %u -> %u events, %u -> %u ROM words",
+         size0, orig.size, events0, in.n_ev, words0, rom_words(&in));
+    INFO("%lu candidates on %ld threads in %.3fs", n_runs, n_workers,
+         (tsc_ns() - t0) / 1e9);
+
+    free(cands);
+
+    return 0;
+}
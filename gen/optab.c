@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Build-time generator of the opcode decoding table.
+ *
+ * Decodes every possible 16-bit instruction and prints the initializer of
+ * a 65536-entry struct opcode array to stdout. The emulator includes the
+ * output in its .rodata (see exec_ins()), so decoding at runtime is reduced
+ * to a single indexed load. The table does not depend on ROM contents.
+ */
+
+#include <stdio.h>      /* printf */
+
+#include "optab.h"
+
+/* handler names, as printed in the generated table */
+static const char *op_names[OP_MAX] = {
+    [OP_UNK]  = "OP_UNK",
+    [OP_00E0] = "OP_00E0", [OP_00EE] = "OP_00EE", [OP_01X0] = "OP_01X0",
+    [OP_01X1] = "OP_01X1", [OP_02NN] = "OP_02NN", [OP_03NN] = "OP_03NN",
+    [OP_1NNN] = "OP_1NNN", [OP_2NNN] = "OP_2NNN", [OP_3XKK] = "OP_3XKK",
+    [OP_4XKK] = "OP_4XKK", [OP_5XY0] = "OP_5XY0", [OP_6XKK] = "OP_6XKK",
+    [OP_7XKK] = "OP_7XKK", [OP_8XY0] = "OP_8XY0", [OP_8XY1] = "OP_8XY1",
+    [OP_8XY2] = "OP_8XY2", [OP_8XY3] = "OP_8XY3", [OP_8XY4] = "OP_8XY4",
+    [OP_8XY5] = "OP_8XY5", [OP_8XY6] = "OP_8XY6", [OP_8XY7] = "OP_8XY7",
+    [OP_8XYE] = "OP_8XYE", [OP_9XY0] = "OP_9XY0", [OP_ANNN] = "OP_ANNN",
+    [OP_BNNN] = "OP_BNNN", [OP_CXKK] = "OP_CXKK", [OP_DXYN] = "OP_DXYN",
+    [OP_EX9E] = "OP_EX9E", [OP_EXA1] = "OP_EXA1", [OP_F002] = "OP_F002",
+    [OP_FX07] = "OP_FX07", [OP_FX0A] = "OP_FX0A", [OP_FX15] = "OP_FX15",
+    [OP_FX18] = "OP_FX18", [OP_FX1E] = "OP_FX1E", [OP_FX29] = "OP_FX29",
+    [OP_FX33] = "OP_FX33", [OP_FX3A] = "OP_FX3A", [OP_FX55] = "OP_FX55",
+    [OP_FX65] = "OP_FX65",
+};
+
+/* decode - determines the handler of an instruction
+ *  @ins : instruction (host byte order)
+ *
+ *  @return : OP_* handler
+ */
+static uint8_t
+decode(uint16_t ins)
+{
+    /* handlers of 8XY? by last nibble */
+    static const uint8_t alu[16] = {
+        [0x0] = OP_8XY0, [0x1] = OP_8XY1, [0x2] = OP_8XY2, [0x3] = OP_8XY3,
+        [0x4] = OP_8XY4, [0x5] = OP_8XY5, [0x6] = OP_8XY6, [0x7] = OP_8XY7,
+        [0xe] = OP_8XYE,
+    };
+
+    /* decode the instruction by class (first nibble) */
+    switch (ins >> 12) {
+        case 0x0:
+            /* 01X0 - 03NN: debug extension, unused by known variants */
+            return ins == 0x00e0            ? OP_00E0
+                 : ins == 0x00ee            ? OP_00EE
+                 : (ins & 0xff0f) == 0x0100 ? OP_01X0
+                 : (ins & 0xff0f) == 0x0101 ? OP_01X1
+                 : (ins & 0xff00) == 0x0200 ? OP_02NN
+                 : (ins & 0xff00) == 0x0300 ? OP_03NN
+                 : OP_UNK;
+        case 0x1: return OP_1NNN;
+        case 0x2: return OP_2NNN;
+        case 0x3: return OP_3XKK;
+        case 0x4: return OP_4XKK;
+        case 0x5: return (ins & 0x000f) == 0x0 ? OP_5XY0 : OP_UNK;
+        case 0x6: return OP_6XKK;
+        case 0x7: return OP_7XKK;
+        case 0x8: return alu[ins & 0x000f];
+        case 0x9: return (ins & 0x000f) == 0x0 ? OP_9XY0 : OP_UNK;
+        case 0xa: return OP_ANNN;
+        case 0xb: return OP_BNNN;
+        case 0xc: return OP_CXKK;
+        case 0xd: return OP_DXYN;
+        case 0xe:
+            switch (ins & 0x00ff) {
+                case 0x9e: return OP_EX9E;
+                case 0xa1: return OP_EXA1;
+            }
+            return OP_UNK;
+        case 0xf:
+            switch (ins & 0x00ff) {
+                case 0x02: return (ins & 0x0f00) ? OP_UNK : OP_F002;
+                case 0x07: return OP_FX07;
+                case 0x0a: return OP_FX0A;
+                case 0x15: return OP_FX15;
+                case 0x18: return OP_FX18;
+                case 0x1e: return OP_FX1E;
+                case 0x29: return OP_FX29;
+                case 0x33: return OP_FX33;
+                case 0x3a: return OP_FX3A;
+                case 0x55: return OP_FX55;
+                case 0x65: return OP_FX65;
+            }
+            return OP_UNK;
+    }
+
+    return OP_UNK;
+}
+
+/* main - prints the decoding table
+ *  @return : 0
+ */
+int32_t main(void)
+{
+    printf("/* generated by gen/optab.c; do not edit */\n");
+
+    for (uint32_t ins = 0; ins <= 0xffff; ins++)
+        printf("[0x%04x] = { %s, 0x%x, 0x%x, 0x%02x },\n", ins,
+               op_names[decode(ins)], (ins >> 8) & 0x0f, (ins >> 4) & 0x0f,
+               ins & 0xff);
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _CATALOG_H
+#define _CATALOG_H
+
+/* public API */
+int32_t catalog_roms(char **, uint32_t, const char *, uint16_t, uint16_t,
+                     uint16_t, uint8_t, uint64_t);
+
+#endif /* _CATALOG_H */
@@ -5,7 +5,10 @@
 #define _CLI_ARGS_H
 
 struct user_settings {
-    char     *rom_path;        /* location of ROM file                        */
+    char     *rom_path;        /* location of (first) ROM file                */
+    char     **rom_paths;      /* locations of all ROM files                  */
+    uint32_t rom_count;        /* number of ROM files                         */
+    uint64_t frames;           /* number of frames to run per ROM (batch)     */
     int32_t  audio_idx;        /* audio device index                          */
     float    tone_freq;        /* buzzer tone frequency                       */
     uint16_t rom_off;          /* RAM offset at which the ROM is loaded       */
@@ -13,8 +16,31 @@ struct user_settings {
     uint16_t scale_f;          /* window scale factor                         */
     uint16_t frequency;        /* CPU frequency                               */
     uint16_t ref_int;          /* screen refresh interval                     */
+    uint16_t stats_int;        /* frame budget summary interval [s]           */
+    uint32_t soak_secs;        /* soak test duration [s] (0 = unlimited)      */
+    char     *soak_csv;        /* soak test telemetry output file             */
+    char     *catalog;         /* ROM library index output file (or NULL)     */
+    uint32_t sessions;         /* live headless machines to host (0 = off)    */
+    char     *session_in;      /* hosted session key input socket (or NULL)   */
+    char     *hash_stream;     /* per-frame state hash output file (or NULL)  */
+    char     *hash_cmp;        /* state hash stream to compare (or NULL)      */
+    char     *dataset;         /* training data output directory (or NULL)    */
+    char     *policy;          /* training data input policy                  */
+    char     *ram_bytes;       /* RAM addresses sampled in training data      */
+    uint32_t episodes;         /* training data episodes per ROM              */
+    uint8_t  phosphor;         /* presented frames to blend (0 = off)         */
     uint8_t  new_shift : 1;    /* use new implementation of shift operations  */
     uint8_t  lazy_render : 1;  /* refresh screen only on DXYN (not regularly) */
+    uint8_t  fuse : 1;         /* execute common sequences as one            */
+    uint8_t  ir : 1;           /* execute straight-line code as IR blocks    */
+    uint8_t  vsync : 1;        /* present once per display refresh           */
+    uint8_t  soak : 1;         /* sample resource usage, fail on growth      */
+    uint8_t  soak_uncap : 1;   /* soak test with CPU not bound to timer      */
+    uint8_t  auto_freq : 1;    /* lower CPU rate while the ROM is waiting    */
+    uint8_t  debug_ops : 1;    /* enable in-ROM timing opcodes               */
+    uint8_t  phos_decay : 1;   /* fade blended frames by age                 */
+    uint8_t  evdev : 1;        /* read keys from evdev devices, not SDL      */
+    uint8_t  validate;         /* ENGINE_* flags to validate (0 = off)        */
 };
 
 extern struct argp          argp;
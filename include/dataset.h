@@ -0,0 +1,16 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _DATASET_H
+#define _DATASET_H
+
+#define DS_SHARD_ROWS   (1 << 16)   /* records per shard file           */
+#define DS_HDR_SZ       256         /* .npy header size (multiple of 64) */
+#define DS_RAM_MAX      64          /* max RAM bytes sampled per record  */
+#define DS_SCRIPT_MAX   4096        /* max input script entries          */
+
+/* public API */
+int32_t dataset_gen(char **, uint32_t, const char *, const char *,
+                    const char *, uint32_t, uint16_t, uint16_t, uint16_t,
+                    uint8_t, uint64_t);
+
+#endif /* _DATASET_H */
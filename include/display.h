@@ -1,13 +1,38 @@
 #include <stdint.h>
+#include <string.h>     /* memcpy */
 
 #ifndef _DISPLAY_H
 #define _DISPLAY_H
 
+#define PERSIST_MAX     8   /* most frames blended by the phosphor filter */
+
+/* pack_frame - converts a screen to one bit per pixel
+ *  @pixels : logical screen state (64x32 bytes, each 0 or 1)
+ *  @out    : packed screen (32x8 bytes)
+ *  @msb    : 1 to store the leftmost of every 8 pixels in the MSB, 0 for LSB
+ *
+ * Every 8 pixels are gathered into one byte by a single multiplication:
+ * the bits of the constant move each pixel byte to a distinct bit of the
+ * most significant byte, without any carries. The two constants place the
+ * pixels in opposite orders.
+ */
+static inline void
+pack_frame(const uint8_t *pixels, uint8_t *out, uint8_t msb)
+{
+    uint64_t w;     /* 8 pixels */
+
+    for (size_t i = 0; i < 32 * 8; i++) {
+        memcpy(&w, pixels + i * 8, sizeof(w));
+        out[i] = w * (msb ? 0x8040201008040201UL : 0x0102040810204080UL)
+               >> 56;
+    }
+}
+
 /* public API */
-int32_t init_display(uint16_t);
+int32_t init_display(uint16_t, uint8_t, uint8_t, uint8_t);
 void    clear_screen(void);
-uint8_t display_sprite(uint8_t, uint8_t, uint8_t *, uint8_t);
-void    refresh_display(void);
+uint8_t display_sprite(uint8_t *, uint8_t, uint8_t, uint8_t *, uint8_t);
+void    refresh_display(const uint8_t *);
 
 #endif /* _DISPLAY_H */
 
@@ -0,0 +1,13 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _EVDEV_H
+#define _EVDEV_H
+
+#define EVDEV_DIR       "/dev/input"    /* where event devices appear      */
+#define EVDEV_MAX       32              /* max simultaneously open devices */
+
+/* public API */
+int32_t evdev_start(const uint32_t *, uint8_t, void (*)(uint8_t, uint8_t));
+void    evdev_stop(void);
+
+#endif /* _EVDEV_H */
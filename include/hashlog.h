@@ -0,0 +1,28 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _HASHLOG_H
+#define _HASHLOG_H
+
+#define HASHLOG_MAGIC   0x53483843  /* "C8HS" (little endian)      */
+#define HASHLOG_VERSION 2           /* stream format version       */
+#define HASHLOG_CHUNK   4096        /* hashes read / written at once */
+
+/* stream header; followed by one little endian 64-bit hash per frame */
+struct hashlog_hdr {
+    uint32_t magic;         /* HASHLOG_MAGIC                    */
+    uint16_t version;       /* HASHLOG_VERSION                  */
+    uint16_t freq;          /* CPU frequency                    */
+    uint16_t rom_off;       /* ROM map offset into RAM          */
+    uint16_t font_off;      /* font sprites offset into RAM     */
+    uint8_t  new_shift;     /* new shift operations             */
+    uint8_t  engines;       /* ENGINE_* flags of the recording  */
+    uint8_t  _pad[2];       /* reserved (0)                     */
+    uint64_t rom_hash;      /* FNV-1a hash of the ROM image     */
+};
+
+/* public API */
+int32_t hash_record(const char *, const char *, uint16_t, uint16_t, uint16_t,
+                    uint8_t, uint8_t, uint64_t);
+int32_t hash_compare(const char *, const char *);
+
+#endif /* _HASHLOG_H */
@@ -0,0 +1,26 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#define INGEST_BUFS     64      /* ROM images in flight (power of 2)  */
+#define INGEST_BUF_SZ   4096    /* size of one registered buffer      */
+
+/* ROM image handed over by the ingest thread */
+struct rom_image {
+    const char *path;   /* path to ROM file                      */
+    uint8_t    *data;   /* ROM contents (valid until released)   */
+    int32_t    len;     /* ROM size [bytes] or -1 on error       */
+    uint32_t   rom;     /* index of ROM in path list             */
+    uint32_t   idx;     /* buffer index                          */
+};
+
+struct ingest;
+
+/* public API */
+struct ingest *ingest_start(char **, uint32_t);
+int32_t       ingest_next(struct ingest *, struct rom_image *);
+void          ingest_release(struct ingest *, struct rom_image *);
+void          ingest_stop(struct ingest *);
+
+#endif /* _INGEST_H */
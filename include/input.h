@@ -0,0 +1,26 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#define INPUT_QUEUE_SZ  256     /* max pending events (power of 2) */
+
+/* key state change, visible to the core starting with a given cycle */
+struct input_event {
+    uint64_t cycle;     /* emulated cycle of visibility */
+    uint8_t  key;       /* chip8 key index              */
+    uint8_t  down;      /* 1 if pressed, 0 if released  */
+};
+
+/* single producer, single consumer lock-free event queue */
+struct input_queue {
+    struct input_event ev[INPUT_QUEUE_SZ];  /* ring buffer            */
+    uint32_t           head;                /* next event to consume  */
+    uint32_t           tail;                /* next free slot         */
+};
+
+/* public API */
+int32_t input_push(struct input_queue *, uint64_t, uint8_t, uint8_t);
+int32_t input_pop(struct input_queue *, uint64_t, struct input_event *);
+
+#endif /* _INPUT_H */
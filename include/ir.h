@@ -0,0 +1,20 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#include "system.h"
+
+#ifndef _IR_H
+#define _IR_H
+
+#define IR_MAX_LEN  32      /* max number of instructions per block */
+
+struct ir_cache;
+
+/* public API */
+struct ir_cache *ir_cache_create(uint8_t, uint16_t);
+void             ir_cache_destroy(struct ir_cache *);
+void             ir_invalidate(struct ir_cache *, uint16_t, uint16_t);
+uint8_t          ir_exec(struct ir_cache *, uint8_t *, struct chip8_regs *,
+                         uint64_t);
+void             ir_report(struct ir_cache *);
+
+#endif /* _IR_H */
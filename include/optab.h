@@ -0,0 +1,60 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _OPTAB_H
+#define _OPTAB_H
+
+/* instruction handlers, in opcode order */
+enum {
+    OP_UNK = 0,     /* undecodable instruction */
+    OP_00E0,
+    OP_00EE,
+    OP_01X0,        /* debug extension: CYC Vx   */
+    OP_01X1,        /* debug extension: NSEC Vx  */
+    OP_02NN,        /* debug extension: BEGIN NN */
+    OP_03NN,        /* debug extension: END NN   */
+    OP_1NNN,
+    OP_2NNN,
+    OP_3XKK,
+    OP_4XKK,
+    OP_5XY0,
+    OP_6XKK,
+    OP_7XKK,
+    OP_8XY0,
+    OP_8XY1,
+    OP_8XY2,
+    OP_8XY3,
+    OP_8XY4,
+    OP_8XY5,
+    OP_8XY6,
+    OP_8XY7,
+    OP_8XYE,
+    OP_9XY0,
+    OP_ANNN,
+    OP_BNNN,
+    OP_CXKK,
+    OP_DXYN,
+    OP_EX9E,
+    OP_EXA1,
+    OP_F002,
+    OP_FX07,
+    OP_FX0A,
+    OP_FX15,
+    OP_FX18,
+    OP_FX1E,
+    OP_FX29,
+    OP_FX33,
+    OP_FX3A,
+    OP_FX55,
+    OP_FX65,
+    OP_MAX,
+};
+
+/* decoded instruction; NNN = x << 8 | kk, N = kk & 0x0f */
+struct opcode {
+    uint8_t op;     /* OP_* handler  */
+    uint8_t x;      /* Vx reg index  */
+    uint8_t y;      /* Vy reg index  */
+    uint8_t kk;     /* ls 2 nibbles  */
+};
+
+#endif /* _OPTAB_H */
@@ -0,0 +1,10 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+/* public API */
+int32_t host_sessions(char **, uint32_t, uint32_t, uint16_t, uint16_t,
+                      uint16_t, uint8_t, uint64_t, char *);
+
+#endif /* _SESSION_H */
@@ -0,0 +1,18 @@
+#include <stdint.h>     /* [u]int*_t */
+#include <stddef.h>     /* size_t    */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#define SLAB_ARENA_SZ   (2UL << 20)     /* one huge page            */
+#define SLAB_ALIGN      64              /* object alignment (cache) */
+
+struct slab;
+
+/* public API */
+struct slab *slab_create(size_t);
+void        *slab_alloc(struct slab *);
+void        slab_free(struct slab *, void *);
+void        slab_destroy(struct slab *);
+
+#endif /* _SLAB_H */
@@ -0,0 +1,14 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _SOAK_H
+#define _SOAK_H
+
+#define SOAK_WARMUP         30      /* samples before baseline is fixed   */
+#define SOAK_RSS_SLACK_KB   8192    /* tolerated RSS growth [KB]          */
+#define SOAK_THREAD_SLACK   8       /* tolerated thread count growth      */
+
+/* public API */
+int32_t soak_start(uint32_t, const char *);
+int32_t soak_stop(void);
+
+#endif /* _SOAK_H */
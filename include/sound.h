@@ -5,11 +5,18 @@
 
 #define Fs  44100       /* audio sample rate [Hz] */
 
+#define PATTERN_BITS    128     /* XO-CHIP audio pattern length     */
+#define PATTERN_PITCH   64      /* XO-CHIP default pitch (4000 Hz)  */
+
 /* public API */
 int32_t init_audio(int32_t, float);
 int32_t terminate_audio(void);
 int32_t list_audio_devs(void);
 int32_t start_playback(void);
 int32_t stop_playback(void);
+void    set_audio_pattern(const uint8_t *);
+void    set_audio_pitch(uint8_t);
+void    set_audio_speed(double);
+void    set_audio_muted(uint8_t);
 
 #endif
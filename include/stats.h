@@ -0,0 +1,25 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+/* host time accounting sections */
+enum {
+    STATS_CORE = 0,     /* instruction execution */
+    STATS_RENDER,       /* screen refresh        */
+    STATS_FRAME,        /* per-frame work        */
+    STATS_EVENTS,       /* UI event handling     */
+    STATS_SECTIONS,
+};
+
+/* public API */
+int32_t  stats_init(uint16_t, uint16_t);
+uint64_t stats_now(void);
+uint64_t stats_add(uint8_t, uint64_t);
+void     stats_cycles(uint32_t);
+void     stats_dropped(void);
+void     stats_retune(uint16_t);
+void     stats_region(uint8_t, uint8_t, uint64_t);
+void     stats_report(void);
+
+#endif /* _STATS_H */
@@ -1,4 +1,7 @@
 #include <stdint.h>     /* [u]int*_t */
+#include <stddef.h>     /* size_t    */
+
+#include "input.h"
 
 #ifndef _SYSTEM_H
 #define _SYSTEM_H
@@ -20,9 +23,79 @@ struct chip8_regs {
 
 #define VF V[15]
 
+/* execution engines that may run alongside the switch interpreter */
+#define ENGINE_FUSE 0x01    /* superinstructions    */
+#define ENGINE_IR   0x02    /* optimized IR blocks  */
+
+/* write journal: RAM is tracked in 64 blocks (one bit each), the rest of *
+ * the state by the DIRTY_* flags                                          */
+#define DIRTY_BLK_SZ    (RAM_SZ / 64)   /* bytes per RAM block            */
+#define DIRTY_SCREEN    0x01            /* screen state                   */
+#define DIRTY_REGS      0x02            /* registers, stack, counters     */
+#define DIRTY_ALL       (DIRTY_SCREEN | DIRTY_REGS)
+
+struct ir_cache;
+
+/* emulated machine                                                         *
+ * NOTE: a headless machine has no display, audio or wall clock timers; DT *
+ *       and ST are decremented every CPU_FREQ/60 cycles instead            */
+struct chip8_vm {
+    /* hot: touched by every cycle; fits in the first cache line */
+    struct chip8_regs  regs;            /* system registers              */
+    uint8_t            stall;           /* cycles owed to a fused run    */
+    uint8_t            headless;        /* timers driven by cycle count  */
+    uint8_t            fuse;            /* use superinstructions         */
+    uint8_t            new_shift;       /* use new shift operations      */
+    uint8_t            skip_idle;       /* fast-forward idle loops       */
+    uint8_t            idle_loop;       /* length of suspected idle loop */
+    uint16_t           font_offset;     /* font sprites offset in RAM    */
+    uint8_t            *ram;            /* system RAM                    */
+    uint64_t           cycles;          /* executed cycles               */
+    uint64_t           batch_cycles;    /* cycles per 60Hz frame         */
+    struct ir_cache    *ir_cache;       /* optimized blocks (if any)     */
+
+    /* warm: touched by some instruction classes */
+    uint8_t            *fuse_map;       /* superinstruction per address  */
+    uint16_t           stack[16];       /* system stack (out-of-RAM)     */
+    uint64_t           rng;             /* xorshift RNG state            */
+    uint64_t           idle_cycles;     /* spent polling DT / waiting    */
+    uint64_t           dt_poll_cycle;   /* cycle of most recent FX07     */
+    uint16_t           dt_poll_pc;      /* PC at most recent FX07        */
+    uint8_t            dt_poll_val;     /* value read by recent FX07     */
+    uint8_t            key_state[16];   /* key state                     */
+    uint16_t           key_edges;       /* keys pressed since last poll  */
+    uint16_t           keys_polled;     /* keys tested by EX9E / EXA1    */
+    uint8_t            key_waited;      /* FX0A was executed             */
+    uint8_t            sound_used;      /* ST set or audio pattern load  */
+    uint8_t            debug_ops;       /* timing debug extension on     */
+    uint64_t           bad_ins;         /* undecodable instructions      */
+    uint64_t           dirty_ram;       /* RAM blocks written since cp   */
+    uint8_t            dirty;           /* DIRTY_* since checkpoint      */
+    size_t             *fuse_hits;      /* executions per kind           */
+    uint8_t            pixels[32 * 64]; /* logical screen state          */
+    struct input_queue input_q;         /* pending key state changes     */
+};
+
 /* public API */
-int32_t init_system(uint16_t, uint16_t, char *, uint16_t, uint8_t, uint8_t);
-int32_t sys_start(uint16_t, uint16_t);
+int32_t  init_system(uint16_t, uint16_t, uint16_t, char *, uint16_t, uint8_t,
+                     uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t,
+                     uint8_t, uint8_t);
+int32_t  sys_start(uint16_t, uint16_t);
+void     sys_stop(void);
+uint64_t sys_cycles(void);
+
+int32_t  read_rom(const char *, uint8_t *, size_t);
+int32_t  vm_init(struct chip8_vm *, uint16_t, uint16_t, uint8_t, uint8_t,
+                 uint64_t);
+int32_t  vm_load(struct chip8_vm *, const uint8_t *, size_t, uint16_t);
+void     vm_run(struct chip8_vm *, uint64_t);
+uint64_t vm_hash(struct chip8_vm *);
+void     vm_restore(struct chip8_vm *, const struct chip8_vm *);
+void     vm_checkpoint(struct chip8_vm *, struct chip8_vm *);
+void     vm_rollback(struct chip8_vm *, const struct chip8_vm *);
+void     vm_free(struct chip8_vm *);
+struct chip8_vm *vm_alloc(void);
+void     vm_release(struct chip8_vm *);
 
 #endif /* _SYSTEM_H */
 
@@ -0,0 +1,13 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _TSC_H
+#define _TSC_H
+
+#define TSC_CALIB_NS    20000000UL  /* calibration window [ns] */
+
+/* public API */
+void     tsc_init(void);
+uint64_t tsc_ns(void);
+uint64_t tsc_hz(void);
+
+#endif /* _TSC_H */
@@ -2,6 +2,7 @@
 #include <stdlib.h>     /* exit     */
 #include <errno.h>      /* errno    */
 #include <string.h>     /* strerror */
+#include <unistd.h>     /* sysconf  */
 
 #ifndef _UTIL_H
 #define _UTIL_H
@@ -70,6 +71,21 @@
         }                            \
     } while (0)
 
+/* worker_count - picks the number of worker threads for a batch job
+ *  @req : requested number of workers (<= 0 for one per online CPU)
+ *  @max : upper bound
+ *
+ *  @return : number of workers, between 1 and @max
+ */
+static inline long
+worker_count(long req, long max)
+{
+    if (req <= 0)
+        req = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return req < 1 ? 1 : req > max ? max : req;
+}
+
 #endif
 
 /* [warning] no assertion, just print */
@@ -0,0 +1,12 @@
+#include <stdint.h>     /* [u]int*_t */
+
+#ifndef _VALIDATE_H
+#define _VALIDATE_H
+
+#define VALIDATE_RING_SZ    1024    /* max blocks in flight (power of 2) */
+
+/* public API */
+int32_t validate_roms(char **, uint32_t, uint8_t, uint16_t, uint16_t,
+                      uint16_t, uint8_t, uint64_t);
+
+#endif /* _VALIDATE_H */
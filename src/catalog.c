@@ -0,0 +1,331 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>    /* pthread_*                  */
+#include <stdlib.h>     /* calloc, free               */
+#include <stdio.h>      /* fopen, fprintf             */
+#include <string.h>     /* memcmp, memcpy, strerror   */
+#include <errno.h>      /* errno                      */
+#include <math.h>       /* log2                       */
+
+#include "catalog.h"
+#include "display.h"
+#include "ingest.h"
+#include "system.h"
+#include "util.h"
+
+#define MAX_WORKERS     64      /* upper bound on emulation threads */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* metadata of one ROM */
+struct rom_info {
+    uint8_t  valid;             /* ROM was loaded and run         */
+    uint8_t  thumb[32 * 8];     /* most detailed frame (1 bpp)    */
+    double   entropy;           /* thumbnail entropy [bits]       */
+    double   fps;               /* screen updates per second      */
+    uint16_t keys_polled;       /* keys tested by EX9E / EXA1     */
+    uint8_t  key_waited;        /* waits for key presses (FX0A)   */
+    uint8_t  sound_used;        /* uses the buzzer / audio        */
+    uint64_t bad_ins;           /* undecodable instructions       */
+};
+
+/* catalog generation job, shared by all workers */
+struct job {
+    struct ingest   *ing;       /* ROM ingest pipeline          */
+    struct rom_info *info;      /* per ROM results              */
+    uint16_t        freq;       /* CPU frequency                */
+    uint16_t        rom_off;    /* ROM map offset into RAM      */
+    uint16_t        font_off;   /* font sprites offset into RAM */
+    uint8_t         new_shift;  /* use new shift operations     */
+    uint64_t        frames;     /* 60Hz frames to run per ROM   */
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* frame_entropy - estimates how much detail a screen holds
+ *  @packed : packed screen (32x8 bytes)
+ *
+ *  @return : Shannon entropy of 8-pixel row segments [bits]
+ *
+ * Blank and uniformly filled screens score 0; text and sprite-rich screens
+ * (i.e.: title and game screens) score highest.
+ */
+static double
+frame_entropy(const uint8_t *packed)
+{
+    uint16_t hist[256] = { 0 };     /* segment histogram */
+    double   h = 0.0;               /* entropy           */
+
+    for (size_t i = 0; i < 32 * 8; i++)
+        hist[packed[i]]++;
+
+    for (size_t i = 0; i < 256; i++) {
+        double p = hist[i] / 256.0;
+
+        if (hist[i])
+            h -= p * log2(p);
+    }
+
+    return h;
+}
+
+/* catalog_rom - runs one ROM headless and collects its metadata
+ *  @job  : catalog generation job
+ *  @vm   : machine with the ROM loaded
+ *  @info : metadata (output)
+ */
+static void
+catalog_rom(struct job *job, struct chip8_vm *vm, struct rom_info *info)
+{
+    uint8_t  prev[sizeof(vm->pixels)] = { 0 };  /* previous frame      */
+    uint8_t  packed[sizeof(info->thumb)];       /* current frame       */
+    uint64_t updates = 0;                       /* frames that changed */
+    double   h;                                 /* current entropy     */
+
+    for (uint64_t f = 0; f < job->frames; f++) {
+        vm_run(vm, vm->batch_cycles);
+
+        if (!memcmp(prev, vm->pixels, sizeof(prev)))
+            continue;
+
+        memcpy(prev, vm->pixels, sizeof(prev));
+        updates++;
+
+        pack_frame(vm->pixels, packed, 1);
+        h = frame_entropy(packed);
+        if (h > info->entropy) {
+            info->entropy = h;
+            memcpy(info->thumb, packed, sizeof(packed));
+        }
+    }
+
+    info->valid       = 1;
+    info->fps         = job->frames ? (double) updates * TIMER_HZ
+                                    / job->frames : 0;
+    info->keys_polled = vm->keys_polled;
+    info->key_waited  = vm->key_waited;
+    info->sound_used  = vm->sound_used;
+    info->bad_ins     = vm->bad_ins;
+}
+
+/* worker_main - catalogs ROMs until the ingest pipeline runs dry
+ *  @arg : struct job
+ *
+ *  @return : NULL
+ */
+static void *
+worker_main(void *arg)
+{
+    struct job       *job = arg;    /* catalog generation job */
+    struct rom_image img;           /* loaded ROM             */
+    struct chip8_vm  *vm;           /* emulated machine       */
+    int32_t          ans;           /* answer                 */
+
+    vm = vm_alloc();
+    RET(!vm, NULL, "unable to allocate machine");
+
+    while (1) {
+        ans = ingest_next(job->ing, &img);
+
+        if (ans)
+            break;
+
+        /* the buffer can be given back as soon as the ROM is in RAM */
+        ans = img.len == -1 ? -1 : vm_init(vm, job->freq, job->font_off,
+                                           job->new_shift, 0, 0);
+        if (!ans) {
+            ans = vm_load(vm, img.data, img.len, job->rom_off);
+            if (ans)
+                vm_free(vm);
+        }
+
+        ingest_release(job->ing, &img);
+
+        if (ans) {
+            ERROR("unable to catalog %s", img.path);
+            continue;
+        }
+
+        catalog_rom(job, vm, &job->info[img.rom]);
+        vm_free(vm);
+    }
+
+    vm_release(vm);
+    return NULL;
+}
+
+/* write_json_str - writes a JSON string literal
+ *  @f : output file
+ *  @s : string
+ */
+static void
+write_json_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((uint8_t) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* write_index - writes the catalog as a JSON array
+ *  @path  : output file
+ *  @roms  : paths to ROM files
+ *  @info  : per ROM metadata
+ *  @n     : number of ROM files
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+write_index(const char *path, char **roms, struct rom_info *info, uint32_t n)
+{
+    FILE     *f;            /* output file      */
+    uint32_t written = 0;   /* entries written  */
+
+    f = fopen(path, "w");
+    RET(!f, -1, "unable to open %s (%s)", path, strerror(errno));
+
+    fprintf(f, "[\n");
+    for (uint32_t i = 0; i < n; i++) {
+        if (!info[i].valid)
+            continue;
+
+        fprintf(f, "%s  {\n    \"path\": ", written++ ? ",\n" : "");
+        write_json_str(f, roms[i]);
+        fprintf(f, ",\n    \"fps\": %.2f,\n", info[i].fps);
+        fprintf(f, "    \"sound\": %s,\n",
+                info[i].sound_used ? "true" : "false");
+        fprintf(f, "    \"key_wait\": %s,\n",
+                info[i].key_waited ? "true" : "false");
+
+        fprintf(f, "    \"keys\": [");
+        for (uint32_t k = 0, first = 1; k < 16; k++) {
+            if (!(info[i].keys_polled & (1 << k)))
+                continue;
+            fprintf(f, "%s%u", first ? "" : ", ", k);
+            first = 0;
+        }
+        fprintf(f, "],\n");
+
+        fprintf(f, "    \"bad_ins\": %lu,\n", info[i].bad_ins);
+        fprintf(f, "    \"entropy\": %.3f,\n", info[i].entropy);
+
+        /* 32 rows of 64 pixels, 1 bpp, MSB first */
+        fprintf(f, "    \"thumbnail\": \"");
+        for (size_t j = 0; j < sizeof(info[i].thumb); j++)
+            fprintf(f, "%02x", info[i].thumb[j]);
+        fprintf(f, "\"\n  }");
+    }
+    fprintf(f, "\n]\n");
+
+    fclose(f);
+
+    INFO("%u/%u ROMs cataloged in %s", written, n, path);
+
+    return written == n ? 0 : -1;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* catalog_roms - generates a metadata index for a ROM library
+ *  @roms      : paths to ROM files
+ *  @n         : number of ROM files
+ *  @out       : index output file (JSON)
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @frames    : number of 60Hz frames to run per ROM
+ *
+ *  @return : 0 if all ROMs were cataloged
+ *
+ * ROMs are loaded by the ingest pipeline and run headless, without input, on
+ * one worker thread per online CPU. For each ROM, the index holds the frame
+ * with the highest entropy (as a thumbnail), the rate at which the screen
+ * changes, whether the sound timer or audio patterns are used and which
+ * keys are polled. Entries appear in the same order as @roms.
+ */
+int32_t
+catalog_roms(char       **roms,
+             uint32_t   n,
+             const char *out,
+             uint16_t   freq,
+             uint16_t   rom_off,
+             uint16_t   font_off,
+             uint8_t    new_shift,
+             uint64_t   frames)
+{
+    struct job job = {              /* shared job state   */
+        .freq      = freq,
+        .rom_off   = rom_off,
+        .font_off  = font_off,
+        .new_shift = new_shift,
+        .frames    = frames,
+    };
+    pthread_t  tids[MAX_WORKERS];   /* worker threads     */
+    long       n_workers;           /* number of workers  */
+    long       started = 0;         /* workers started    */
+    int32_t    ans;                 /* answer             */
+    int32_t    ret = -1;            /* function status    */
+
+    job.info = calloc(n, sizeof(*job.info));
+    RET(!job.info, -1, "unable to allocate ROM metadata (%s)",
+        strerror(errno));
+
+    job.ing = ingest_start(roms, n);
+    GOTO(!job.ing, clean_info, "unable to start ROM ingest");
+
+    n_workers = worker_count(0, MAX_WORKERS);
+
+    for (; started < n_workers; started++) {
+        ans = pthread_create(&tids[started], NULL, worker_main, &job);
+        if (ans) {
+            WAR("unable to create worker (%s)", strerror(ans));
+            break;
+        }
+    }
+
+    /* fall back to doing all the work on this thread */
+    if (!started)
+        worker_main(&job);
+
+    for (long i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    ingest_stop(job.ing);
+
+    ret = write_index(out, roms, job.info, n);
+
+clean_info:
+    free(job.info);
+
+    return ret;
+}
@@ -17,10 +17,12 @@
  * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <stdio.h>      /* sscanf */
-#include <string.h>     /* strdup */
+#include <stdio.h>      /* sscanf          */
+#include <stdlib.h>     /* realloc         */
+#include <string.h>     /* strdup, strtok  */
 
 #include "cli_args.h"
+#include "system.h"
 #include "util.h"
 
 
@@ -28,6 +30,33 @@
 const char *argp_program_version     = "version 1.0";
 const char *argp_program_bug_address = "<andru.mantu@gmail.com>";
 
+/* keys of arguments without a short form */
+enum {
+    OPT_FUSE = 0x100,
+    OPT_IR,
+    OPT_STATS,
+    OPT_VALIDATE,
+    OPT_FRAMES,
+    OPT_VSYNC,
+    OPT_SOAK,
+    OPT_SOAK_CSV,
+    OPT_SOAK_UNCAPPED,
+    OPT_CATALOG,
+    OPT_AUTO_FREQ,
+    OPT_SESSIONS,
+    OPT_SESSION_INPUT,
+    OPT_DEBUG_OPS,
+    OPT_PHOSPHOR,
+    OPT_PHOSPHOR_DECAY,
+    OPT_HASH_STREAM,
+    OPT_HASH_COMPARE,
+    OPT_EVDEV,
+    OPT_DATASET,
+    OPT_POLICY,
+    OPT_RAM_BYTES,
+    OPT_EPISODES,
+};
+
 /* command line arguments */
 static struct argp_option options[] = {
     { "rom-offset",   'r', "UINT", 0, "ROM offset in memory (default:0x200)" },
@@ -39,6 +68,29 @@ static struct argp_option options[] = {
     { "lazy-render",  'l', NULL,   0, "Refresh screen on DXYN, 00E0 (default:no)" },
     { "audio-dev",    'a', "INT",  0, "Audio device index [2] (default:unset)" },
     { "tone-freq",    't', "HZ",   0, "Buzzer tone frequency (default:440Hz)" },
+    { "fuse",    OPT_FUSE, NULL,   0, "Fuse common opcode sequences [3] (default:no)" },
+    { "ir",        OPT_IR, NULL,   0, "Run optimized straight-line blocks [4] (default:no)" },
+    { "stats",  OPT_STATS, "SECS", 0, "Frame budget summary interval [5] (default:off)" },
+    { "validate", OPT_VALIDATE, "ENGINE", 0, "Check engine against interpreter [6] (default:off)" },
+    { "frames",     OPT_FRAMES, "UINT",   0, "Frames to run per ROM in batch modes (default:3600)" },
+    { "vsync",       OPT_VSYNC, NULL,     0, "Present once per display refresh [7] (default:no)" },
+    { "soak",         OPT_SOAK, "SECS",   0, "Soak test with resource telemetry [8] (default:off)" },
+    { "soak-csv", OPT_SOAK_CSV, "FILE",   0, "Soak test telemetry output (default:soak.csv)" },
+    { "soak-uncapped", OPT_SOAK_UNCAPPED, NULL, 0, "Soak test at full host speed [8] (default:no)" },
+    { "catalog",   OPT_CATALOG, "FILE",   0, "Write ROM library index [9] (default:off)" },
+    { "auto-freq", OPT_AUTO_FREQ, NULL,   0, "Lower CPU rate while ROM waits [10] (default:no)" },
+    { "sessions",  OPT_SESSIONS, "UINT",  0, "Host live headless machines [11] (default:off)" },
+    { "session-input", OPT_SESSION_INPUT, "SOCKET", 0, "Hosted session key input socket [11] (default:none)" },
+    { "debug-ops", OPT_DEBUG_OPS, NULL,   0, "Enable in-ROM timing opcodes [12] (default:no)" },
+    { "phosphor",   OPT_PHOSPHOR, "UINT", 0, "Blend last UINT presented frames [13] (default:off)" },
+    { "phosphor-decay", OPT_PHOSPHOR_DECAY, NULL, 0, "Fade blended frames by age (default:no)" },
+    { "hash-stream", OPT_HASH_STREAM, "FILE",  0, "Write per-frame state hashes [14] (default:off)" },
+    { "hash-compare", OPT_HASH_COMPARE, "FILE", 0, "Find first frame where streams differ (default:off)" },
+    { "evdev",       OPT_EVDEV, NULL,     0, "Read keys from /dev/input directly [15] (default:no)" },
+    { "dataset",   OPT_DATASET, "DIR",    0, "Write training data shards [16] (default:off)" },
+    { "policy",     OPT_POLICY, "POLICY", 0, "Dataset input: \"random\" or script FILE (default:random)" },
+    { "ram-bytes", OPT_RAM_BYTES, "LIST", 0, "Dataset RAM addresses, e.g. 0x1f0-0x1ff,0x300 (default:none)" },
+    { "episodes",  OPT_EPISODES, "UINT",  0, "Dataset episodes per ROM (default:1)" },
     { 0 }
 };
 
@@ -46,7 +98,12 @@ static struct argp_option options[] = {
 static error_t parse_opt(int, char *, struct argp_state *);
 
 /* description of accepted non-option arguments */
-static char args_doc[] = "ROM_FILE";
+static char args_doc[] = "ROM_FILE\n--validate=ENGINE ROM_FILE...\n"
+                         "--catalog=FILE ROM_FILE...\n"
+                         "--sessions=UINT ROM_FILE...\n"
+                         "--hash-stream=FILE ROM_FILE\n"
+                         "--hash-compare=FILE FILE\n"
+                         "--dataset=DIR ROM_FILE...";
 
 /* program documentation */
 static char doc[] =
@@ -58,12 +115,98 @@ static char doc[] =
     "\n"
     "[2] If not specified, the emulator will dump a list of available devs.\n"
     "    Look for \"pulseaudio\" or \"pipewire\" and pass one of their \n"
-    "    indices.";
+    "    indices."
+    "\n"
+    "[3] Sequences such as ANNN+DXYN or FX07+3X00+1NNN are executed as a \n"
+    "    single superinstruction. The CPU frequency remains unchanged."
+    "\n"
+    "[4] Runs of arithmetic instructions are translated to an IR where dead \n"
+    "    VF flag computations are removed and 6XKK / 7XKK chains are folded."
+    "\n"
+    "[5] For each 60Hz frame, executed cycles are compared to CPU_FREQ/60 \n"
+    "    and host time spent in the core, rendering, per-frame work \n"
+    "    (input, vsync hand-off, governor) and UI event handling is \n"
+    "    measured. With --vsync, rendering includes the wait for the \n"
+    "    display refresh. A summary is printed every SECS seconds and on \n"
+    "    exit."
+    "\n"
+    "[6] ENGINE is a comma separated list of \"fuse\" and \"ir\". Each ROM \n"
+    "    is run headless, without input, on both the switch interpreter \n"
+    "    and the given engine. State hashes are compared after every frame \n"
+    "    and the first difference is reported. No window or audio device \n"
+    "    is opened."
+    "\n"
+    "[7] The screen is presented from the UI thread, once per display \n"
+    "    refresh. If the refresh rate is within 0.5% of 60Hz, the CPU, \n"
+    "    timers and audio pattern are sped up or slowed down to match it, \n"
+    "    so that every refresh shows exactly one new frame. --ref-int and \n"
+    "    --lazy-render are ignored."
+    "\n"
+    "[8] The ROM runs normally for SECS seconds (0 = until closed) while \n"
+    "    throughput, RSS, open fds, threads, timers and page faults are \n"
+    "    written to a CSV file every second. Any growth of fds or timers \n"
+    "    (or of RSS and threads past some slack) after the first 30s ends \n"
+    "    the run with an error. With --soak-uncapped, instructions are \n"
+    "    executed back to back on a dedicated thread instead of on CPU \n"
+    "    timer expirations; DT, ST, audio and the display still run in \n"
+    "    real time. Not compatible with --vsync and --auto-freq."
+    "\n"
+    "[9] Each ROM is run headless, without input, for --frames frames on \n"
+    "    all CPUs. The frame with the most detail (thumbnail), the screen \n"
+    "    update rate, sound usage and polled keys are written to FILE as \n"
+    "    a JSON array. No window or audio device is opened."
+    "\n"
+    "[10] --cpu-freq becomes the highest rate. While the ROM spends most \n"
+    "    of its cycles polling DT (e.g.: FX07+3X00+1NNN) or waiting in \n"
+    "    FX0A, the CPU rate is gradually lowered (down to 60Hz); it is \n"
+    "    restored as soon as the waits get short. DT, ST and audio are \n"
+    "    not affected. --ref-int still counts cycles."
+    "\n"
+    "[11] UINT copies of the given ROMs (assigned round robin) are run \n"
+    "    headless, in step with host time, for --frames frames. Each is a \n"
+    "    coroutine on one of a fixed pool of threads (one per CPU); FX0A \n"
+    "    waits and DT polling loops are fast-forwarded instead of spun. \n"
+    "    Late frames and host CPU usage are reported. No window or audio \n"
+    "    device is opened. With --session-input, a datagram socket is \n"
+    "    bound at SOCKET; each \"SESSION KEY DOWN\" line received (e.g.: \n"
+    "    \"3 a 1\") presses or releases hex KEY on session SESSION (0 \n"
+    "    based) at the start of its next frame."
+    "\n"
+    "[12] 01X0 and 01X1 store the low 32 bits of the cycle counter and of \n"
+    "    the host clock [ns] in VX..VX+3 (big endian). 02NN and 03NN mark \n"
+    "    the beginning and end of region NN; cycle and host time totals \n"
+    "    of each region are printed on exit."
+    "\n"
+    "[13] A pixel is shown lit if it was lit in any of the last UINT \n"
+    "    presents (at most 8), so that sprites erased and redrawn via XOR \n"
+    "    do not flicker. Best combined with --vsync (one present per \n"
+    "    60Hz frame) instead of -i 1 or --lazy-render."
+    "\n"
+    "[14] The ROM is run headless, without input, for --frames frames on \n"
+    "    the engines given by --fuse and --ir. After every frame, a 64-bit \n"
+    "    hash of the registers, stack, RAM and screen is written to FILE \n"
+    "    (8 bytes per frame). --hash-compare reports the first frame at \n"
+    "    which two such streams differ (e.g.: between engines or builds)."
+    "\n"
+    "[15] Keyboards in /dev/input (incl. ones plugged in later, such as \n"
+    "    uinput devices) are read on a dedicated thread, bypassing the \n"
+    "    display server. SDL key events are ignored. Requires read access \n"
+    "    to the event devices (e.g.: membership in the \"input\" group)."
+    "\n"
+    "[16] Each ROM is played headless --episodes times, for --frames \n"
+    "    frames, on all CPUs. Every frame yields one record: the screen \n"
+    "    (1 bpp) and --ram-bytes before the frame, and the keys held \n"
+    "    during it. Keys are picked at random or read from a script of \n"
+    "    \"FRAME KEY_MASK\" lines. Records go to memory mapped .npy shards \n"
+    "    in DIR (np.load(f, mmap_mode='r')).";
 
 /* declaration of relevant structures */
 struct argp          argp = { options, parse_opt, args_doc, doc };
 struct user_settings settings = {
     .rom_path    = NULL,
+    .rom_paths   = NULL,
+    .rom_count   = 0,
+    .frames      = 3600,
     .audio_idx   = -1,
     .tone_freq   = 440.0f,
     .rom_off     = 0x200,
@@ -71,8 +214,31 @@ struct user_settings settings = {
     .scale_f     = 10,
     .frequency   = 200,
     .ref_int     = 20,
+    .stats_int   = 0,
+    .soak_secs   = 0,
+    .soak_csv    = "soak.csv",
+    .catalog     = NULL,
+    .sessions    = 0,
+    .session_in  = NULL,
+    .hash_stream = NULL,
+    .hash_cmp    = NULL,
+    .dataset     = NULL,
+    .policy      = "random",
+    .ram_bytes   = NULL,
+    .episodes    = 1,
     .new_shift   = 0,
     .lazy_render = 0,
+    .fuse        = 0,
+    .ir          = 0,
+    .vsync       = 0,
+    .soak        = 0,
+    .soak_uncap  = 0,
+    .auto_freq   = 0,
+    .debug_ops   = 0,
+    .phosphor    = 0,
+    .phos_decay  = 0,
+    .evdev       = 0,
+    .validate    = 0,
 };
 
 /* parse_opt - parses one argument and updates relevant structures
@@ -84,6 +250,8 @@ struct user_settings settings = {
  */
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
+    char **paths;   /* resized ROM path list */
+
     switch (key) {
         /* offset at which ROM is loaded in memory (normally 0x200) */
         case 'r':
@@ -113,6 +281,106 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'l':
             settings.lazy_render = 1;
             break;
+        /* execute common instruction sequences as superinstructions */
+        case OPT_FUSE:
+            settings.fuse = 1;
+            break;
+        /* execute straight-line code as optimized IR blocks */
+        case OPT_IR:
+            settings.ir = 1;
+            break;
+        /* present once per display refresh */
+        case OPT_VSYNC:
+            settings.vsync = 1;
+            break;
+        /* number of live headless machines to host */
+        case OPT_SESSIONS:
+            sscanf(arg, "%u", &settings.sessions);
+            break;
+        /* key input socket of hosted sessions */
+        case OPT_SESSION_INPUT:
+            settings.session_in = arg;
+            break;
+        /* lower CPU rate while the ROM is waiting */
+        case OPT_AUTO_FREQ:
+            settings.auto_freq = 1;
+            break;
+        /* number of presented frames to blend */
+        case OPT_PHOSPHOR:
+            sscanf(arg, "%hhu", &settings.phosphor);
+            break;
+        /* fade blended frames by age */
+        case OPT_PHOSPHOR_DECAY:
+            settings.phos_decay = 1;
+            break;
+        /* training data output directory */
+        case OPT_DATASET:
+            settings.dataset = arg;
+            break;
+        /* training data input policy */
+        case OPT_POLICY:
+            settings.policy = arg;
+            break;
+        /* RAM addresses sampled in training data */
+        case OPT_RAM_BYTES:
+            settings.ram_bytes = arg;
+            break;
+        /* training data episodes per ROM */
+        case OPT_EPISODES:
+            sscanf(arg, "%u", &settings.episodes);
+            break;
+        /* read keys from evdev devices */
+        case OPT_EVDEV:
+            settings.evdev = 1;
+            break;
+        /* enable the in-ROM timing opcodes */
+        case OPT_DEBUG_OPS:
+            settings.debug_ops = 1;
+            break;
+        /* soak test duration */
+        case OPT_SOAK:
+            sscanf(arg, "%u", &settings.soak_secs);
+            settings.soak = 1;
+            break;
+        /* soak test telemetry output file */
+        case OPT_SOAK_CSV:
+            settings.soak_csv = arg;
+            break;
+        /* run the soak test CPU without the timer */
+        case OPT_SOAK_UNCAPPED:
+            settings.soak_uncap = 1;
+            break;
+        /* ROM library index output file */
+        case OPT_CATALOG:
+            settings.catalog = arg;
+            break;
+        /* per-frame state hash output file */
+        case OPT_HASH_STREAM:
+            settings.hash_stream = arg;
+            break;
+        /* state hash stream to compare against */
+        case OPT_HASH_COMPARE:
+            settings.hash_cmp = arg;
+            break;
+        /* frame budget accounting summary interval */
+        case OPT_STATS:
+            sscanf(arg, "%hu", &settings.stats_int);
+            break;
+        /* validate execution engines against the switch interpreter */
+        case OPT_VALIDATE:
+            for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+                if (!strcmp(tok, "fuse"))
+                    settings.validate |= ENGINE_FUSE;
+                else if (!strcmp(tok, "ir"))
+                    settings.validate |= ENGINE_IR;
+                else
+                    argp_error(state, "Unknown engine: %s", tok);
+            }
+            break;
+        /* number of frames to validate per ROM */
+        case OPT_FRAMES:
+            sscanf(arg, "%lu", &settings.frames);
+            break;
         /* audio device to use as portaudio backend */
         case 'a':
             sscanf(arg, "%d", &settings.audio_idx);
@@ -123,8 +391,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
             break;
         /* ROM file location (relative or absolute) */
         case ARGP_KEY_ARG:
-            RET(settings.rom_path, -1, "Too many arguments");
-            settings.rom_path = strdup(arg);
+            paths = realloc(settings.rom_paths,
+                            (settings.rom_count + 1) * sizeof(*paths));
+            RET(!paths, -1, "unable to allocate ROM path list");
+
+            settings.rom_paths = paths;
+            settings.rom_paths[settings.rom_count++] = strdup(arg);
+            settings.rom_path  = settings.rom_paths[0];
             break;
         defualt:            /* unknown argument */
             return ARGP_ERR_UNKNOWN;
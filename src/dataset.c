@@ -0,0 +1,588 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>    /* pthread_*                    */
+#include <sys/mman.h>   /* m[un]map, madvise            */
+#include <sys/stat.h>   /* mkdir                        */
+#include <unistd.h>     /* ftruncate, close             */
+#include <fcntl.h>      /* open, posix_fallocate        */
+#include <stdlib.h>     /* calloc, free, strtoul        */
+#include <stdio.h>      /* snprintf, fopen, fscanf      */
+#include <string.h>     /* memcpy, memset, strerror     */
+#include <errno.h>      /* errno                        */
+
+#include "dataset.h"
+#include "display.h"
+#include "system.h"
+#include "tsc.h"
+#include "util.h"
+
+#define MAX_WORKERS     64      /* upper bound on emulation threads */
+
+/* record fields preceding the sampled RAM bytes (all little endian) */
+#define REC_ROM         0       /* <u2: index of ROM in argument list */
+#define REC_EPISODE     2       /* <u4: episode number                */
+#define REC_STEP        6       /* <u4: frame number within episode   */
+#define REC_KEYS        10      /* <u2: keys held during this frame   */
+#define REC_FRAME       12      /* u1[32][8]: screen before the frame */
+#define REC_RAM         268     /* u1[n]: RAM before the frame        */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* input script entry: keys held starting with a frame */
+struct script_ent {
+    uint64_t frame;             /* first frame              */
+    uint16_t keys;              /* key mask (bit = chip8 key) */
+};
+
+/* dataset generation job, shared by all workers */
+struct job {
+    const char        *dir;         /* output directory             */
+    uint8_t           **roms;       /* ROM images                   */
+    int32_t           *rom_len;     /* ROM sizes (-1 = unreadable)  */
+    uint32_t          n_roms;       /* number of ROMs               */
+    uint64_t          n_eps;        /* total number of episodes     */
+    uint32_t          n_workers;    /* number of workers            */
+    struct script_ent *script;      /* input script (NULL = random) */
+    uint32_t          script_len;   /* number of script entries     */
+    uint16_t          ram_sel[DS_RAM_MAX];  /* sampled RAM addresses */
+    uint8_t           ram_n;        /* number of sampled bytes      */
+    size_t            rec_sz;       /* record size [bytes]          */
+    uint16_t          freq;         /* CPU frequency                */
+    uint16_t          rom_off;      /* ROM map offset into RAM      */
+    uint16_t          font_off;     /* font sprites offset into RAM */
+    uint8_t           new_shift;    /* use new shift operations     */
+    uint64_t          frames;       /* 60Hz frames per episode      */
+    uint64_t          rows;         /* records written (atomic)     */
+    uint8_t           failed;       /* some worker failed (atomic)  */
+};
+
+/* memory mapped .npy file being filled by one worker */
+struct shard {
+    int32_t  fd;                /* shard file                   */
+    uint8_t  *map;              /* header + records (or NULL)   */
+    size_t   map_sz;            /* size of mapping [bytes]      */
+    uint64_t rows;              /* records written so far       */
+    uint32_t worker;            /* owner (part of file name)    */
+    uint32_t seq;               /* shard number of this worker  */
+    char     path[4096];        /* file name                    */
+};
+
+/* per worker state */
+struct worker {
+    pthread_t       tid;        /* thread                       */
+    struct job      *job;       /* shared job                   */
+    struct shard    shard;      /* current output shard         */
+    struct chip8_vm *vm;        /* emulated machine             */
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* parse_ram_sel - parses a list of RAM addresses to sample
+ *  @str : comma separated addresses or ranges (e.g.: "0x1f0-0x1ff,0x300")
+ *  @job : dataset generation job (output)
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+parse_ram_sel(const char *str, struct job *job)
+{
+    char          *end;     /* end of parsed number */
+    unsigned long lo, hi;   /* address range        */
+
+    job->ram_n = 0;
+    while (str && *str) {
+        lo = hi = strtoul(str, &end, 0);
+        if (*end == '-')
+            hi = strtoul(end + 1, &end, 0);
+
+        RET(end == str || (*end && *end != ',') || lo > hi || hi >= RAM_SZ,
+            -1, "invalid RAM address list: %s", str);
+
+        for (; lo <= hi; lo++) {
+            RET(job->ram_n == DS_RAM_MAX, -1, "at most %u RAM bytes may be "
+                "sampled", DS_RAM_MAX);
+            job->ram_sel[job->ram_n++] = lo;
+        }
+
+        str = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+/* load_script - reads an input script
+ *  @path : script file; one "FRAME KEY_MASK" line (decimal, hex) per entry
+ *  @job  : dataset generation job (output)
+ *
+ *  @return : 0 if everything went well
+ *
+ * Each key mask is held from its frame until the next entry's frame.
+ * Entries must be sorted by frame. Every episode replays the same script.
+ */
+static int32_t
+load_script(const char *path, struct job *job)
+{
+    FILE     *f;        /* script file  */
+    uint64_t frame;     /* entry frame  */
+    uint32_t keys;      /* entry keys   */
+    int32_t  ret = -1;  /* status       */
+
+    job->script = calloc(DS_SCRIPT_MAX, sizeof(*job->script));
+    RET(!job->script, -1, "unable to allocate input script (%s)",
+        strerror(errno));
+
+    f = fopen(path, "r");
+    GOTO(!f, clean_script, "unable to open %s (%s)", path, strerror(errno));
+
+    while (fscanf(f, "%lu %x", &frame, &keys) == 2) {
+        GOTO(job->script_len == DS_SCRIPT_MAX, clean_file,
+             "input script longer than %u entries", DS_SCRIPT_MAX);
+        GOTO(job->script_len && frame < job->script[job->script_len - 1].frame,
+             clean_file, "input script is not sorted (frame %lu)", frame);
+
+        job->script[job->script_len++] = (struct script_ent) {
+            .frame = frame,
+            .keys  = keys,
+        };
+    }
+    GOTO(!feof(f), clean_file, "malformed input script line %u",
+         job->script_len + 1);
+
+    ret = 0;
+
+clean_file:
+    fclose(f);
+clean_script:
+    if (ret) {
+        free(job->script);
+        job->script = NULL;
+    }
+
+    return ret;
+}
+
+/* write_npy_hdr - writes a .npy (version 1.0) header for a record array
+ *  @job  : dataset generation job
+ *  @dst  : start of file (DS_HDR_SZ bytes)
+ *  @rows : number of records
+ *
+ * The header is padded to DS_HDR_SZ bytes regardless of @rows, so that it
+ * can be rewritten in place once the final number of records is known.
+ */
+static void
+write_npy_hdr(struct job *job, uint8_t *dst, uint64_t rows)
+{
+    char   ram[32] = "";    /* ram field (if any) */
+    size_t len;             /* dictionary length  */
+
+    if (job->ram_n)
+        snprintf(ram, sizeof(ram), ", ('ram', 'u1', (%hhu,))", job->ram_n);
+
+    memset(dst, ' ', DS_HDR_SZ);
+    memcpy(dst, "\x93NUMPY\x01\x00", 8);
+    dst[8] = (DS_HDR_SZ - 10) & 0xff;
+    dst[9] = (DS_HDR_SZ - 10) >> 8;
+
+    len = snprintf((char *) dst + 10, DS_HDR_SZ - 10,
+                   "{'descr': [('rom', '<u2'), ('episode', '<u4'), "
+                   "('step', '<u4'), ('keys', '<u2'), "
+                   "('frame', 'u1', (32, 8))%s], 'fortran_order': False, "
+                   "'shape': (%lu,), }", ram, rows);
+
+    /* snprintf's terminator is overwritten by the padding */
+    dst[10 + len]       = ' ';
+    dst[DS_HDR_SZ - 1]  = '\n';
+}
+
+/* shard_open - creates and maps the next shard of a worker
+ *  @job : dataset generation job
+ *  @s   : shard (worker and seq must be set)
+ *
+ *  @return : 0 if everything went well
+ *
+ * Space for DS_SHARD_ROWS records is allocated upfront, so that records are
+ * written straight to the page cache with no system calls, and so that a
+ * full disk is noticed here rather than as a SIGBUS later on.
+ */
+static int32_t
+shard_open(struct job *job, struct shard *s)
+{
+    int32_t ans;    /* answer */
+
+    snprintf(s->path, sizeof(s->path), "%s/shard-%03u-%05u.npy", job->dir,
+             s->worker, s->seq);
+
+    s->rows   = 0;
+    s->map_sz = DS_HDR_SZ + DS_SHARD_ROWS * job->rec_sz;
+
+    s->fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    RET(s->fd == -1, -1, "unable to create %s (%s)", s->path, strerror(errno));
+
+    ans = posix_fallocate(s->fd, 0, s->map_sz);
+    if (ans == EOPNOTSUPP || ans == EINVAL)
+        ans = ftruncate(s->fd, s->map_sz) ? errno : 0;
+    GOTO(ans, clean_fd, "unable to allocate %s (%s)", s->path, strerror(ans));
+
+    s->map = mmap(NULL, s->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    GOTO(s->map == MAP_FAILED, clean_fd, "unable to map %s (%s)", s->path,
+         strerror(errno));
+
+    madvise(s->map, s->map_sz, MADV_SEQUENTIAL);
+
+    write_npy_hdr(job, s->map, DS_SHARD_ROWS);
+
+    return 0;
+
+clean_fd:
+    close(s->fd);
+    unlink(s->path);
+    s->map = NULL;
+
+    return -1;
+}
+
+/* shard_close - finalizes a shard
+ *  @job : dataset generation job
+ *  @s   : open shard
+ *
+ *  @return : 0 if everything went well
+ *
+ * A partially filled shard has its header patched and is truncated to the
+ * records actually written; an empty one is removed.
+ */
+static int32_t
+shard_close(struct job *job, struct shard *s)
+{
+    int32_t ret = 0;    /* function status */
+
+    if (!s->map)
+        return 0;
+
+    if (s->rows < DS_SHARD_ROWS)
+        write_npy_hdr(job, s->map, s->rows);
+
+    munmap(s->map, s->map_sz);
+
+    if (!s->rows) {
+        unlink(s->path);
+    } else if (s->rows < DS_SHARD_ROWS
+               && ftruncate(s->fd, DS_HDR_SZ + s->rows * job->rec_sz)) {
+        ERROR("unable to truncate %s (%s)", s->path, strerror(errno));
+        ret = -1;
+    }
+
+    close(s->fd);
+    s->map = NULL;
+    s->seq++;
+
+    return ret;
+}
+
+/* random_keys - advances the random input policy by one frame
+ *  @rng  : xorshift64 state
+ *  @hold : frames left to hold the current keys
+ *  @keys : current key mask
+ *
+ *  @return : keys held during this frame
+ *
+ * Either one key or none is held for 2 to 32 frames at a time; most ROMs
+ * only react to single keys and ignore presses shorter than a few frames.
+ */
+static inline uint16_t
+random_keys(uint64_t *rng, uint32_t *hold, uint16_t keys)
+{
+    uint64_t r;     /* random value */
+
+    if (!*hold) {
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 7;
+        *rng ^= *rng << 17;
+        r = *rng;
+
+        *hold = 2 + r % 31;
+        keys  = (r >> 8) % 20 < 16 ? 1 << (r >> 8) % 20 : 0;
+    }
+
+    (*hold)--;
+    return keys;
+}
+
+/* run_episode - plays one episode and appends its records
+ *  @w  : worker
+ *  @ep : episode number
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+run_episode(struct worker *w, uint64_t ep)
+{
+    struct job      *job = w->job;          /* shared job         */
+    struct shard    *s   = &w->shard;       /* output shard       */
+    uint32_t        rom  = ep % job->n_roms;/* played ROM         */
+    struct chip8_vm *vm  = w->vm;           /* emulated machine   */
+    uint8_t         *rec;                   /* current record     */
+    uint64_t        rng;                    /* random policy      */
+    uint32_t        hold = 0;               /* random policy      */
+    uint32_t        sc   = 0;               /* script position    */
+    uint16_t        keys = 0;               /* keys held          */
+    uint16_t        prev = 0;               /* keys held before   */
+    uint32_t        step;                   /* frame in episode   */
+    int32_t         ans;                    /* answer             */
+
+    if (job->rom_len[rom] == -1)
+        return 0;
+
+    /* splitmix64 of the episode number; seeds both CXKK and the policy */
+    rng = ep + 0x9e3779b97f4a7c15;
+    rng = (rng ^ rng >> 30) * 0xbf58476d1ce4e5b9;
+    rng = (rng ^ rng >> 27) * 0x94d049bb133111eb;
+    rng = (rng ^ rng >> 31) | 1;
+
+    ans = vm_init(vm, job->freq, job->font_off, job->new_shift, 0, rng);
+    RET(ans, -1, "unable to initialize machine");
+    ans = vm_load(vm, job->roms[rom], job->rom_len[rom], job->rom_off);
+    GOTO(ans, clean_vm, "unable to load ROM");
+
+    for (step = 0; step < job->frames; step++) {
+        if (s->rows == DS_SHARD_ROWS) {
+            ans = shard_close(job, s) || shard_open(job, s);
+            GOTO(ans, clean_vm, "unable to start next shard");
+        }
+
+        if (!job->script) {
+            keys = random_keys(&rng, &hold, keys);
+        } else {
+            while (sc < job->script_len && job->script[sc].frame <= step)
+                keys = job->script[sc++].keys;
+        }
+
+        /* key changes become visible at the start of this frame */
+        for (uint16_t d = keys ^ prev; d; d &= d - 1)
+            input_push(&vm->input_q, vm->cycles, __builtin_ctz(d),
+                       keys >> __builtin_ctz(d) & 1);
+        prev = keys;
+
+        /* observation (before the frame) and action (during the frame) */
+        rec = s->map + DS_HDR_SZ + s->rows++ * job->rec_sz;
+
+        memcpy(rec + REC_ROM,     &(uint16_t) { rom },  2);
+        memcpy(rec + REC_EPISODE, &(uint32_t) { ep },   4);
+        memcpy(rec + REC_STEP,    &step,                4);
+        memcpy(rec + REC_KEYS,    &keys,                2);
+        pack_frame(vm->pixels, rec + REC_FRAME, 1);
+        for (size_t i = 0; i < job->ram_n; i++)
+            rec[REC_RAM + i] = vm->ram[job->ram_sel[i]];
+
+        vm_run(vm, vm->batch_cycles);
+    }
+
+    __atomic_fetch_add(&job->rows, job->frames, __ATOMIC_RELAXED);
+
+clean_vm:
+    vm_free(vm);
+
+    return ans ? -1 : 0;
+}
+
+/* worker_main - runs this worker's share of the episodes
+ *  @arg : struct worker
+ *
+ *  @return : NULL
+ *
+ * Worker W runs episodes W, W + n_workers, W + 2 * n_workers, ... in this
+ * order. Episodes are not claimed dynamically, so that the contents of each
+ * shard do not depend on thread scheduling.
+ */
+static void *
+worker_main(void *arg)
+{
+    struct worker *w   = arg;       /* this worker      */
+    struct job    *job = w->job;    /* shared job       */
+    uint64_t      ep;               /* current episode  */
+    int32_t       ans;              /* answer           */
+
+    w->vm = vm_alloc();
+    ans   = !w->vm;
+    GOTO(ans, out, "unable to allocate machine");
+
+    ans = shard_open(job, &w->shard);
+    GOTO(ans, out, "unable to open first shard");
+
+    for (ep = w->shard.worker; ep < job->n_eps; ep += job->n_workers) {
+        if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+            break;
+
+        ans = run_episode(w, ep);
+        if (ans)
+            break;
+    }
+
+    ans = shard_close(job, &w->shard) || ans;
+
+out:
+    if (ans)
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+
+    vm_release(w->vm);
+    return NULL;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* dataset_gen - records (screen, keys, RAM) tuples of headless runs
+ *  @roms      : paths to ROM files
+ *  @n         : number of ROM files
+ *  @dir       : output directory (created if needed)
+ *  @policy    : "random" or path to an input script
+ *  @ram_sel   : RAM addresses to sample (see parse_ram_sel()) or NULL
+ *  @episodes  : episodes per ROM
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @frames    : number of 60Hz frames per episode
+ *
+ *  @return : 0 if all episodes were recorded
+ *
+ * Episodes are spread over one worker thread per online CPU. Every worker
+ * fills its own preallocated, memory mapped .npy shards, each an array of
+ * DS_SHARD_ROWS records (see REC_*) that np.load(mmap_mode='r') can open.
+ * A record holds the screen and the sampled RAM bytes at the start of a
+ * frame, and the keys held during that frame. Episode E plays ROM E % n and
+ * seeds both CXKK and the random policy from E. Since every worker also runs
+ * a fixed set of episodes (see worker_main()), runs with the same number of
+ * workers produce identical shards.
+ */
+int32_t
+dataset_gen(char       **roms,
+            uint32_t   n,
+            const char *dir,
+            const char *policy,
+            const char *ram_sel,
+            uint32_t   episodes,
+            uint16_t   freq,
+            uint16_t   rom_off,
+            uint16_t   font_off,
+            uint8_t    new_shift,
+            uint64_t   frames)
+{
+    struct job    job = {           /* shared job state   */
+        .dir       = dir,
+        .n_roms    = n,
+        .n_eps     = (uint64_t) n * episodes,
+        .freq      = freq,
+        .rom_off   = rom_off,
+        .font_off  = font_off,
+        .new_shift = new_shift,
+        .frames    = frames,
+    };
+    struct worker *workers;         /* worker threads     */
+    long          n_workers;        /* number of workers  */
+    long          started = 0;      /* workers started    */
+    uint64_t      t0;               /* start time         */
+    int32_t       ans;              /* answer             */
+    int32_t       ret = -1;         /* function status    */
+
+    RET(frames > UINT32_MAX, -1, "too many frames per episode");
+    RET(parse_ram_sel(ram_sel, &job), -1, "unable to parse RAM selection");
+    job.rec_sz = REC_RAM + job.ram_n;
+
+    if (strcmp(policy, "random")) {
+        ans = load_script(policy, &job);
+        RET(ans, -1, "unable to load input script");
+    }
+
+    ans = mkdir(dir, 0755);
+    GOTO(ans && errno != EEXIST, clean_script, "unable to create %s (%s)",
+         dir, strerror(errno));
+
+    /* all ROMs are replayed many times; read them once */
+    job.roms    = calloc(n, sizeof(*job.roms));
+    job.rom_len = calloc(n, sizeof(*job.rom_len));
+    GOTO(!job.roms || !job.rom_len, clean_roms, "unable to allocate ROM "
+         "table (%s)", strerror(errno));
+
+    for (uint32_t i = 0; i < n; i++) {
+        job.roms[i] = malloc(RAM_SZ);
+        GOTO(!job.roms[i], clean_roms, "unable to allocate ROM (%s)",
+             strerror(errno));
+
+        job.rom_len[i] = read_rom(roms[i], job.roms[i], RAM_SZ);
+        if (job.rom_len[i] == -1)
+            WAR("skipping %s", roms[i]);
+    }
+
+    n_workers = worker_count(0, MAX_WORKERS);
+    if ((uint64_t) n_workers > job.n_eps)
+        n_workers = job.n_eps ? job.n_eps : 1;
+    job.n_workers = n_workers;
+
+    workers = calloc(n_workers, sizeof(*workers));
+    GOTO(!workers, clean_roms, "unable to allocate workers (%s)",
+         strerror(errno));
+
+    t0 = tsc_ns();
+    for (long i = 0; i < n_workers; i++) {
+        workers[i].job          = &job;
+        workers[i].shard.worker = i;
+    }
+
+    for (; started < n_workers; started++) {
+        ans = pthread_create(&workers[started].tid, NULL, worker_main,
+                             &workers[started]);
+        if (ans) {
+            WAR("unable to create worker (%s)", strerror(ans));
+            break;
+        }
+    }
+
+    /* the share of workers that could not be started is run on this one */
+    for (long i = started; i < n_workers; i++)
+        worker_main(&workers[i]);
+
+    for (long i = 0; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    GOTO(job.failed, clean_workers, "dataset generation failed");
+
+    INFO("%lu records (%zu bytes each) written to %s in %.3fs by %ld "
+         "workers", job.rows, job.rec_sz, dir, (tsc_ns() - t0) / 1e9,
+         n_workers);
+    ret = 0;
+
+clean_workers:
+    free(workers);
+clean_roms:
+    for (uint32_t i = 0; job.roms && i < n; i++)
+        free(job.roms[i]);
+    free(job.roms);
+    free(job.rom_len);
+clean_script:
+    free(job.script);
+
+    return ret;
+}
@@ -21,6 +21,7 @@
 #include <SDL2/SDL_pixels.h>    /* SDL pixel ops */
 #include <stdint.h>             /* [u]int*_t     */
 #include <alloca.h>             /* alloca        */
+#include <string.h>             /* memset        */
 
 #include "display.h"
 #include "util.h"
@@ -37,29 +38,75 @@
 #define LIGHT_B     0x33
 #define LIGHT_COLOR LIGHT_R, LIGHT_G, LIGHT_B
 
+/* pixel color of a phosphor persistence level (0 = newest frame) */
+#define FADE(dark, light, lvl) \
+    ((dark) + ((light) - (dark)) * (persist - (lvl)) / persist)
+#define FADE_COLOR(lvl)             \
+    FADE(DARK_R, LIGHT_R, lvl),     \
+    FADE(DARK_G, LIGHT_G, lvl),     \
+    FADE(DARK_B, LIGHT_B, lvl)
+
 /******************************************************************************
  **************************** INTERNAL STRUCTURES *****************************
  ******************************************************************************/
 
-static SDL_Window   *window;
-static SDL_Renderer *render;
+/* 32 rows of 64 pixels, one bit each (LSB = leftmost); the vector type *
+ * lets the compiler process multiple rows per SIMD instruction         */
+typedef uint64_t rows_t __attribute__((vector_size(32)));
+
+#define ROW_VECS    (32 / (sizeof(rows_t) / sizeof(uint64_t)))
+
+union packed_frame {
+    rows_t   v[ROW_VECS];   /* SIMD view                   */
+    uint64_t row[32];       /* row view                    */
+    uint8_t  bytes[256];    /* byte view (see pack_frame()) */
+};
 
-/* logical screen state */
-static uint8_t pixels[32 * 64] = { [0 ... 2047] = 0x00 };
+static SDL_Window         *window;
+static SDL_Renderer       *render;
+static uint8_t            persist = 1;              /* frames blended      */
+static uint8_t            decay;                    /* fade older frames   */
+static uint8_t            hist_head;                /* newest in history   */
+static union packed_frame history[PERSIST_MAX];     /* recent presents     */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* draw_rows - draws all pixels that are set in a packed screen
+ *  @frame : packed screen
+ */
+static void
+draw_rows(const union packed_frame *frame)
+{
+    for (size_t i = 0; i < 32; i++)
+        for (uint64_t m = frame->row[i]; m; m &= m - 1)
+            SDL_RenderDrawPoint(render, __builtin_ctzl(m), i);
+}
 
 /******************************************************************************
  ************************* PUBLIC API IMPLEMENTATION **************************
  ******************************************************************************/
 
 /* init_display - initializes SDL2-based display
- *  @sf : window scaling factor
+ *  @sf       : window scaling factor
+ *  @vsync    : synchronize presents with display refresh
+ *  @_persist : number of presented frames to blend (0 or 1 = off)
+ *  @_decay   : fade older frames out, rather than showing them as lit
  *
  *  @return : 0 if everything went well
  */
-int32_t init_display(uint16_t sf)
+int32_t init_display(uint16_t sf, uint8_t vsync, uint8_t _persist,
+                     uint8_t _decay)
 {
     int ans;    /* answer */
 
+    RET(_persist > PERSIST_MAX, -1, "at most %u frames can be blended",
+        PERSIST_MAX);
+
+    persist = _persist ? _persist : 1;
+    decay   = _decay;
+
     /* create a window object */
     window = SDL_CreateWindow("CHIP8",
                 SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -68,7 +115,8 @@ int32_t init_display(uint16_t sf)
          SDL_GetError());
 
     /* create an accelerated rendering context */
-    render = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    render = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+                                (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     GOTO(!render, clean_window, "unable to create rendering context (%s)",
          SDL_GetError());
 
@@ -92,26 +140,27 @@ clean_window:
 }
 
 /* clear_screen - resets the screen texture to the default color (black)
+ *
+ * NOTE: the logical screen state is owned (and cleared) by the caller
  */
 void clear_screen(void)
 {
     /* deactivate all pixels */
     SDL_SetRenderDrawColor(render, DARK_COLOR, SDL_ALPHA_OPAQUE);
     SDL_RenderClear(render);
-
-    /* clear logical representation */
-    memset(pixels, 0x00, sizeof(pixels));
 }
 
 /* display_sprite - flips pixels according to sprite data
- *  @x   : horizontal starting location on screen
- *  @y   : vertical starting location on screen
- *  @src : start of sprite data in host memory
- *  @n   : size of spirte [bytes]
+ *  @pixels : logical screen state (64x32 bytes)
+ *  @x      : horizontal starting location on screen
+ *  @y      : vertical starting location on screen
+ *  @src    : start of sprite data in host memory
+ *  @n      : size of spirte [bytes]
  *
  *  @return : 1 if any pixels were turned off
  */
-uint8_t display_sprite(uint8_t x, uint8_t y, uint8_t *src, uint8_t n)
+uint8_t display_sprite(uint8_t *pixels, uint8_t x, uint8_t y, uint8_t *src,
+                       uint8_t n)
 {
     uint8_t   _x;                   /* individual x coordinate         */
     uint8_t   _y;                   /* individual y coordinate         */
@@ -142,28 +191,52 @@ uint8_t display_sprite(uint8_t x, uint8_t y, uint8_t *src, uint8_t n)
 }
 
 /* refresh_display - forces rendering the texture on screen
+ *  @pixels : logical screen state (64x32 bytes)
  *
  * This should be called in the main system loop to avoid artifacts.
+ *
+ * With phosphor persistence, a pixel is lit if it was lit in any of the
+ * most recent presents, so that sprites erased and redrawn via XOR across
+ * a frame boundary do not flicker. With decay, a pixel that was last lit
+ * N presents ago is drawn N steps closer to the background color.
  */
-void refresh_display(void)
+void refresh_display(const uint8_t *pixels)
 {
+    union packed_frame seen;    /* lit in any frame so far (newest first) */
+    union packed_frame level;   /* last lit in the current frame          */
+    union packed_frame *f;      /* blended frame                          */
+
+    hist_head = (hist_head + 1) % persist;
+    pack_frame(pixels, history[hist_head].bytes, 0);
+
     /* deactivate all pixels */
     SDL_SetRenderDrawColor(render, DARK_COLOR, SDL_ALPHA_OPAQUE);
     SDL_RenderClear(render);
 
     /* redraw each active pixel */
     SDL_SetRenderDrawColor(render, LIGHT_COLOR, SDL_ALPHA_OPAQUE);
-    for (size_t i = 0; i < 32; i++) {
-        for (size_t j = 0; j < 64; j++) {
-            /* skip dark pixels */
-            if (!pixels[i * 64 + j])
-                continue;
-
-            /* draw active pixels */
-            SDL_RenderDrawPoint(render, j, i);
+    memset(&seen, 0, sizeof(seen));
+
+    for (size_t lvl = 0; lvl < persist; lvl++) {
+        f = &history[(hist_head + persist - lvl) % persist];
+
+        if (decay) {
+            for (size_t i = 0; i < ROW_VECS; i++) {
+                level.v[i]  = f->v[i] & ~seen.v[i];
+                seen.v[i]  |= f->v[i];
+            }
+
+            SDL_SetRenderDrawColor(render, FADE_COLOR(lvl), SDL_ALPHA_OPAQUE);
+            draw_rows(&level);
+        } else {
+            for (size_t i = 0; i < ROW_VECS; i++)
+                seen.v[i] |= f->v[i];
         }
     }
 
+    if (!decay)
+        draw_rows(&seen);
+
     /* present buffer */
     SDL_RenderPresent(render);
 }
@@ -0,0 +1,443 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <linux/input.h>    /* input_event, EVIOCG*, KEY_*      */
+#include <sys/epoll.h>      /* epoll_*                          */
+#include <sys/eventfd.h>    /* eventfd                          */
+#include <sys/inotify.h>    /* inotify_*                        */
+#include <sys/ioctl.h>      /* ioctl                            */
+#include <sys/stat.h>       /* fstat                            */
+#include <pthread.h>        /* pthread_{create,join}            */
+#include <dirent.h>         /* {open,read,close}dir             */
+#include <fcntl.h>          /* open                             */
+#include <unistd.h>         /* read, write, close               */
+#include <stdio.h>          /* snprintf                         */
+#include <string.h>         /* strncmp, strerror                */
+#include <errno.h>          /* errno                            */
+
+#include "evdev.h"
+#include "util.h"
+
+/* epoll tags of the non-device descriptors */
+#define TAG_STOP        EVDEV_MAX       /* evdev_stop() was called  */
+#define TAG_HOTPLUG     (EVDEV_MAX + 1) /* EVDEV_DIR changed        */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* one open event device */
+struct evdev_dev {
+    int32_t  fd;            /* device file descriptor (-1 = free)   */
+    dev_t    rdev;          /* device number (avoids reopening)     */
+    uint16_t down;          /* mapped keys held on this device      */
+    uint8_t  dropped;       /* SYN_DROPPED seen; resync at report   */
+};
+
+static pthread_t        tid;                /* reader thread              */
+static int32_t          epfd    = -1;       /* waits on all below         */
+static int32_t          stopfd  = -1;       /* wakes up the reader        */
+static int32_t          inofd   = -1;       /* EVDEV_DIR watch            */
+static struct evdev_dev devs[EVDEV_MAX];    /* open devices               */
+static uint16_t         codes[16];          /* chip8 key -> KEY_* code    */
+static uint8_t          n_keys;             /* mapped keys                */
+static uint16_t         published;          /* key state sent to the core */
+static void             (*publish)(uint8_t, uint8_t);   /* key callback   */
+
+/* USB HID usage (i.e.: SDL scancode) -> evdev KEY_* code; 0 if unknown */
+static const uint16_t hid_keys[] = {
+    [ 0x04 ] = KEY_A,     [ 0x05 ] = KEY_B,     [ 0x06 ] = KEY_C,
+    [ 0x07 ] = KEY_D,     [ 0x08 ] = KEY_E,     [ 0x09 ] = KEY_F,
+    [ 0x0a ] = KEY_G,     [ 0x0b ] = KEY_H,     [ 0x0c ] = KEY_I,
+    [ 0x0d ] = KEY_J,     [ 0x0e ] = KEY_K,     [ 0x0f ] = KEY_L,
+    [ 0x10 ] = KEY_M,     [ 0x11 ] = KEY_N,     [ 0x12 ] = KEY_O,
+    [ 0x13 ] = KEY_P,     [ 0x14 ] = KEY_Q,     [ 0x15 ] = KEY_R,
+    [ 0x16 ] = KEY_S,     [ 0x17 ] = KEY_T,     [ 0x18 ] = KEY_U,
+    [ 0x19 ] = KEY_V,     [ 0x1a ] = KEY_W,     [ 0x1b ] = KEY_X,
+    [ 0x1c ] = KEY_Y,     [ 0x1d ] = KEY_Z,     [ 0x1e ] = KEY_1,
+    [ 0x1f ] = KEY_2,     [ 0x20 ] = KEY_3,     [ 0x21 ] = KEY_4,
+    [ 0x22 ] = KEY_5,     [ 0x23 ] = KEY_6,     [ 0x24 ] = KEY_7,
+    [ 0x25 ] = KEY_8,     [ 0x26 ] = KEY_9,     [ 0x27 ] = KEY_0,
+    [ 0x28 ] = KEY_ENTER, [ 0x29 ] = KEY_ESC,   [ 0x2a ] = KEY_BACKSPACE,
+    [ 0x2b ] = KEY_TAB,   [ 0x2c ] = KEY_SPACE, [ 0x4f ] = KEY_RIGHT,
+    [ 0x50 ] = KEY_LEFT,  [ 0x51 ] = KEY_DOWN,  [ 0x52 ] = KEY_UP,
+    [ 0x59 ] = KEY_KP1,   [ 0x5a ] = KEY_KP2,   [ 0x5b ] = KEY_KP3,
+    [ 0x5c ] = KEY_KP4,   [ 0x5d ] = KEY_KP5,   [ 0x5e ] = KEY_KP6,
+    [ 0x5f ] = KEY_KP7,   [ 0x60 ] = KEY_KP8,   [ 0x61 ] = KEY_KP9,
+    [ 0x62 ] = KEY_KP0,
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* test_bit - tests a bit in an evdev bitmap
+ *  @bits : bitmap (as filled in by EVIOCG*)
+ *  @n    : bit index
+ *
+ *  @return : 1 if set, 0 otherwise
+ */
+static inline uint8_t
+test_bit(const uint8_t *bits, uint16_t n)
+{
+    return bits[n / 8] >> (n % 8) & 1;
+}
+
+/* publish_keys - sends key state changes of all devices to the core
+ *
+ * A key is down if it is held on any device. Only changes of the combined
+ * state are published, so that two keyboards can share the keypad.
+ */
+static void
+publish_keys(void)
+{
+    uint16_t state = 0;     /* combined key state */
+    uint16_t diff;          /* changed keys       */
+
+    for (size_t i = 0; i < EVDEV_MAX; i++)
+        if (devs[i].fd != -1)
+            state |= devs[i].down;
+
+    for (diff = state ^ published; diff; diff &= diff - 1)
+        publish(__builtin_ctz(diff), state >> __builtin_ctz(diff) & 1);
+
+    published = state;
+}
+
+/* dev_sync - reads the current key state of a device
+ *  @dev : open device
+ *
+ * Used when a device is opened and after the kernel dropped events
+ * (SYN_DROPPED), since key presses and releases may have been lost.
+ */
+static void
+dev_sync(struct evdev_dev *dev)
+{
+    uint8_t bits[KEY_MAX / 8 + 1] = { 0 };  /* held keys */
+    int32_t ans;                            /* answer    */
+
+    ans = ioctl(dev->fd, EVIOCGKEY(sizeof(bits)), bits);
+    RET(ans == -1, , "unable to read key state (%s)", strerror(errno));
+
+    dev->down = 0;
+    for (size_t k = 0; k < n_keys; k++)
+        dev->down |= test_bit(bits, codes[k]) << k;
+
+    publish_keys();
+}
+
+/* dev_open - starts reading an event device, if it has any mapped keys
+ *  @path : device node
+ */
+static void
+dev_open(const char *path)
+{
+    uint8_t     bits[KEY_MAX / 8 + 1] = { 0 };  /* supported keys  */
+    char        name[64] = "?";                 /* device name     */
+    struct stat st;                             /* device number   */
+    int32_t     fd;                             /* device          */
+    int32_t     ans;                            /* answer          */
+    size_t      slot = EVDEV_MAX;               /* free entry      */
+    uint8_t     usable = 0;                     /* has mapped keys */
+
+    /* may fail until udev has set the permissions; retried on IN_ATTRIB */
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG("unable to open %s (%s)", path, strerror(errno));
+        return;
+    }
+
+    ans = fstat(fd, &st);
+    GOTO(ans == -1, clean_fd, "unable to stat %s (%s)", path,
+         strerror(errno));
+
+    for (size_t i = 0; i < EVDEV_MAX; i++) {
+        if (devs[i].fd != -1 && devs[i].rdev == st.st_rdev)
+            goto clean_fd;
+        if (devs[i].fd == -1 && slot == EVDEV_MAX)
+            slot = i;
+    }
+    GOTO(slot == EVDEV_MAX, clean_fd, "too many input devices; %s ignored",
+         path);
+
+    /* skip mice, power buttons, etc. */
+    ans = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits);
+    GOTO(ans == -1, clean_fd, "unable to query %s (%s)", path,
+         strerror(errno));
+
+    for (size_t k = 0; k < n_keys; k++)
+        usable |= test_bit(bits, codes[k]);
+    if (!usable)
+        goto clean_fd;
+
+    devs[slot] = (struct evdev_dev) {
+        .fd   = fd,
+        .rdev = st.st_rdev,
+    };
+
+    ans = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &(struct epoll_event) {
+        .events   = EPOLLIN,
+        .data.u64 = slot,
+    });
+    if (ans == -1) {
+        ERROR("unable to watch %s (%s)", path, strerror(errno));
+        devs[slot].fd = -1;
+        goto clean_fd;
+    }
+
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    INFO("evdev: reading keys from %s (%s)", path, name);
+
+    /* keys may already be held */
+    dev_sync(&devs[slot]);
+    return;
+
+clean_fd:
+    close(fd);
+}
+
+/* dev_close - stops reading an event device
+ *  @dev : open device
+ *
+ * Keys held on the device are released.
+ */
+static void
+dev_close(struct evdev_dev *dev)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+    close(dev->fd);
+
+    dev->fd   = -1;
+    dev->down = 0;
+    publish_keys();
+}
+
+/* dev_read - processes all pending events of a device
+ *  @dev : open device
+ */
+static void
+dev_read(struct evdev_dev *dev)
+{
+    struct input_event ev[64];  /* read events */
+    ssize_t            n;       /* bytes read  */
+
+    while ((n = read(dev->fd, ev, sizeof(ev))) > 0) {
+        for (size_t i = 0; i < n / sizeof(*ev); i++) {
+            /* discard everything up to the next report, then resync */
+            if (dev->dropped) {
+                if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+                    dev->dropped = 0;
+                    dev_sync(dev);
+                }
+                continue;
+            }
+
+            if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+                dev->dropped = 1;
+                continue;
+            }
+
+            /* value is 0 (release), 1 (press) or 2 (auto-repeat) */
+            if (ev[i].type != EV_KEY || ev[i].value == 2)
+                continue;
+
+            for (size_t k = 0; k < n_keys; k++) {
+                if (codes[k] != ev[i].code)
+                    continue;
+
+                dev->down = (dev->down & ~(1 << k)) | !!ev[i].value << k;
+                publish_keys();
+            }
+        }
+    }
+
+    /* device was unplugged (ENODEV) or is otherwise unusable */
+    if (n == 0 || errno != EAGAIN) {
+        DEBUG("evdev: device closed (%s)", n ? strerror(errno) : "EOF");
+        dev_close(dev);
+    }
+}
+
+/* dev_scan - opens event devices that appeared in EVDEV_DIR
+ *
+ * Devices that are already open are skipped.
+ */
+static void
+dev_scan(void)
+{
+    char           path[sizeof(EVDEV_DIR) + 256];   /* device node */
+    DIR            *dir;                            /* EVDEV_DIR   */
+    struct dirent  *ent;                            /* dir entry   */
+
+    dir = opendir(EVDEV_DIR);
+    RET(!dir, , "unable to open %s (%s)", EVDEV_DIR, strerror(errno));
+
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "event", 5))
+            continue;
+
+        snprintf(path, sizeof(path), EVDEV_DIR "/%s", ent->d_name);
+        dev_open(path);
+    }
+
+    closedir(dir);
+}
+
+/* reader_main - waits for input on all devices until stopped
+ *  @arg : unused
+ *
+ *  @return : NULL
+ */
+static void *
+reader_main(void *arg)
+{
+    struct epoll_event ev[16];                  /* ready descriptors  */
+    uint8_t            buf[4096]                /* inotify events     */
+                       __attribute__((aligned(8)));
+    int32_t            n;                       /* ready / bytes read */
+
+    while (1) {
+        n = epoll_wait(epfd, ev, sizeof(ev) / sizeof(*ev), -1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        RET(n == -1, NULL, "unable to wait for input (%s)", strerror(errno));
+
+        for (int32_t i = 0; i < n; i++) {
+            switch (ev[i].data.u64) {
+                case TAG_STOP:
+                    return NULL;
+                case TAG_HOTPLUG:
+                    /* new nodes may still be inaccessible; rescan on every *
+                     * change (cheap, and hotplug is rare)                  */
+                    while (read(inofd, buf, sizeof(buf)) > 0)
+                        ;
+                    dev_scan();
+                    break;
+                default:
+                    dev_read(&devs[ev[i].data.u64]);
+                    break;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* evdev_start - starts reading keys from event devices
+ *  @keys : USB HID usage (i.e.: SDL scancode) of each chip8 key
+ *  @n    : number of chip8 keys
+ *  @cb   : called with (key, down) on every change of a key's state
+ *
+ *  @return : 0 if everything went well
+ *
+ * All keyboards in EVDEV_DIR are read directly on a dedicated thread; ones
+ * plugged in later (including uinput devices) are picked up as they appear.
+ * @cb runs on that thread and is its only caller, so it may act as the
+ * producer side of a single producer queue. Access to the device nodes
+ * usually requires membership in the "input" group.
+ */
+int32_t
+evdev_start(const uint32_t *keys, uint8_t n, void (*cb)(uint8_t, uint8_t))
+{
+    int32_t ans;    /* answer */
+
+    RET(n > sizeof(codes) / sizeof(*codes), -1, "too many keys: %hhu", n);
+
+    for (size_t k = 0; k < n; k++) {
+        codes[k] = keys[k] < sizeof(hid_keys) / sizeof(*hid_keys)
+                 ? hid_keys[keys[k]] : 0;
+        RET(!codes[k], -1, "key %zx has no evdev equivalent", k);
+    }
+
+    n_keys    = n;
+    publish   = cb;
+    published = 0;
+    for (size_t i = 0; i < EVDEV_MAX; i++)
+        devs[i].fd = -1;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    RET(epfd == -1, -1, "unable to create epoll instance (%s)",
+        strerror(errno));
+
+    stopfd = eventfd(0, EFD_CLOEXEC);
+    GOTO(stopfd == -1, clean_ep, "unable to create eventfd (%s)",
+         strerror(errno));
+
+    ans = epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &(struct epoll_event) {
+        .events   = EPOLLIN,
+        .data.u64 = TAG_STOP,
+    });
+    GOTO(ans == -1, clean_stop, "unable to watch eventfd (%s)",
+         strerror(errno));
+
+    /* not fatal; only devices present at startup will be read */
+    inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inofd == -1
+        || inotify_add_watch(inofd, EVDEV_DIR, IN_CREATE | IN_ATTRIB) == -1
+        || epoll_ctl(epfd, EPOLL_CTL_ADD, inofd, &(struct epoll_event) {
+               .events   = EPOLLIN,
+               .data.u64 = TAG_HOTPLUG,
+           }) == -1)
+        WAR("evdev: hotplug detection unavailable (%s)", strerror(errno));
+
+    dev_scan();
+
+    ans = pthread_create(&tid, NULL, reader_main, NULL);
+    GOTO(ans, clean_devs, "unable to create evdev thread (%s)",
+         strerror(ans));
+
+    return 0;
+
+clean_devs:
+    for (size_t i = 0; i < EVDEV_MAX; i++)
+        if (devs[i].fd != -1)
+            close(devs[i].fd);
+    if (inofd != -1)
+        close(inofd);
+clean_stop:
+    close(stopfd);
+clean_ep:
+    close(epfd);
+
+    return -1;
+}
+
+/* evdev_stop - stops reading keys and closes all devices
+ *
+ * The callback is not invoked once this returns.
+ */
+void
+evdev_stop(void)
+{
+    uint64_t one = 1;   /* eventfd increment */
+
+    if (write(stopfd, &one, sizeof(one)) != sizeof(one))
+        WAR("unable to stop evdev thread (%s)", strerror(errno));
+    pthread_join(tid, NULL);
+
+    for (size_t i = 0; i < EVDEV_MAX; i++)
+        if (devs[i].fd != -1)
+            close(devs[i].fd);
+    if (inofd != -1)
+        close(inofd);
+    close(stopfd);
+    close(epfd);
+}
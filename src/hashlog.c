@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>      /* fopen, fread, fwrite */
+#include <string.h>     /* strerror             */
+#include <errno.h>      /* errno                */
+
+#include "hashlog.h"
+#include "system.h"
+#include "tsc.h"
+#include "util.h"
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* rom_hash - calculates the FNV-1a hash of a ROM image
+ *  @rom : ROM contents
+ *  @len : size of ROM [bytes]
+ *
+ *  @return : 64-bit hash
+ */
+static uint64_t
+rom_hash(const uint8_t *rom, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325;    /* FNV offset basis */
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ rom[i]) * 0x100000001b3;
+
+    return h;
+}
+
+/* open_stream - opens a hash stream and reads its header
+ *  @path : stream file
+ *  @hdr  : stream header (output)
+ *
+ *  @return : open file or NULL on error
+ */
+static FILE *
+open_stream(const char *path, struct hashlog_hdr *hdr)
+{
+    FILE *f;    /* stream file */
+
+    f = fopen(path, "rb");
+    RET(!f, NULL, "unable to open %s (%s)", path, strerror(errno));
+
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != HASHLOG_MAGIC
+        || hdr->version != HASHLOG_VERSION)
+    {
+        ERROR("%s is not a hash stream (version %u)", path, HASHLOG_VERSION);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* hash_record - runs a ROM headless and writes a state hash per frame
+ *  @rom_path  : path to ROM file
+ *  @out       : hash stream output file
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @engines   : ENGINE_* flags
+ *  @frames    : number of 60Hz frames to run
+ *
+ *  @return : 0 if everything went well
+ *
+ * The ROM receives no input and CXKK is seeded with 0, as in --validate.
+ * After every frame, vm_hash() of the registers, stack, RAM and screen is
+ * appended to the stream (8 bytes per frame, little endian).
+ */
+int32_t
+hash_record(const char *rom_path,
+            const char *out,
+            uint16_t   freq,
+            uint16_t   rom_off,
+            uint16_t   font_off,
+            uint8_t    new_shift,
+            uint8_t    engines,
+            uint64_t   frames)
+{
+    static uint64_t    buf[HASHLOG_CHUNK];  /* pending hashes   */
+    uint8_t            rom[RAM_SZ];         /* ROM contents     */
+    struct chip8_vm    vm;                  /* emulated machine */
+    struct hashlog_hdr hdr = {              /* stream header    */
+        .magic     = HASHLOG_MAGIC,
+        .version   = HASHLOG_VERSION,
+        .freq      = freq,
+        .rom_off   = rom_off,
+        .font_off  = font_off,
+        .new_shift = new_shift,
+        .engines   = engines,
+    };
+    FILE               *f;                  /* stream file      */
+    int32_t            len;                 /* ROM size         */
+    int32_t            ans;                 /* answer           */
+    int32_t            ret = -1;            /* function status  */
+    size_t             n = 0;               /* pending hashes   */
+    uint64_t           t0 = tsc_ns();       /* start time       */
+
+    len = read_rom(rom_path, rom, sizeof(rom));
+    RET(len == -1, -1, "unable to read ROM");
+    hdr.rom_hash = rom_hash(rom, len);
+
+    ans = vm_init(&vm, freq, font_off, new_shift, engines, 0);
+    RET(ans, -1, "unable to initialize machine");
+    ans = vm_load(&vm, rom, len, rom_off);
+    GOTO(ans, clean_vm, "unable to load ROM");
+
+    f = fopen(out, "wb");
+    GOTO(!f, clean_vm, "unable to open %s (%s)", out, strerror(errno));
+    GOTO(fwrite(&hdr, sizeof(hdr), 1, f) != 1, clean_file,
+         "unable to write %s (%s)", out, strerror(errno));
+
+    for (uint64_t i = 0; i < frames; i++) {
+        vm_run(&vm, vm.batch_cycles);
+        buf[n++] = vm_hash(&vm);
+
+        if (n == HASHLOG_CHUNK || i == frames - 1) {
+            GOTO(fwrite(buf, sizeof(*buf), n, f) != n, clean_file,
+                 "unable to write %s (%s)", out, strerror(errno));
+            n = 0;
+        }
+    }
+
+    INFO("%lu frame hashes written to %s in %.3fs", frames, out,
+         (tsc_ns() - t0) / 1e9);
+    ret = 0;
+
+clean_file:
+    if (fclose(f))
+        ret = -1;
+clean_vm:
+    vm_free(&vm);
+
+    return ret;
+}
+
+/* hash_compare - reports the first frame at which two hash streams differ
+ *  @a : hash stream file
+ *  @b : hash stream file
+ *
+ *  @return : 0 if the streams are identical
+ *
+ * Streams recorded with different engines are expected to be identical;
+ * differences in any other setting or in the ROM are only warned about.
+ */
+int32_t
+hash_compare(const char *a, const char *b)
+{
+    static uint64_t    buf_a[HASHLOG_CHUNK];    /* hashes of a      */
+    static uint64_t    buf_b[HASHLOG_CHUNK];    /* hashes of b      */
+    struct hashlog_hdr ha, hb;                  /* stream headers   */
+    FILE               *fa, *fb;                /* stream files     */
+    uint64_t           frame = 0;               /* frames compared  */
+    uint64_t           batch;                   /* cycles per frame */
+    size_t             na, nb;                  /* hashes read      */
+    int32_t            ret = -1;                /* function status  */
+
+    fa = open_stream(a, &ha);
+    RET(!fa, -1, "unable to open hash stream");
+    fb = open_stream(b, &hb);
+    GOTO(!fb, clean_a, "unable to open hash stream");
+
+    /* same as the batch size of headless machines (see vm_init()) */
+    batch = ha.freq / TIMER_HZ ? ha.freq / TIMER_HZ : 1;
+
+    if (ha.rom_hash != hb.rom_hash)
+        WAR("streams were recorded from different ROMs");
+    if (ha.freq != hb.freq || ha.rom_off != hb.rom_off
+        || ha.font_off != hb.font_off || ha.new_shift != hb.new_shift)
+        WAR("streams were recorded with different settings");
+
+    do {
+        na = fread(buf_a, sizeof(*buf_a), HASHLOG_CHUNK, fa);
+        nb = fread(buf_b, sizeof(*buf_b), HASHLOG_CHUNK, fb);
+
+        for (size_t i = 0; i < na && i < nb; i++, frame++) {
+            if (buf_a[i] != buf_b[i]) {
+                ERROR("first divergence in frame %lu (cycles %lu to %lu)",
+                      frame, frame * batch, (frame + 1) * batch - 1);
+                goto clean_b;
+            }
+        }
+    } while (na == HASHLOG_CHUNK && nb == HASHLOG_CHUNK);
+
+    if (na != nb) {
+        ERROR("identical for %lu frames, then %s ends", frame,
+              na < nb ? a : b);
+        goto clean_b;
+    }
+
+    INFO("%lu frames identical", frame);
+    ret = 0;
+
+clean_b:
+    fclose(fb);
+clean_a:
+    fclose(fa);
+
+    return ret;
+}
@@ -0,0 +1,742 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Asynchronous ROM ingest for batch runs.
+ *
+ * A dedicated thread loads ROM files through io_uring into a pool of
+ * registered buffers and hands the images to the consumers through a
+ * queue. Either side sleeps on a condition variable while it has nothing to
+ * do. Each ROM is read by one linked chain of requests:
+ *
+ *   OPENAT (direct descriptor) -> STATX -> READ_FIXED -> CLOSE
+ *
+ * Only the OPENAT link is soft; the others are hard links so that the
+ * descriptor is closed even if STATX or READ_FIXED fail (e.g.: a short read
+ * counts as a failure). Buffer i always uses direct descriptor slot i.
+ *
+ * liburing is not required; the rings are set up via raw system calls. If
+ * io_uring is unavailable (old kernel, seccomp policy), lacks any of the
+ * above (direct descriptors need 5.15) or fails later on, ROMs are read with
+ * blocking calls on the same thread instead.
+ */
+
+#include <linux/io_uring.h> /* io_uring ABI                       */
+#include <linux/stat.h>     /* struct statx, STATX_SIZE           */
+#include <sys/syscall.h>    /* __NR_io_uring_*                    */
+#include <sys/mman.h>       /* mmap, munmap                       */
+#include <sys/uio.h>        /* struct iovec                       */
+#include <pthread.h>        /* pthread_*                          */
+#include <unistd.h>         /* syscall, close                     */
+#include <fcntl.h>          /* O_RDONLY, AT_FDCWD                 */
+#include <stdlib.h>         /* calloc, free                       */
+#include <string.h>         /* memset, strerror                   */
+#include <errno.h>          /* errno                              */
+
+#include "ingest.h"
+#include "system.h"
+#include "util.h"
+
+#define OP_OPEN         0                   /* chain position of OPENAT  */
+#define OP_STATX        1                   /* chain position of STATX   */
+#define OP_READ         2                   /* chain position of READ    */
+#define OP_CLOSE        3                   /* chain position of CLOSE   */
+#define CHAIN_LEN       4                   /* requests per ROM          */
+#define RING_ENTRIES    (INGEST_BUFS * CHAIN_LEN)
+#define PROBE_OPS       256                 /* io_uring_probe capacity   */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* state of one buffer while its ROM is being read */
+struct slot {
+    uint32_t     path;      /* index of ROM path          */
+    int32_t      len;       /* bytes read                 */
+    int32_t      err;       /* errno of first failure     */
+    uint8_t      pending;   /* outstanding completions    */
+    struct statx stx;       /* STATX result               */
+};
+
+/* single producer, single consumer lock-free buffer index queue *
+ * (multiple consumers / producers are serialized by ingest.lock)  */
+struct idx_ring {
+    uint32_t slot[INGEST_BUFS];     /* ring buffer           */
+    uint32_t head;                  /* next index to consume */
+    uint32_t tail;                  /* next free slot        */
+};
+
+/* mapped io_uring instance */
+struct uring {
+    int32_t             fd;         /* ring fd (-1 if unavailable) */
+    uint32_t            *sq_head;   /* consumed by kernel          */
+    uint32_t            *sq_tail;   /* produced by us              */
+    uint32_t            *sq_array;  /* SQE index indirection       */
+    uint32_t            sq_mask;    /* SQ index mask               */
+    uint32_t            *cq_head;   /* consumed by us              */
+    uint32_t            *cq_tail;   /* produced by kernel          */
+    uint32_t            cq_mask;    /* CQ index mask               */
+    struct io_uring_sqe *sqes;      /* submission queue entries    */
+    struct io_uring_cqe *cqes;      /* completion queue entries    */
+    void                *sq_ptr;    /* SQ ring mapping             */
+    void                *cq_ptr;    /* CQ ring mapping             */
+    size_t              sq_sz;      /* SQ ring mapping size        */
+    size_t              cq_sz;      /* CQ ring mapping size        */
+    size_t              sqes_sz;    /* SQE array mapping size      */
+};
+
+/* ingest pipeline */
+struct ingest {
+    char            **paths;                /* ROM paths                 */
+    uint32_t        n;                      /* number of ROM paths       */
+    uint32_t        next;                   /* next path to submit       */
+    uint8_t         *bufs;                  /* registered buffers        */
+    struct slot     slots[INGEST_BUFS];     /* per buffer read state     */
+    uint32_t        free[INGEST_BUFS];      /* idle buffers (own thread) */
+    uint32_t        n_free;                 /* number of idle buffers    */
+    uint32_t        queued;                 /* SQEs not yet submitted    */
+    uint32_t        in_flight;              /* chains not yet completed  */
+    struct uring    ring;                   /* io_uring instance         */
+    struct idx_ring ready;                  /* ingest -> consumer        */
+    struct idx_ring freed;                  /* consumer -> ingest        */
+    uint8_t         done;                   /* no more images will come  */
+    uint8_t         stop;                   /* consumer gave up          */
+    pthread_t       tid;                    /* ingest thread             */
+    pthread_mutex_t lock;                   /* consumer side + waits     */
+    pthread_cond_t  ready_cv;               /* ready pushed or done set  */
+    pthread_cond_t  freed_cv;               /* freed pushed or stop set  */
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* idx_push - appends a buffer index to a queue
+ *  @q   : queue
+ *  @idx : buffer index
+ *
+ * NOTE: never blocks; a queue can not hold more indices than there are buffers
+ */
+static inline void
+idx_push(struct idx_ring *q, uint32_t idx)
+{
+    q->slot[q->tail % INGEST_BUFS] = idx;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* idx_pop - removes a buffer index from a queue
+ *  @q   : queue
+ *  @idx : buffer index (output)
+ *
+ *  @return : 0 if an index was available; -1 otherwise
+ */
+static inline int32_t
+idx_pop(struct idx_ring *q, uint32_t *idx)
+{
+    if (q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return -1;
+
+    *idx = q->slot[q->head % INGEST_BUFS];
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* wake - wakes up all threads waiting on a condition
+ *  @ing  : ingest pipeline
+ *  @cond : condition variable
+ *
+ * NOTE: the change being signaled must be visible before this is called; a
+ *       waiter checks for it and goes to sleep while holding the lock, so
+ *       taking the lock here ensures that the wakeup is not lost
+ */
+static void
+wake(struct ingest *ing, pthread_cond_t *cond)
+{
+    pthread_mutex_lock(&ing->lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&ing->lock);
+}
+
+/* uring_init - creates an io_uring instance and registers buffers and files
+ *  @ing : ingest pipeline
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+uring_init(struct ingest *ing)
+{
+    struct uring           *r = &ing->ring;     /* shorthand         */
+    struct io_uring_params p;                   /* setup parameters  */
+    struct iovec           iov[INGEST_BUFS];    /* buffers           */
+    int32_t                fds[INGEST_BUFS];    /* sparse file table */
+    int64_t                ans;                 /* answer            */
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    RET(r->fd == -1, -1, "unable to create io_uring (%s)", strerror(errno));
+
+    /* map rings; since 5.4 both share one mapping */
+    r->sq_sz   = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_sz   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_sz = r->cq_sz = r->sq_sz > r->cq_sz ? r->sq_sz : r->cq_sz;
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    GOTO(r->sq_ptr == MAP_FAILED, clean_fd, "unable to map SQ ring (%s)",
+         strerror(errno));
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        GOTO(r->cq_ptr == MAP_FAILED, clean_sq, "unable to map CQ ring (%s)",
+             strerror(errno));
+    }
+
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    GOTO(r->sqes == MAP_FAILED, clean_cq, "unable to map SQEs (%s)",
+         strerror(errno));
+
+    r->sq_head  = r->sq_ptr + p.sq_off.head;
+    r->sq_tail  = r->sq_ptr + p.sq_off.tail;
+    r->sq_array = r->sq_ptr + p.sq_off.array;
+    r->sq_mask  = *(uint32_t *)(r->sq_ptr + p.sq_off.ring_mask);
+    r->cq_head  = r->cq_ptr + p.cq_off.head;
+    r->cq_tail  = r->cq_ptr + p.cq_off.tail;
+    r->cq_mask  = *(uint32_t *)(r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes     = r->cq_ptr + p.cq_off.cqes;
+
+    /* SQEs are always filled in ring order */
+    for (uint32_t i = 0; i < p.sq_entries; i++)
+        r->sq_array[i] = i;
+
+    /* register buffers and an empty direct descriptor table */
+    for (uint32_t i = 0; i < INGEST_BUFS; i++) {
+        iov[i].iov_base = ing->bufs + i * INGEST_BUF_SZ;
+        iov[i].iov_len  = INGEST_BUF_SZ;
+        fds[i]          = -1;
+    }
+
+    ans = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                  iov, INGEST_BUFS);
+    GOTO(ans == -1, clean_sqes, "unable to register buffers (%s)",
+         strerror(errno));
+
+    ans = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+                  fds, INGEST_BUFS);
+    GOTO(ans == -1, clean_sqes, "unable to register files (%s)",
+         strerror(errno));
+
+    return 0;
+
+clean_sqes:
+    munmap(r->sqes, r->sqes_sz);
+clean_cq:
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+clean_sq:
+    munmap(r->sq_ptr, r->sq_sz);
+clean_fd:
+    close(r->fd);
+    r->fd = -1;
+
+    return -1;
+}
+
+/* uring_fini - destroys an io_uring instance
+ *  @r : io_uring instance
+ */
+static void
+uring_fini(struct uring *r)
+{
+    if (r->fd == -1)
+        return;
+
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+    munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* uring_sqe - claims the next submission queue entry
+ *  @ing : ingest pipeline
+ *
+ *  @return : zeroed SQE
+ *
+ * NOTE: the SQ ring has room for a full chain per buffer and everything that
+ *       is queued is submitted before more chains are added
+ */
+static struct io_uring_sqe *
+uring_sqe(struct ingest *ing)
+{
+    struct uring        *r = &ing->ring;
+    struct io_uring_sqe *sqe;
+
+    sqe = &r->sqes[(*r->sq_tail + ing->queued++) & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/* uring_once - submits the one queued request and waits for it
+ *  @ing : ingest pipeline
+ *  @res : completion result (output)
+ *
+ *  @return : 0 if the request completed
+ *
+ * NOTE: only used before any chain is queued
+ */
+static int32_t
+uring_once(struct ingest *ing, int32_t *res)
+{
+    struct uring *r = &ing->ring;
+    uint32_t     head;      /* CQ head */
+    int64_t      ans;       /* answer  */
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + ing->queued, __ATOMIC_RELEASE);
+    ing->queued = 0;
+
+    ans = syscall(__NR_io_uring_enter, r->fd, 1, 1, IORING_ENTER_GETEVENTS,
+                  NULL, 0);
+    RET(ans == -1, -1, "unable to submit request (%s)", strerror(errno));
+
+    head = *r->cq_head;
+    RET(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE), -1,
+        "request did not complete");
+
+    *res = r->cqes[head & r->cq_mask].res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* uring_probe - checks that the kernel supports every request of a chain
+ *  @ing : ingest pipeline (with rings set up and files registered)
+ *
+ *  @return : 0 if chains can be used
+ *
+ * Setting up a ring succeeds on kernels that lack some opcodes (< 5.6) or
+ * direct descriptors (< 5.15); every chain would then fail. Opcodes are
+ * checked via IORING_REGISTER_PROBE. Older kernels ignore file_index and
+ * install a regular descriptor instead, so one direct OPENAT + CLOSE pair is
+ * tried as well (never a CLOSE of fd 0, as an old kernel would do).
+ */
+static int32_t
+uring_probe(struct ingest *ing)
+{
+    static const uint8_t   ops[] = {            /* opcodes of a chain */
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ_FIXED,
+        IORING_OP_CLOSE,
+    };
+    struct io_uring_probe  *probe;              /* supported opcodes  */
+    struct io_uring_sqe    *sqe;                /* trial request      */
+    int32_t                res;                 /* trial result       */
+    int64_t                ans;                 /* answer             */
+    int32_t                ret = -1;            /* function status    */
+
+    probe = calloc(1, sizeof(*probe) + PROBE_OPS * sizeof(*probe->ops));
+    RET(!probe, -1, "unable to allocate probe (%s)", strerror(errno));
+
+    ans = syscall(__NR_io_uring_register, ing->ring.fd, IORING_REGISTER_PROBE,
+                  probe, PROBE_OPS);
+    GOTO(ans == -1, out, "unable to probe io_uring (%s)", strerror(errno));
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+        GOTO(ops[i] > probe->last_op ||
+             !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED), out,
+             "io_uring opcode %hhu unsupported", ops[i]);
+
+    sqe = uring_sqe(ing);
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = (uintptr_t) "/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+
+    GOTO(uring_once(ing, &res), out, "unable to open direct descriptor");
+    if (res > 0)
+        close(res);
+    GOTO(res, out, "direct descriptors unsupported (%s)",
+         res > 0 ? "regular fd returned" : strerror(-res));
+
+    sqe = uring_sqe(ing);
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+
+    GOTO(uring_once(ing, &res), out, "unable to close direct descriptor");
+    GOTO(res, out, "unable to close direct descriptor (%s)", strerror(-res));
+
+    ret = 0;
+
+out:
+    free(probe);
+
+    return ret;
+}
+
+/* uring_fallback - switches to blocking reads after io_uring failed
+ *  @ing : ingest pipeline
+ *
+ * The ring is torn down and the ROMs of all chains in flight are read again
+ * with read_rom(), so that none of them is lost.
+ */
+static void
+uring_fallback(struct ingest *ing)
+{
+    struct slot *s;     /* buffer state */
+
+    uring_fini(&ing->ring);
+    ing->queued = 0;
+
+    for (uint32_t idx = 0; idx < INGEST_BUFS; idx++) {
+        s = &ing->slots[idx];
+        if (!s->pending)
+            continue;
+
+        s->pending = 0;
+        s->len     = read_rom(ing->paths[s->path],
+                              ing->bufs + idx * INGEST_BUF_SZ, INGEST_BUF_SZ);
+        ing->in_flight--;
+        idx_push(&ing->ready, idx);
+    }
+}
+
+/* queue_chain - queues the requests that read a ROM into a buffer
+ *  @ing  : ingest pipeline
+ *  @idx  : buffer index
+ */
+static void
+queue_chain(struct ingest *ing, uint32_t idx)
+{
+    struct slot         *s    = &ing->slots[idx];
+    const char          *path = ing->paths[s->path];
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(ing);
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->flags      = IOSQE_IO_LINK;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = (uintptr_t) path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = idx + 1;
+    sqe->user_data  = idx * CHAIN_LEN + OP_OPEN;
+
+    sqe = uring_sqe(ing);
+    sqe->opcode      = IORING_OP_STATX;
+    sqe->flags       = IOSQE_IO_HARDLINK;
+    sqe->fd          = AT_FDCWD;
+    sqe->addr        = (uintptr_t) path;
+    sqe->addr2       = (uintptr_t) &s->stx;
+    sqe->len         = STATX_SIZE;
+    sqe->user_data   = idx * CHAIN_LEN + OP_STATX;
+
+    sqe = uring_sqe(ing);
+    sqe->opcode    = IORING_OP_READ_FIXED;
+    sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd        = idx;
+    sqe->addr      = (uintptr_t) (ing->bufs + idx * INGEST_BUF_SZ);
+    sqe->len       = INGEST_BUF_SZ;
+    sqe->buf_index = idx;
+    sqe->user_data = idx * CHAIN_LEN + OP_READ;
+
+    sqe = uring_sqe(ing);
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->file_index = idx + 1;
+    sqe->user_data  = idx * CHAIN_LEN + OP_CLOSE;
+
+    s->len     = -1;
+    s->err     = 0;
+    s->pending = CHAIN_LEN;
+    ing->in_flight++;
+}
+
+/* complete - accounts one completion of a chain
+ *  @ing : ingest pipeline
+ *  @cqe : completion queue entry
+ *
+ * Requests that follow a failed one complete with -ECANCELED. The error of
+ * the request that actually failed is the one reported, regardless of the
+ * order in which completions arrive.
+ */
+static void
+complete(struct ingest *ing, struct io_uring_cqe *cqe)
+{
+    uint32_t    idx = cqe->user_data / CHAIN_LEN;
+    uint32_t    op  = cqe->user_data % CHAIN_LEN;
+    struct slot *s  = &ing->slots[idx];
+
+    if (cqe->res < 0 && op != OP_CLOSE && (!s->err || s->err == ECANCELED))
+        s->err = -cqe->res;
+    if (op == OP_READ && cqe->res >= 0)
+        s->len = cqe->res;
+
+    if (--s->pending)
+        return;
+
+    if (!s->err && s->stx.stx_size > INGEST_BUF_SZ)
+        s->err = EFBIG;
+    if (s->err) {
+        ERROR("unable to read ROM %s (%s)", ing->paths[s->path],
+              strerror(s->err));
+        s->len = -1;
+    }
+
+    ing->in_flight--;
+    idx_push(&ing->ready, idx);
+}
+
+/* uring_submit - submits queued chains and waits for completions
+ *  @ing : ingest pipeline
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+uring_submit(struct ingest *ing)
+{
+    struct uring *r = &ing->ring;
+    uint32_t     tail;      /* SQ tail */
+    uint32_t     head;      /* CQ head */
+    int64_t      ans;       /* answer  */
+
+    tail = *r->sq_tail + ing->queued;
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    ing->queued = 0;
+
+    /* whatever was not consumed last time is still in the SQ ring */
+    ans = syscall(__NR_io_uring_enter, r->fd,
+                  tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ans == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        RET(1, -1, "unable to submit ROM reads (%s)", strerror(errno));
+
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        complete(ing, &r->cqes[head++ & r->cq_mask]);
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* ingest_main - loads ROMs into free buffers until all paths are consumed
+ *  @arg : struct ingest
+ *
+ *  @return : NULL
+ */
+static void *
+ingest_main(void *arg)
+{
+    struct ingest *ing = arg;
+    uint32_t      idx;      /* buffer index */
+    int32_t       ans;      /* answer       */
+
+    while (ing->next < ing->n || ing->in_flight) {
+        /* take back buffers released by the consumer */
+        while (!idx_pop(&ing->freed, &idx))
+            ing->free[ing->n_free++] = idx;
+
+        if (__atomic_load_n(&ing->stop, __ATOMIC_RELAXED))
+            ing->next = ing->n;
+
+        /* all buffers are with the consumer; sleep until one is released */
+        if (ing->next < ing->n && !ing->n_free && !ing->in_flight) {
+            pthread_mutex_lock(&ing->lock);
+            while (ing->freed.head == __atomic_load_n(&ing->freed.tail,
+                                                      __ATOMIC_ACQUIRE)
+                   && !__atomic_load_n(&ing->stop, __ATOMIC_RELAXED))
+                pthread_cond_wait(&ing->freed_cv, &ing->lock);
+            pthread_mutex_unlock(&ing->lock);
+            continue;
+        }
+
+        for (; ing->n_free && ing->next < ing->n; ing->next++) {
+            idx = ing->free[--ing->n_free];
+            ing->slots[idx].path = ing->next;
+
+            if (ing->ring.fd != -1) {
+                queue_chain(ing, idx);
+                continue;
+            }
+
+            ing->slots[idx].len = read_rom(ing->paths[ing->next],
+                                           ing->bufs + idx * INGEST_BUF_SZ,
+                                           INGEST_BUF_SZ);
+            idx_push(&ing->ready, idx);
+        }
+
+        if (ing->in_flight) {
+            ans = uring_submit(ing);
+            if (ans) {
+                WAR("io_uring failed; falling back to blocking reads");
+                uring_fallback(ing);
+            }
+        }
+
+        wake(ing, &ing->ready_cv);
+    }
+
+    __atomic_store_n(&ing->done, 1, __ATOMIC_RELEASE);
+    wake(ing, &ing->ready_cv);
+
+    return NULL;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* ingest_start - starts loading a list of ROMs in the background
+ *  @paths : paths to ROM files
+ *  @n     : number of ROM files
+ *
+ *  @return : ingest pipeline or NULL on error
+ *
+ * Images are handed over in order of completion, not in order of @paths.
+ */
+struct ingest *
+ingest_start(char **paths, uint32_t n)
+{
+    struct ingest *ing;     /* ingest pipeline */
+    int32_t       ans;      /* answer          */
+
+    ing = calloc(1, sizeof(*ing));
+    RET(!ing, NULL, "unable to allocate ingest pipeline (%s)",
+        strerror(errno));
+
+    ing->paths = paths;
+    ing->n     = n;
+
+    pthread_mutex_init(&ing->lock, NULL);
+    pthread_cond_init(&ing->ready_cv, NULL);
+    pthread_cond_init(&ing->freed_cv, NULL);
+
+    ing->bufs = mmap(NULL, INGEST_BUFS * INGEST_BUF_SZ, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    GOTO(ing->bufs == MAP_FAILED, clean_ing, "unable to map buffers (%s)",
+         strerror(errno));
+
+    for (uint32_t i = 0; i < INGEST_BUFS; i++)
+        ing->free[ing->n_free++] = INGEST_BUFS - 1 - i;
+
+    ans = uring_init(ing);
+    if (!ans && uring_probe(ing)) {
+        uring_fini(&ing->ring);
+        ans = -1;
+    }
+    if (ans)
+        WAR("io_uring unavailable; falling back to blocking reads");
+
+    ans = pthread_create(&ing->tid, NULL, ingest_main, ing);
+    GOTO(ans, clean_ring, "unable to create thread (%s)", strerror(ans));
+
+    return ing;
+
+clean_ring:
+    uring_fini(&ing->ring);
+    munmap(ing->bufs, INGEST_BUFS * INGEST_BUF_SZ);
+clean_ing:
+    free(ing);
+
+    return NULL;
+}
+
+/* ingest_next - waits for the next ROM image
+ *  @ing : ingest pipeline
+ *  @img : ROM image (output)
+ *
+ *  @return : 0 if an image was returned; -1 if all ROMs were handed over
+ *
+ * The image's buffer must be given back with ingest_release() once its
+ * contents are no longer needed. Failed reads are also handed over (with
+ * a length of -1) and their buffers must be released as well. May be called
+ * by multiple threads; the caller sleeps while no image is ready.
+ */
+int32_t
+ingest_next(struct ingest *ing, struct rom_image *img)
+{
+    uint32_t idx;       /* buffer index      */
+    uint8_t  done;      /* producer finished */
+
+    pthread_mutex_lock(&ing->lock);
+    while (1) {
+        /* NOTE: read before popping, so that no image pushed before the *
+         *       ingest thread finished can be missed                    */
+        done = __atomic_load_n(&ing->done, __ATOMIC_ACQUIRE);
+
+        if (!idx_pop(&ing->ready, &idx))
+            break;
+        if (done) {
+            pthread_mutex_unlock(&ing->lock);
+            return -1;
+        }
+
+        pthread_cond_wait(&ing->ready_cv, &ing->lock);
+    }
+    pthread_mutex_unlock(&ing->lock);
+
+    img->path = ing->paths[ing->slots[idx].path];
+    img->rom  = ing->slots[idx].path;
+    img->data = ing->bufs + idx * INGEST_BUF_SZ;
+    img->len  = ing->slots[idx].len;
+    img->idx  = idx;
+
+    return 0;
+}
+
+/* ingest_release - gives a buffer back to the ingest thread
+ *  @ing : ingest pipeline
+ *  @img : ROM image returned by ingest_next()
+ *
+ * May be called by multiple threads.
+ */
+void
+ingest_release(struct ingest *ing, struct rom_image *img)
+{
+    pthread_mutex_lock(&ing->lock);
+    idx_push(&ing->freed, img->idx);
+    pthread_cond_signal(&ing->freed_cv);
+    pthread_mutex_unlock(&ing->lock);
+}
+
+/* ingest_stop - cancels pending ROMs and destroys the pipeline
+ *  @ing : ingest pipeline
+ *
+ * Reads that are already in flight are allowed to complete, since the kernel
+ * may still be writing into the registered buffers.
+ */
+void
+ingest_stop(struct ingest *ing)
+{
+    __atomic_store_n(&ing->stop, 1, __ATOMIC_RELAXED);
+    wake(ing, &ing->freed_cv);
+    pthread_join(ing->tid, NULL);
+
+    pthread_cond_destroy(&ing->freed_cv);
+    pthread_cond_destroy(&ing->ready_cv);
+    pthread_mutex_destroy(&ing->lock);
+    uring_fini(&ing->ring);
+    munmap(ing->bufs, INGEST_BUFS * INGEST_BUF_SZ);
+    free(ing);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "input.h"
+#include "util.h"
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* input_push - appends an event to the queue (producer side)
+ *  @q     : event queue
+ *  @cycle : emulated cycle starting with which the event is visible
+ *  @key   : chip8 key index
+ *  @down  : 1 if pressed, 0 if released
+ *
+ *  @return : 0 if everything went well; -1 if the queue is full
+ *
+ * Events must be pushed in non-decreasing cycle order.
+ */
+int32_t
+input_push(struct input_queue *q, uint64_t cycle, uint8_t key, uint8_t down)
+{
+    uint32_t tail = q->tail;                                    /* own    */
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE); /* remote */
+
+    RET(tail - head == INPUT_QUEUE_SZ, -1, "input queue full; event dropped");
+
+    q->ev[tail % INPUT_QUEUE_SZ] = (struct input_event) {
+        .cycle = cycle,
+        .key   = key,
+        .down  = down,
+    };
+
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* input_pop - removes the oldest event if it is visible (consumer side)
+ *  @q     : event queue
+ *  @cycle : current emulated cycle
+ *  @ev    : popped event
+ *
+ *  @return : 0 if an event was popped; -1 if none is visible yet
+ */
+int32_t
+input_pop(struct input_queue *q, uint64_t cycle, struct input_event *ev)
+{
+    uint32_t head = q->head;                                    /* own    */
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE); /* remote */
+
+    if (head == tail || q->ev[head % INPUT_QUEUE_SZ].cycle > cycle)
+        return -1;
+
+    *ev = q->ev[head % INPUT_QUEUE_SZ];
+
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
@@ -0,0 +1,531 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>     /* calloc, free */
+#include <string.h>     /* memset       */
+
+#include "ir.h"
+#include "util.h"
+
+/* register liveness bits; I is tracked alongside V0-VF */
+#define LIVE_I      (1U << 16)
+#define LIVE_ALL    0x1ffff
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* IR operations                                                   *
+ * NOTE: the *_NF variants do not compute VF (flag write was dead) */
+enum {
+    IR_NOP = 0,     /* eliminated instruction  */
+    IR_LD_IMM,      /* 6XKK                    */
+    IR_ADD_IMM,     /* 7XKK                    */
+    IR_MOV,         /* 8XY0                    */
+    IR_OR,          /* 8XY1                    */
+    IR_AND,         /* 8XY2                    */
+    IR_XOR,         /* 8XY3                    */
+    IR_ADD,         /* 8XY4                    */
+    IR_SUB,         /* 8XY5                    */
+    IR_SHR,         /* 8XY6                    */
+    IR_SUBN,        /* 8XY7                    */
+    IR_SHL,         /* 8XYE                    */
+    IR_OR_NF,
+    IR_AND_NF,
+    IR_XOR_NF,
+    IR_ADD_NF,
+    IR_SUB_NF,
+    IR_SHR_NF,
+    IR_SUBN_NF,
+    IR_SHL_NF,
+    IR_LD_I,        /* ANNN                    */
+    IR_ADD_I,       /* FX1E                    */
+    IR_ADD_I_NF,
+    IR_FONT,        /* FX29                    */
+};
+
+/* offset between an 8XY* IR op that writes VF and its flagless variant */
+#define IR_NF_OFF   (IR_OR_NF - IR_OR)
+
+/* single IR instruction */
+struct ir_ins {
+    uint8_t  op;        /* IR_* operation          */
+    uint8_t  x;         /* destination register    */
+    uint8_t  y;         /* source register         */
+    uint16_t imm;       /* immediate value         */
+};
+
+/* straight-line sequence of side-effect free instructions */
+struct ir_block {
+    uint16_t      end_pc;           /* PC after block execution       */
+    uint8_t       cycles;           /* number of original instructions */
+    uint8_t       len;              /* number of IR instructions      */
+    struct ir_ins ins[IR_MAX_LEN];  /* optimized instructions         */
+};
+
+/* per-machine block cache */
+struct ir_cache {
+    struct ir_block *blocks[RAM_SZ];    /* block starting at each address */
+    uint8_t         new_shift;          /* use new shift operations       */
+    uint16_t        font_offset;        /* font sprites offset in RAM     */
+    size_t          flags_elim;         /* dead VF computations removed   */
+    size_t          ins_elim;           /* instructions removed           */
+    size_t          hits;               /* block executions               */
+};
+
+/* placeholder for addresses where no block can be formed */
+static struct ir_block no_block = { 0 };
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* ir_decode - translates one instruction to IR (if side-effect free)
+ *  @cache : block cache (for decoding preferences)
+ *  @ins   : instruction (host byte order)
+ *  @out   : IR instruction
+ *
+ *  @return : 0 if instruction can be part of a block
+ */
+static int32_t
+ir_decode(struct ir_cache *cache, uint16_t ins, struct ir_ins *out)
+{
+    out->x   = (ins & 0x0f00) >> 8;
+    out->y   = (ins & 0x00f0) >> 4;
+    out->imm = ins & 0x00ff;
+
+    switch ((ins & 0xf000) >> 12) {
+        case 0x6:
+            out->op = IR_LD_IMM;
+            return 0;
+        case 0x7:
+            out->op = IR_ADD_IMM;
+            return 0;
+        case 0x8:
+            switch (ins & 0x000f) {
+                case 0x0: out->op = IR_MOV;  return 0;
+                case 0x1: out->op = IR_OR;   return 0;
+                case 0x2: out->op = IR_AND;  return 0;
+                case 0x3: out->op = IR_XOR;  return 0;
+                case 0x4: out->op = IR_ADD;  return 0;
+                case 0x5: out->op = IR_SUB;  return 0;
+                case 0x6: out->op = IR_SHR;  break;
+                case 0x7: out->op = IR_SUBN; return 0;
+                case 0xe: out->op = IR_SHL;  break;
+                default:  return -1;
+            }
+
+            /* shift source register depends on interpretation */
+            if (cache->new_shift)
+                out->y = out->x;
+            return 0;
+        case 0xa:
+            out->op  = IR_LD_I;
+            out->imm = ins & 0x0fff;
+            return 0;
+        case 0xf:
+            switch (ins & 0x00ff) {
+                case 0x1e: out->op = IR_ADD_I; return 0;
+                case 0x29: out->op = IR_FONT;  return 0;
+                default:   return -1;
+            }
+    }
+
+    return -1;
+}
+
+/* ir_effects - determines registers read / written by an IR instruction
+ *  @ins  : IR instruction
+ *  @uses : bitmask of read registers
+ *  @defs : bitmask of written registers (excluding VF as flag)
+ *
+ *  @return : 1 if the instruction also writes VF as a flag
+ */
+static uint8_t
+ir_effects(struct ir_ins *ins, uint32_t *uses, uint32_t *defs)
+{
+    uint32_t x = 1U << ins->x;
+    uint32_t y = 1U << ins->y;
+
+    switch (ins->op) {
+        case IR_LD_IMM:
+            *uses = 0;      *defs = x;      return 0;
+        case IR_ADD_IMM:
+            *uses = x;      *defs = x;      return 0;
+        case IR_MOV:
+            *uses = y;      *defs = x;      return 0;
+        case IR_SHR:
+        case IR_SHL:
+            *uses = y;      *defs = x;      return 1;
+        case IR_SHR_NF:
+        case IR_SHL_NF:
+            *uses = y;      *defs = x;      return 0;
+        case IR_OR:  case IR_AND:  case IR_XOR:
+        case IR_ADD: case IR_SUB:  case IR_SUBN:
+            *uses = x | y;  *defs = x;      return 1;
+        case IR_OR_NF:  case IR_AND_NF:  case IR_XOR_NF:
+        case IR_ADD_NF: case IR_SUB_NF:  case IR_SUBN_NF:
+            *uses = x | y;  *defs = x;      return 0;
+        case IR_LD_I:
+            *uses = 0;      *defs = LIVE_I; return 0;
+        case IR_ADD_I:
+            *uses = x | LIVE_I; *defs = LIVE_I; return 1;
+        case IR_ADD_I_NF:
+            *uses = x | LIVE_I; *defs = LIVE_I; return 0;
+        case IR_FONT:
+            *uses = x;      *defs = LIVE_I; return 0;
+    }
+
+    *uses = *defs = 0;
+    return 0;
+}
+
+/* ir_fold - constant folding of 6XKK / 7XKK / 8XY0 chains
+ *  @blk : block being optimized
+ *
+ * Additions to registers with known values become loads; consecutive
+ * additions to the same register (with no access in between) are merged.
+ * Loads made redundant by this are removed later, by ir_dce().
+ */
+static void
+ir_fold(struct ir_block *blk)
+{
+    uint8_t  val[16];               /* known register values           */
+    uint32_t known = 0;             /* bitmask of known registers      */
+    int16_t  last_add[16];          /* pending IR_ADD_IMM per register */
+    uint32_t uses, defs;            /* instruction effects             */
+    uint8_t  flag;                  /* instruction writes VF           */
+
+    memset(last_add, 0xff, sizeof(last_add));
+
+    for (size_t i = 0; i < blk->len; i++) {
+        struct ir_ins *ins = &blk->ins[i];
+
+        /* known value plus immediate is a known value */
+        if (ins->op == IR_ADD_IMM && known & (1U << ins->x)) {
+            ins->op  = IR_LD_IMM;
+            ins->imm = (val[ins->x] + ins->imm) & 0xff;
+        }
+        /* merge with a previous addition to the same register */
+        else if (ins->op == IR_ADD_IMM && last_add[ins->x] >= 0) {
+            blk->ins[last_add[ins->x]].imm += ins->imm;
+            blk->ins[last_add[ins->x]].imm &= 0xff;
+            ins->op = IR_NOP;
+            continue;
+        }
+        /* copy of a known value is a known value */
+        else if (ins->op == IR_MOV && known & (1U << ins->y)) {
+            ins->op  = IR_LD_IMM;
+            ins->imm = val[ins->y];
+        }
+
+        flag = ir_effects(ins, &uses, &defs);
+        if (flag)
+            defs |= 1U << 15;
+
+        /* any other access breaks a pending addition */
+        for (size_t r = 0; r < 16; r++)
+            if ((uses | defs) & (1U << r))
+                last_add[r] = -1;
+
+        known &= ~defs;
+
+        if (ins->op == IR_LD_IMM) {
+            known |= 1U << ins->x;
+            val[ins->x] = ins->imm;
+        } else if (ins->op == IR_ADD_IMM) {
+            last_add[ins->x] = i;
+        }
+    }
+}
+
+/* ir_dce - liveness-based dead code elimination
+ *  @cache : block cache (for statistics)
+ *  @blk   : block being optimized
+ *
+ * All registers are considered live at the end of the block. Walking it
+ * backwards, flag computations whose VF value is overwritten before being
+ * read are dropped, as are instructions whose results are never read.
+ */
+static void
+ir_dce(struct ir_cache *cache, struct ir_block *blk)
+{
+    uint32_t live = LIVE_ALL;       /* registers live after instruction */
+    uint32_t uses, defs;            /* instruction effects              */
+    uint8_t  flag;                  /* instruction writes VF            */
+
+    for (int32_t i = blk->len - 1; i >= 0; i--) {
+        struct ir_ins *ins = &blk->ins[i];
+
+        if (ins->op == IR_NOP)
+            continue;
+
+        flag = ir_effects(ins, &uses, &defs);
+
+        /* the flag write is dead; VF as destination is left untouched *
+         * because flag and result writes are ordered differently      */
+        if (flag && !(live & (1U << 15)) && !(defs & (1U << 15))) {
+            ins->op = ins->op == IR_ADD_I ? IR_ADD_I_NF : ins->op + IR_NF_OFF;
+            flag = 0;
+            cache->flags_elim++;
+        }
+
+        /* instruction result is never read */
+        if (!flag && !(live & defs)) {
+            ins->op = IR_NOP;
+            cache->ins_elim++;
+            continue;
+        }
+
+        if (flag)
+            defs |= 1U << 15;
+
+        live = (live & ~defs) | uses;
+    }
+}
+
+/* ir_compile - builds an optimized block starting at a given address
+ *  @cache : block cache
+ *  @ram   : emulated system RAM
+ *  @pc    : address of first instruction
+ *
+ *  @return : new block or &no_block if fewer than 2 instructions qualify
+ */
+static struct ir_block *
+ir_compile(struct ir_cache *cache, uint8_t *ram, uint16_t pc)
+{
+    struct ir_block blk = { 0 };    /* block under construction */
+    struct ir_block *ret;           /* compacted block          */
+    uint16_t        ins;            /* fetched instruction      */
+    uint8_t         len = 0;        /* compacted length         */
+
+    /* gather side-effect free instructions */
+    while (blk.len < IR_MAX_LEN && pc + blk.len * 2 < RAM_SZ - 1) {
+        ins = ram[pc + blk.len * 2] << 8 | ram[pc + blk.len * 2 + 1];
+        if (ir_decode(cache, ins, &blk.ins[blk.len]))
+            break;
+        blk.len++;
+    }
+
+    if (blk.len < 2)
+        return &no_block;
+
+    blk.cycles = blk.len;
+    blk.end_pc = pc + blk.len * 2;
+
+    ir_fold(&blk);
+    ir_dce(cache, &blk);
+
+    /* drop eliminated instructions */
+    for (size_t i = 0; i < blk.len; i++)
+        if (blk.ins[i].op != IR_NOP)
+            blk.ins[len++] = blk.ins[i];
+    blk.len = len;
+
+    ret = malloc(sizeof(*ret));
+    RET(!ret, &no_block, "unable to allocate IR block");
+    memcpy(ret, &blk, sizeof(blk));
+
+    return ret;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* ir_cache_create - allocates an empty block cache
+ *  @new_shift   : use new implementation of shift operations
+ *  @font_offset : font sprites offset into RAM [bytes]
+ *
+ *  @return : block cache or NULL on error
+ */
+struct ir_cache *
+ir_cache_create(uint8_t new_shift, uint16_t font_offset)
+{
+    struct ir_cache *cache;     /* new cache */
+
+    cache = calloc(1, sizeof(*cache));
+    RET(!cache, NULL, "unable to allocate IR cache");
+
+    cache->new_shift   = new_shift;
+    cache->font_offset = font_offset;
+
+    return cache;
+}
+
+/* ir_cache_destroy - frees a block cache and all its blocks
+ *  @cache : block cache
+ */
+void
+ir_cache_destroy(struct ir_cache *cache)
+{
+    if (!cache)
+        return;
+
+    ir_invalidate(cache, 0, RAM_SZ);
+    free(cache);
+}
+
+/* ir_invalidate - discards blocks overlapping a RAM write
+ *  @cache : block cache
+ *  @addr  : start of written region
+ *  @len   : size of written region [bytes]
+ */
+void
+ir_invalidate(struct ir_cache *cache, uint16_t addr, uint16_t len)
+{
+    size_t start = addr >= IR_MAX_LEN * 2 ? addr - IR_MAX_LEN * 2 + 1 : 0;
+    size_t end   = addr + len < RAM_SZ ? addr + len : RAM_SZ;
+
+    for (size_t i = start; i < end; i++) {
+        if (cache->blocks[i] && cache->blocks[i] != &no_block)
+            free(cache->blocks[i]);
+        cache->blocks[i] = NULL;
+    }
+}
+
+/* ir_exec - executes the block starting at PC (if any)
+ *  @cache : block cache
+ *  @ram   : emulated system RAM
+ *  @regs  : system registers
+ *  @max   : max number of cycles the block may consume
+ *
+ *  @return : number of cycles consumed by the block
+ *            0 if no block (short enough) could be formed at PC
+ */
+uint8_t
+ir_exec(struct ir_cache *cache, uint8_t *ram, struct chip8_regs *regs,
+        uint64_t max)
+{
+    struct ir_block *blk;       /* block at PC                */
+    uint8_t         Vx, Vy;     /* backup of source registers */
+
+    /* lazily compile the block at PC */
+    blk = cache->blocks[regs->PC];
+    if (unlikely(!blk))
+        blk = cache->blocks[regs->PC] = ir_compile(cache, ram, regs->PC);
+    if (blk == &no_block || blk->cycles > max)
+        return 0;
+
+    cache->hits++;
+
+    for (size_t i = 0; i < blk->len; i++) {
+        struct ir_ins *ins = &blk->ins[i];
+
+        Vx = regs->V[ins->x];
+        Vy = regs->V[ins->y];
+
+        /* NOTE: flag / result write order mirrors the ins_8XY* handlers */
+        switch (ins->op) {
+            case IR_LD_IMM:
+                regs->V[ins->x] = ins->imm;
+                break;
+            case IR_ADD_IMM:
+                regs->V[ins->x] += ins->imm;
+                break;
+            case IR_MOV:
+                regs->V[ins->x] = Vy;
+                break;
+            case IR_OR:
+                regs->V[ins->x] = Vx | Vy;
+                regs->VF = 0x00;
+                break;
+            case IR_AND:
+                regs->V[ins->x] = Vx & Vy;
+                regs->VF = 0x00;
+                break;
+            case IR_XOR:
+                regs->V[ins->x] = Vx ^ Vy;
+                regs->VF = 0x00;
+                break;
+            case IR_ADD:
+                regs->VF = (Vx + Vy) > 0xff;
+                regs->V[ins->x] = Vx + Vy;
+                break;
+            case IR_SUB:
+                regs->VF = Vx > Vy;
+                regs->V[ins->x] = Vx - Vy;
+                break;
+            case IR_SHR:
+                regs->V[ins->x] = Vy >> 1;
+                regs->VF = Vy & 0x01;
+                break;
+            case IR_SUBN:
+                regs->VF = Vy > Vx;
+                regs->V[ins->x] = Vy - Vx;
+                break;
+            case IR_SHL:
+                regs->V[ins->x] = Vy << 1;
+                regs->VF = (Vy & 0x80) >> 7;
+                break;
+            case IR_OR_NF:
+                regs->V[ins->x] = Vx | Vy;
+                break;
+            case IR_AND_NF:
+                regs->V[ins->x] = Vx & Vy;
+                break;
+            case IR_XOR_NF:
+                regs->V[ins->x] = Vx ^ Vy;
+                break;
+            case IR_ADD_NF:
+                regs->V[ins->x] = Vx + Vy;
+                break;
+            case IR_SUB_NF:
+                regs->V[ins->x] = Vx - Vy;
+                break;
+            case IR_SHR_NF:
+                regs->V[ins->x] = Vy >> 1;
+                break;
+            case IR_SUBN_NF:
+                regs->V[ins->x] = Vy - Vx;
+                break;
+            case IR_SHL_NF:
+                regs->V[ins->x] = Vy << 1;
+                break;
+            case IR_LD_I:
+                regs->I = ins->imm;
+                break;
+            case IR_ADD_I:
+                regs->I += Vx;
+                regs->VF = regs->I > 0x0fff;
+                regs->I &= 0x0fff;
+                break;
+            case IR_ADD_I_NF:
+                regs->I = (regs->I + Vx) & 0x0fff;
+                break;
+            case IR_FONT:
+                regs->I = cache->font_offset + 5 * (Vx & 0x0f);
+                break;
+        }
+    }
+
+    regs->PC = blk->end_pc;
+    return blk->cycles;
+}
+
+/* ir_report - prints block execution statistics
+ *  @cache : block cache
+ */
+void
+ir_report(struct ir_cache *cache)
+{
+    DEBUG("IR blocks: %lu executions, %lu dead VF writes removed, "
+          "%lu dead instructions removed",
+          cache->hits, cache->flags_elim, cache->ins_elim);
+}
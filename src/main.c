@@ -23,6 +23,14 @@
 #include "system.h"
 #include "display.h"
 #include "sound.h"
+#include "stats.h"
+#include "soak.h"
+#include "validate.h"
+#include "catalog.h"
+#include "session.h"
+#include "hashlog.h"
+#include "dataset.h"
+#include "tsc.h"
 #include "util.h"
 
 int32_t main(int32_t argc, char *argv[])
@@ -31,11 +39,76 @@ int32_t main(int32_t argc, char *argv[])
     int32_t ret = -1;   /* exit code */
 
     /* parse command line arguments */
-    argp_parse(&argp, argc, argv, 0, 0, &settings);
+    ans = argp_parse(&argp, argc, argv, 0, 0, &settings);
+    DIE(ans, "unable to parse arguments");
     DIE(!settings.rom_path,  "No ROM provided");
     DIE(!settings.scale_f,   "Scale factor 0 not allowed");
     DIE(!settings.frequency, "CPU frequency 0 not allowed");
+
+    /* all instrumentation timestamps come from the TSC, if usable */
+    tsc_init();
+
+    /* differential validation runs headless; no display or audio needed */
+    if (settings.validate) {
+        ans = validate_roms(settings.rom_paths, settings.rom_count,
+                            settings.validate,  settings.frequency,
+                            settings.rom_off,   settings.font_off,
+                            settings.new_shift, settings.frames);
+        return ans ? -1 : 0;
+    }
+
+    /* ROM library indexing runs headless as well */
+    if (settings.catalog) {
+        ans = catalog_roms(settings.rom_paths,  settings.rom_count,
+                           settings.catalog,    settings.frequency,
+                           settings.rom_off,    settings.font_off,
+                           settings.new_shift,  settings.frames);
+        return ans ? -1 : 0;
+    }
+
+    /* so do hosted sessions */
+    if (settings.sessions) {
+        ans = host_sessions(settings.rom_paths,  settings.rom_count,
+                            settings.sessions,   settings.frequency,
+                            settings.rom_off,    settings.font_off,
+                            settings.new_shift,  settings.frames,
+                            settings.session_in);
+        return ans ? -1 : 0;
+    }
+
+    /* and so does training data generation */
+    if (settings.dataset) {
+        ans = dataset_gen(settings.rom_paths,  settings.rom_count,
+                          settings.dataset,    settings.policy,
+                          settings.ram_bytes,  settings.episodes,
+                          settings.frequency,  settings.rom_off,
+                          settings.font_off,   settings.new_shift,
+                          settings.frames);
+        return ans ? -1 : 0;
+    }
+
+    /* state hash streams are recorded and compared headless */
+    if (settings.hash_cmp) {
+        DIE(settings.rom_count > 1, "Too many arguments");
+        ans = hash_compare(settings.hash_cmp, settings.rom_path);
+        return ans ? -1 : 0;
+    }
+
+    if (settings.hash_stream) {
+        DIE(settings.rom_count > 1, "Too many arguments");
+        ans = hash_record(settings.rom_path,  settings.hash_stream,
+                          settings.frequency, settings.rom_off,
+                          settings.font_off,  settings.new_shift,
+                          (settings.fuse ? ENGINE_FUSE : 0)
+                          | (settings.ir ? ENGINE_IR : 0),
+                          settings.frames);
+        return ans ? -1 : 0;
+    }
+
+    DIE(settings.rom_count > 1, "Too many arguments");
     DIE(!settings.ref_int,   "Screen refresh interval 0 not allowed");
+    DIE(settings.soak_uncap && (settings.vsync || settings.auto_freq),
+        "--soak-uncapped excludes --vsync and --auto-freq");
     GOTO(settings.audio_idx < 0, invalid_audio_dev,
          "No audio device selected; pick from the following:");
 
@@ -44,19 +117,46 @@ int32_t main(int32_t argc, char *argv[])
     DIE(ans, "unable to initialize sound system");
 
     /* initialize system RAM */
-    ans = init_system(settings.rom_off,   settings.font_off,
+    ans = init_system(settings.frequency,
+                      settings.rom_off,   settings.font_off,
                       settings.rom_path,  settings.ref_int,
-                      settings.new_shift, settings.lazy_render);
+                      settings.new_shift, settings.lazy_render,
+                      settings.fuse,      settings.ir,
+                      settings.vsync,     settings.auto_freq,
+                      settings.debug_ops, settings.evdev,
+                      settings.soak && settings.soak_uncap);
     GOTO(ans, cleanup_sound, "unable to initialize system");
 
     /* initialize display */
-    ans = init_display(settings.scale_f);
+    ans = init_display(settings.scale_f,  settings.vsync,
+                       settings.phosphor, settings.phos_decay);
     GOTO(ans, cleanup_sound, "unable to initialize display");
 
+    /* enable frame budget accounting */
+    if (settings.stats_int) {
+        ans = stats_init(settings.frequency, settings.stats_int);
+        GOTO(ans, cleanup_sound, "unable to initialize frame statistics");
+    }
+
+    /* sample resource usage for the duration of the run */
+    if (settings.soak) {
+        ans = soak_start(settings.soak_secs, settings.soak_csv);
+        GOTO(ans, cleanup_sound, "unable to start soak telemetry");
+    }
+
     /* start the CPU */
     ans = sys_start(settings.frequency, settings.rom_off);
     GOTO(ans, cleanup_sound, "unable to initialize system CPU");
 
+    /* fail the run if any resource kept growing */
+    if (settings.soak) {
+        ans = soak_stop();
+        GOTO(ans, cleanup_sound, "soak test failed");
+    }
+
+    /* end-of-run frame budget report */
+    stats_report();
+
     /* normal termination path */
     ret = 0;
     goto cleanup_sound;
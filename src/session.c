@@ -0,0 +1,461 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>        /* pthread_*                   */
+#include <poll.h>           /* poll                        */
+#include <ucontext.h>       /* {get,make,swap}context      */
+#include <unistd.h>         /* close, unlink               */
+#include <stdio.h>          /* sscanf                      */
+#include <stdlib.h>         /* calloc, malloc, free        */
+#include <string.h>         /* strerror, strlen, strtok_r  */
+#include <errno.h>          /* errno                       */
+#include <time.h>           /* clock_{gettime,nanosleep}   */
+#include <sys/resource.h>   /* getrusage                   */
+#include <sys/socket.h>     /* socket, bind, recv          */
+#include <sys/un.h>         /* sockaddr_un                 */
+
+#include "session.h"
+#include "slab.h"
+#include "system.h"
+#include "util.h"
+
+#define MAX_WORKERS     64          /* upper bound on worker threads */
+#define SESSION_STACK   (64 << 10)  /* coroutine stack size [bytes]  */
+#define FRAME_NS        (1000000000UL / TIMER_HZ)
+#define INPUT_MSG_SZ    4096        /* max input datagram size       */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* one live machine, run as a coroutine */
+struct session {
+    struct chip8_vm vm;         /* emulated machine            */
+    ucontext_t      ctx;        /* coroutine context           */
+    uint8_t         *stack;     /* coroutine stack             */
+    uint64_t        frames;     /* frames left to run          */
+    uint64_t        deadline;   /* start of next frame [ns]    */
+    struct session  *next;      /* next in worker's run queue  */
+};
+
+/* OS thread multiplexing a fixed set of sessions                          *
+ * NOTE: all sessions have the same frame period, so appending a session   *
+ *       at the tail after each frame keeps the run queue sorted by        *
+ *       deadline                                                          */
+struct worker {
+    pthread_t       tid;        /* worker thread               */
+    ucontext_t      ctx;        /* scheduler context           */
+    struct session  *head;      /* run queue (earliest first)  */
+    struct session  *tail;      /* run queue end               */
+    struct session  *cur;       /* currently running session   */
+    uint64_t        frames;     /* frames run                  */
+    uint64_t        late;       /* frames started too late     */
+};
+
+static __thread struct worker *self;    /* worker of calling thread */
+static uint32_t live_workers = 0;       /* workers not yet finished */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* now_ns - returns the current monotonic time
+ *  @return : time [ns]
+ */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;     /* current time */
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* session_main - coroutine body of a session
+ *
+ * Runs one 60Hz frame worth of cycles, then yields to the worker until the
+ * start of the next frame. Key waits (FX0A) and DT polling loops do not
+ * spin until the frame is over; they are fast-forwarded (see vm_run()).
+ */
+static void
+session_main(void)
+{
+    struct session *s = self->cur;  /* this session */
+
+    while (s->frames) {
+        vm_run(&s->vm, s->vm.batch_cycles);
+        s->frames--;
+        swapcontext(&s->ctx, &self->ctx);
+    }
+}
+
+/* worker_main - runs sessions as their frames come due
+ *  @arg : struct worker
+ *
+ *  @return : NULL
+ */
+static void *
+worker_main(void *arg)
+{
+    struct worker   *w = arg;   /* this worker      */
+    struct session  *s;         /* due session      */
+    struct timespec ts;         /* session deadline */
+    uint64_t        now;        /* current time     */
+
+    self = w;
+
+    while ((s = w->head)) {
+        w->head = s->next;
+
+        now = now_ns();
+        if (now < s->deadline) {
+            ts.tv_sec  = s->deadline / 1000000000UL;
+            ts.tv_nsec = s->deadline % 1000000000UL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                   == EINTR)
+                ;
+        } else if (now - s->deadline > FRAME_NS) {
+            w->late++;
+        }
+
+        w->cur = s;
+        swapcontext(&w->ctx, &s->ctx);
+        w->frames++;
+
+        /* finished sessions are never resumed */
+        if (!s->frames)
+            continue;
+
+        /* missed frames are caught up on, to stay in step with host time */
+        s->deadline += FRAME_NS;
+        s->next      = NULL;
+        if (w->head)
+            w->tail->next = s;
+        else
+            w->head = s;
+        w->tail = s;
+    }
+
+    __atomic_sub_fetch(&live_workers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* input_open - binds the session input socket
+ *  @path : socket path
+ *
+ *  @return : socket descriptor or -1 on error
+ */
+static int32_t
+input_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };  /* socket address */
+    int32_t            fd;                                /* socket         */
+    int32_t            ans;                               /* answer         */
+
+    RET(strlen(path) >= sizeof(addr.sun_path), -1,
+        "socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    RET(fd == -1, -1, "unable to create socket (%s)", strerror(errno));
+
+    ans = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    GOTO(ans, clean_fd, "unable to bind %s (%s)", path, strerror(errno));
+
+    return fd;
+
+clean_fd:
+    close(fd);
+    return -1;
+}
+
+/* input_feed - forwards all pending key state changes to their sessions
+ *  @fd       : session input socket
+ *  @ss       : sessions
+ *  @sessions : number of sessions
+ *
+ * Each datagram holds one or more "SESSION KEY DOWN" lines (e.g.: "3 a 1"
+ * presses key A on the fourth session). Malformed lines are skipped.
+ *
+ * NOTE: this is the only producer for the input queues of all sessions.
+ *       Events are applied at frame boundaries only (see vm_frame()), so
+ *       they are stamped as visible right away and take effect at the start
+ *       of the session's next frame, as with the interactive machine.
+ */
+static void
+input_feed(int32_t fd, struct session **ss, uint32_t sessions)
+{
+    char     msg[INPUT_MSG_SZ + 1];     /* received datagram    */
+    char     *line;                     /* current line         */
+    char     *save;                     /* strtok_r state       */
+    ssize_t  len;                       /* datagram size        */
+    uint32_t id;                        /* session index        */
+    uint8_t  key;                       /* chip8 key index      */
+    uint8_t  down;                      /* 1 if pressed         */
+
+    while ((len = recv(fd, msg, INPUT_MSG_SZ, MSG_DONTWAIT)) > 0) {
+        msg[len] = '\0';
+
+        for (line = strtok_r(msg, "\n", &save); line;
+             line = strtok_r(NULL, "\n", &save))
+        {
+            if (sscanf(line, "%u %hhx %hhu", &id, &key, &down) != 3
+                || id >= sessions || key > 0xf || down > 1)
+            {
+                WAR("malformed session input: %s", line);
+                continue;
+            }
+
+            input_push(&ss[id]->vm.input_q, 0, key, down);
+        }
+    }
+}
+
+/* session_init - creates a session and its coroutine
+ *  @s         : session
+ *  @w         : worker that will run it
+ *  @rom       : ROM contents
+ *  @len       : ROM size [bytes]
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @frames    : number of frames to run
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+session_init(struct session *s,
+             struct worker  *w,
+             const uint8_t  *rom,
+             int32_t        len,
+             uint16_t       freq,
+             uint16_t       rom_off,
+             uint16_t       font_off,
+             uint8_t        new_shift,
+             uint64_t       frames)
+{
+    int32_t ans;    /* answer */
+
+    ans = vm_init(&s->vm, freq, font_off, new_shift, 0, 0);
+    RET(ans, -1, "unable to initialize machine");
+
+    s->vm.skip_idle = 1;
+
+    ans = vm_load(&s->vm, rom, len, rom_off);
+    GOTO(ans, clean_vm, "unable to load ROM");
+
+    s->stack = malloc(SESSION_STACK);
+    GOTO(!s->stack, clean_vm, "unable to allocate stack (%s)",
+         strerror(errno));
+
+    ans = getcontext(&s->ctx);
+    GOTO(ans, clean_stack, "unable to get context (%s)", strerror(errno));
+
+    s->ctx.uc_stack.ss_sp   = s->stack;
+    s->ctx.uc_stack.ss_size = SESSION_STACK;
+    s->ctx.uc_link          = &w->ctx;
+    makecontext(&s->ctx, session_main, 0);
+
+    s->frames = frames;
+
+    return 0;
+
+clean_stack:
+    free(s->stack);
+    s->stack = NULL;
+clean_vm:
+    vm_free(&s->vm);
+    return -1;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* host_sessions - runs many live machines on a fixed pool of threads
+ *  @roms      : paths to ROM files
+ *  @n         : number of ROM files
+ *  @sessions  : number of machines; ROMs are assigned round robin
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @frames    : number of 60Hz frames to run per machine
+ *  @input     : path of the key input socket to create (or NULL)
+ *
+ *  @return : 0 if all machines ran to completion
+ *
+ * Each machine is a headless session that runs in step with host time, one
+ * frame per 1/60s, as a ucontext coroutine. Sessions are spread over one
+ * worker thread per online CPU, with their frames staggered across the
+ * frame period. If @input is given, the calling thread receives key state
+ * changes on a datagram socket bound there and feeds them to the input
+ * queue of the addressed session (see input_feed()) until all sessions end.
+ */
+int32_t
+host_sessions(char     **roms,
+              uint32_t n,
+              uint32_t sessions,
+              uint16_t freq,
+              uint16_t rom_off,
+              uint16_t font_off,
+              uint8_t  new_shift,
+              uint64_t frames,
+              char     *input)
+{
+    uint8_t         (*images)[RAM_SZ];  /* ROM contents               */
+    int32_t         *lens;              /* ROM sizes                  */
+    struct slab     *slab;              /* session allocator          */
+    struct session  **ss;               /* sessions                   */
+    struct worker   ws[MAX_WORKERS];    /* worker threads             */
+    long            n_workers;          /* number of workers          */
+    uint32_t        created = 0;        /* sessions initialized       */
+    long            started = 0;        /* workers started            */
+    int32_t         in_fd = -1;         /* key input socket           */
+    struct pollfd   pfd;                /* key input poll request     */
+    uint64_t        t0;                 /* start time                 */
+    uint64_t        wall;               /* run duration [ns]          */
+    uint64_t        run = 0;            /* frames run                 */
+    uint64_t        late = 0;           /* frames started late        */
+    uint64_t        cycles = 0;         /* emulated cycles            */
+    uint64_t        idle = 0;           /* fast-forwarded cycles      */
+    struct rusage   ru;                 /* host CPU time              */
+    double          cpu;                /* host CPU time [s]          */
+    int32_t         ans;                /* answer                     */
+    int32_t         ret = -1;           /* function status            */
+
+    RET(!sessions, -1, "no sessions to host");
+
+    images = calloc(n, sizeof(*images));
+    lens   = calloc(n, sizeof(*lens));
+    ss     = calloc(sessions, sizeof(*ss));
+    slab   = slab_create(sizeof(**ss));
+    GOTO(!images || !lens || !ss || !slab, clean_mem,
+         "unable to allocate sessions");
+
+    for (uint32_t i = 0; i < n; i++) {
+        lens[i] = read_rom(roms[i], images[i], sizeof(images[i]));
+        GOTO(lens[i] == -1, clean_mem, "unable to read %s", roms[i]);
+    }
+
+    n_workers = worker_count(0, MAX_WORKERS);
+    n_workers = n_workers > sessions ? sessions : n_workers;
+    memset(ws, 0, sizeof(ws));
+
+    /* session i runs on worker i % n_workers, k-th in its frame period */
+    for (; created < sessions; created++) {
+        struct session *s = slab_alloc(slab);
+        struct worker  *w = &ws[created % n_workers];
+        uint32_t       k  = created / n_workers;
+
+        GOTO(!s, clean_sessions, "unable to allocate session %u", created);
+
+        ans = session_init(s, w, images[created % n], lens[created % n],
+                           freq, rom_off, font_off, new_shift, frames);
+        if (ans)
+            slab_free(slab, s);
+        GOTO(ans, clean_sessions, "unable to create session %u", created);
+
+        ss[created] = s;
+
+        s->deadline = FRAME_NS * k / ((sessions - 1) / n_workers + 1);
+        if (w->head)
+            w->tail->next = s;
+        else
+            w->head = s;
+        w->tail = s;
+    }
+
+    INFO("hosting %u sessions on %ld threads for %lu frames",
+         sessions, n_workers, frames);
+
+    if (input) {
+        in_fd = input_open(input);
+        GOTO(in_fd == -1, clean_sessions, "unable to open session input");
+        INFO("reading session input from %s", input);
+    }
+
+    /* the first frames are due once all workers are up */
+    t0 = now_ns();
+    for (uint32_t i = 0; i < created; i++)
+        ss[i]->deadline += t0 + FRAME_NS;
+
+    for (; started < n_workers; started++) {
+        __atomic_add_fetch(&live_workers, 1, __ATOMIC_RELAXED);
+        ans = pthread_create(&ws[started].tid, NULL, worker_main,
+                             &ws[started]);
+        if (ans)
+            __atomic_sub_fetch(&live_workers, 1, __ATOMIC_RELAXED);
+        GOTO(ans, clean_workers, "unable to create worker (%s)",
+             strerror(ans));
+    }
+
+    /* key state changes are forwarded until all sessions have ended */
+    pfd = (struct pollfd) { .fd = in_fd, .events = POLLIN };
+    while (in_fd != -1 && __atomic_load_n(&live_workers, __ATOMIC_ACQUIRE))
+        if (poll(&pfd, 1, FRAME_NS / 1000000) > 0)
+            input_feed(in_fd, ss, created);
+
+    ret = 0;
+
+clean_workers:
+    /* NOTE: on error, sessions of unstarted workers are left as they are */
+    for (long i = 0; i < started; i++)
+        pthread_join(ws[i].tid, NULL);
+
+    if (in_fd != -1) {
+        close(in_fd);
+        unlink(input);
+    }
+
+    wall = now_ns() - t0;
+    getrusage(RUSAGE_SELF, &ru);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    for (long i = 0; i < started; i++) {
+        run  += ws[i].frames;
+        late += ws[i].late;
+    }
+    for (uint32_t i = 0; i < created; i++) {
+        cycles += ss[i]->vm.cycles;
+        idle   += ss[i]->vm.idle_cycles;
+    }
+
+    INFO("%lu frames in %.2fs, %lu late (%.2f%%); %.2f CPUs busy, "
+         "%.2fus per frame, %.1f%% of cycles fast-forwarded",
+         run, wall / 1e9, late, run ? 100.0 * late / run : 0,
+         cpu * 1e9 / wall, run ? cpu * 1e6 / run : 0,
+         cycles ? 100.0 * idle / cycles : 0);
+
+clean_sessions:
+    for (uint32_t i = 0; i < created; i++) {
+        vm_free(&ss[i]->vm);
+        free(ss[i]->stack);
+    }
+
+clean_mem:
+    slab_destroy(slab);
+    free(ss);
+    free(lens);
+    free(images);
+
+    return ret;
+}
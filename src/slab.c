@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>    /* pthread_mutex_*        */
+#include <sys/mman.h>   /* m[un]map, madvise      */
+#include <stdlib.h>     /* calloc, free           */
+#include <string.h>     /* memset, strerror       */
+#include <errno.h>      /* errno                  */
+
+#include "slab.h"
+#include "util.h"
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* header at the start of each arena; objects follow after one cache line */
+struct arena {
+    struct arena *next;         /* previously mapped arena */
+};
+
+/* free object; the link overlays its first bytes */
+struct free_obj {
+    struct free_obj *next;      /* next free object */
+};
+
+struct slab {
+    pthread_mutex_t lock;       /* serializes all operations      */
+    size_t          obj_sz;     /* object stride [bytes]          */
+    struct free_obj *free;      /* recycled objects               */
+    struct arena    *arenas;    /* all mapped arenas (newest)     */
+    uint8_t         *cur;       /* next unused object in newest   */
+    uint8_t         *end;       /* end of newest arena            */
+    uint64_t        n_arenas;   /* mapped arenas                  */
+    uint64_t        n_hugetlb;  /* arenas from hugetlb page pool  */
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* arena_map - maps a SLAB_ARENA_SZ region backed by a huge page, if possible
+ *  @hugetlb : 1 if the region comes from the explicit huge page pool (output)
+ *
+ *  @return : SLAB_ARENA_SZ aligned region or NULL on error
+ *
+ * Explicit huge pages are used if any were reserved (vm.nr_hugepages).
+ * Otherwise, an aligned region is carved out of a larger mapping so that
+ * transparent huge pages can back it as a whole; those are requested via
+ * madvise() in case THP is set to "madvise" rather than "always".
+ */
+static uint8_t *
+arena_map(uint8_t *hugetlb)
+{
+    uint8_t   *p;       /* mapped region  */
+    uintptr_t off;      /* head to unmap  */
+
+    p = mmap(NULL, SLAB_ARENA_SZ, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *hugetlb = 1;
+        return p;
+    }
+
+    p = mmap(NULL, 2 * SLAB_ARENA_SZ, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    RET(p == MAP_FAILED, NULL, "unable to map arena (%s)", strerror(errno));
+
+    off = -(uintptr_t) p & (SLAB_ARENA_SZ - 1);
+    if (off)
+        munmap(p, off);
+    munmap(p + off + SLAB_ARENA_SZ, SLAB_ARENA_SZ - off);
+    p += off;
+
+    /* not fatal; the arena is still usable with regular pages */
+    madvise(p, SLAB_ARENA_SZ, MADV_HUGEPAGE);
+
+    *hugetlb = 0;
+    return p;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* slab_create - creates an allocator of fixed size objects
+ *  @size : object size [bytes]
+ *
+ *  @return : allocator or NULL on error
+ *
+ * Objects are carved out of SLAB_ARENA_SZ arenas (one huge page each) and
+ * are aligned to SLAB_ALIGN, so that no two objects share a cache line.
+ * Many small objects thus cost one TLB entry and one kernel mapping per
+ * arena, rather than per object.
+ */
+struct slab *
+slab_create(size_t size)
+{
+    struct slab *slab;      /* new allocator */
+
+    RET(!size || size > SLAB_ARENA_SZ - SLAB_ALIGN, NULL,
+        "invalid object size: %lu", size);
+
+    slab = calloc(1, sizeof(*slab));
+    RET(!slab, NULL, "unable to allocate slab (%s)", strerror(errno));
+
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->obj_sz = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+    return slab;
+}
+
+/* slab_alloc - allocates one object
+ *  @slab : allocator
+ *
+ *  @return : zeroed object or NULL on error
+ *
+ * May be called from any thread.
+ */
+void *
+slab_alloc(struct slab *slab)
+{
+    void         *obj = NULL;   /* allocated object */
+    struct arena *arena;        /* new arena        */
+    uint8_t      hugetlb;       /* hugetlb arena    */
+
+    pthread_mutex_lock(&slab->lock);
+
+    /* reuse freed objects first; they are likely still cached */
+    if (slab->free) {
+        obj        = slab->free;
+        slab->free = slab->free->next;
+        goto out;
+    }
+
+    if (slab->cur + slab->obj_sz > slab->end) {
+        arena = (struct arena *) arena_map(&hugetlb);
+        GOTO(!arena, out, "unable to grow slab");
+
+        arena->next      = slab->arenas;
+        slab->arenas     = arena;
+        slab->cur        = (uint8_t *) arena + SLAB_ALIGN;
+        slab->end        = (uint8_t *) arena + SLAB_ARENA_SZ;
+        slab->n_arenas  += 1;
+        slab->n_hugetlb += hugetlb;
+    }
+
+    obj        = slab->cur;
+    slab->cur += slab->obj_sz;
+
+out:
+    pthread_mutex_unlock(&slab->lock);
+
+    if (obj)
+        memset(obj, 0, slab->obj_sz);
+
+    return obj;
+}
+
+/* slab_free - returns an object to its allocator
+ *  @slab : allocator
+ *  @obj  : object (may be NULL)
+ *
+ * May be called from any thread. Arenas are only unmapped on destruction.
+ */
+void
+slab_free(struct slab *slab, void *obj)
+{
+    struct free_obj *f = obj;   /* recycled object */
+
+    if (!obj)
+        return;
+
+    pthread_mutex_lock(&slab->lock);
+    f->next    = slab->free;
+    slab->free = f;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/* slab_destroy - unmaps all arenas of an allocator
+ *  @slab : allocator (may be NULL)
+ *
+ * All objects must have been freed or must no longer be used.
+ */
+void
+slab_destroy(struct slab *slab)
+{
+    struct arena *next;     /* next arena to unmap */
+
+    if (!slab)
+        return;
+
+    DEBUG("slab of %lu byte objects: %lu arenas, %lu explicit huge pages",
+          slab->obj_sz, slab->n_arenas, slab->n_hugetlb);
+
+    for (struct arena *a = slab->arenas; a; a = next) {
+        next = a->next;
+        munmap(a, SLAB_ARENA_SZ);
+    }
+
+    pthread_mutex_destroy(&slab->lock);
+    free(slab);
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>    /* pthread_{create,join}      */
+#include <dirent.h>     /* {open,read,close}dir        */
+#include <stdio.h>      /* fopen, fscanf, fprintf      */
+#include <string.h>     /* strncmp, strrchr, strerror  */
+#include <errno.h>      /* errno                       */
+#include <time.h>       /* clock_{gettime,nanosleep}   */
+#include <unistd.h>     /* sysconf                     */
+
+#include "soak.h"
+#include "system.h"
+#include "util.h"
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* process resource usage at one point in time */
+struct sample {
+    uint64_t cycles;        /* executed cycles              */
+    int64_t  rss_kb;        /* resident set size [KB]       */
+    int64_t  fds;           /* open file descriptors        */
+    int64_t  threads;       /* threads (incl. timer ones)   */
+    int64_t  timers;        /* POSIX timers (-1 if unknown) */
+    int64_t  minflt;        /* minor page faults            */
+    int64_t  majflt;        /* major page faults            */
+};
+
+static pthread_t     tid;               /* sampler thread             */
+static FILE          *csv;              /* telemetry output           */
+static uint32_t      duration;          /* soak duration [s] (0 = ∞)  */
+static uint8_t       stop = 0;          /* set by soak_stop()         */
+static uint8_t       failed = 0;        /* resource growth detected   */
+static struct sample base;              /* max over warmup samples    */
+static double        base_rate;         /* avg warmup cycles / second */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* count_fds - counts open file descriptors
+ *  @return : number of file descriptors or -1 on error
+ */
+static int64_t
+count_fds(void)
+{
+    DIR           *dir;         /* /proc/self/fd     */
+    struct dirent *ent;         /* directory entry   */
+    int64_t       n = -1;       /* excludes dir's fd */
+
+    dir = opendir("/proc/self/fd");
+    RET(!dir, -1, "unable to open /proc/self/fd (%s)", strerror(errno));
+
+    while ((ent = readdir(dir)))
+        n += ent->d_name[0] != '.';
+
+    closedir(dir);
+
+    return n;
+}
+
+/* count_lines - counts lines in a file that start with a prefix
+ *  @path   : file path
+ *  @prefix : line prefix
+ *  @value  : value following prefix on last matching line (output; optional)
+ *
+ *  @return : number of matching lines or -1 if file is unavailable
+ */
+static int64_t
+count_lines(const char *path, const char *prefix, int64_t *value)
+{
+    FILE    *f;             /* input file    */
+    char    line[256];      /* current line  */
+    size_t  len;            /* prefix length */
+    int64_t n = 0;          /* matches       */
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    len = strlen(prefix);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, prefix, len))
+            continue;
+
+        n++;
+        if (value)
+            sscanf(line + len, "%ld", value);
+    }
+
+    fclose(f);
+
+    return n;
+}
+
+/* take_sample - reads the current resource usage of this process
+ *  @s : sample (output)
+ *
+ *  @return : 0 if everything went well
+ */
+static int32_t
+take_sample(struct sample *s)
+{
+    FILE    *f;             /* /proc file         */
+    char    buf[1024];      /* /proc/self/stat    */
+    char    *p;             /* end of comm field  */
+    int64_t pages;          /* resident pages     */
+    int32_t ans;            /* answer             */
+
+    s->cycles = sys_cycles();
+
+    /* statm: size resident shared ... [pages] */
+    f = fopen("/proc/self/statm", "r");
+    RET(!f, -1, "unable to open /proc/self/statm (%s)", strerror(errno));
+    ans = fscanf(f, "%*d %ld", &pages);
+    fclose(f);
+    RET(ans != 1, -1, "unable to parse /proc/self/statm");
+
+    s->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+    /* stat: fields after the (comm) may contain anything but ')' */
+    f = fopen("/proc/self/stat", "r");
+    RET(!f, -1, "unable to open /proc/self/stat (%s)", strerror(errno));
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    RET(!p || !(p = strrchr(buf, ')')), -1, "unable to read /proc/self/stat");
+
+    ans = sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %ld %*u %ld",
+                 &s->minflt, &s->majflt);
+    RET(ans != 2, -1, "unable to parse /proc/self/stat");
+
+    s->fds = count_fds();
+    RET(s->fds == -1, -1, "unable to count file descriptors");
+
+    ans = count_lines("/proc/self/status", "Threads:", &s->threads);
+    RET(ans != 1, -1, "unable to read thread count");
+
+    /* needs CONFIG_CHECKPOINT_RESTORE */
+    s->timers = count_lines("/proc/self/timers", "ID:", NULL);
+
+    return 0;
+}
+
+/* check_growth - compares a sample against the warmup baseline
+ *  @s : sample
+ *
+ *  @return : 0 if no resource grew beyond its tolerance
+ *
+ * File descriptors and timers are expected to stay constant. Threads come
+ * and go with SIGEV_THREAD notifications and RSS may settle a bit later, so
+ * some slack is allowed for those.
+ */
+static int32_t
+check_growth(struct sample *s)
+{
+    int32_t ret = 0;    /* function status */
+
+    if (s->fds > base.fds) {
+        ERROR("SOAK: open file descriptors grew from %ld to %ld",
+              base.fds, s->fds);
+        ret = -1;
+    }
+    if (s->timers > base.timers) {
+        ERROR("SOAK: POSIX timers grew from %ld to %ld",
+              base.timers, s->timers);
+        ret = -1;
+    }
+    if (s->threads > base.threads + SOAK_THREAD_SLACK) {
+        ERROR("SOAK: threads grew from %ld to %ld", base.threads, s->threads);
+        ret = -1;
+    }
+    if (s->rss_kb > base.rss_kb + SOAK_RSS_SLACK_KB) {
+        ERROR("SOAK: RSS grew from %ldKB to %ldKB", base.rss_kb, s->rss_kb);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* sampler_main - samples resource usage once per second
+ *  @arg : unused
+ *
+ *  @return : NULL
+ */
+static void *
+sampler_main(void *arg)
+{
+    struct timespec next;           /* next sample time            */
+    struct sample   prev;           /* previous sample             */
+    struct sample   cur;            /* current sample              */
+    uint64_t        rate;           /* cycles in last second       */
+    uint8_t         slow = 0;       /* throughput below half       */
+    int32_t         ans;            /* answer                      */
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    ans = take_sample(&prev);
+    GOTO(ans, out, "unable to sample resource usage");
+
+    for (uint32_t t = 1; !duration || t <= duration; t++) {
+        next.tv_sec++;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+               == EINTR)
+            ;
+
+        if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+            break;
+
+        ans = take_sample(&cur);
+        GOTO(ans, out, "unable to sample resource usage");
+
+        rate = cur.cycles - prev.cycles;
+        fprintf(csv, "%u,%lu,%ld,%ld,%ld,%ld,%ld,%ld\n", t, rate, cur.rss_kb,
+                cur.fds, cur.threads, cur.timers, cur.minflt, cur.majflt);
+        fflush(csv);
+
+        prev = cur;
+
+        /* baseline: highest usage seen while warming up */
+        if (t <= SOAK_WARMUP) {
+#define BASE_MAX(field) base.field = cur.field > base.field \
+                                   ? cur.field : base.field
+            BASE_MAX(rss_kb);
+            BASE_MAX(fds);
+            BASE_MAX(threads);
+            BASE_MAX(timers);
+#undef BASE_MAX
+            base_rate += (rate - base_rate) / t;
+            continue;
+        }
+
+        if (check_growth(&cur)) {
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        /* throughput may dip due to host load; only report transitions */
+        if (slow != (rate < base_rate / 2)) {
+            slow = !slow;
+            if (slow)
+                WAR("SOAK: throughput dropped to %lu cycles/s (%.0f baseline)",
+                    rate, base_rate);
+            else
+                INFO("SOAK: throughput recovered to %lu cycles/s", rate);
+        }
+    }
+
+out:
+    if (ans)
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+
+    /* end the run (no-op if it was already ended by the user) */
+    sys_stop();
+
+    return NULL;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* soak_start - starts sampling resource usage into a CSV file
+ *  @secs : soak duration [s]; the run is stopped afterwards (0 = no limit)
+ *  @path : CSV output file
+ *
+ *  @return : 0 if everything went well
+ *
+ * The emulator runs normally (display, audio, timers; with the CPU either
+ * paced by its timer or uncapped, see init_system()) while a sampler thread
+ * records throughput and resource usage every second. The highest values
+ * seen in the first SOAK_WARMUP seconds are used as baseline; any growth
+ * past it (see check_growth()) ends the run and fails soak_stop().
+ */
+int32_t
+soak_start(uint32_t secs, const char *path)
+{
+    int32_t ans;    /* answer */
+
+    csv = fopen(path, "w");
+    RET(!csv, -1, "unable to open %s (%s)", path, strerror(errno));
+
+    fprintf(csv, "seconds,cycles_per_sec,rss_kb,fds,threads,timers,"
+                 "minflt,majflt\n");
+
+    duration = secs;
+    base     = (struct sample) { .timers = -1 };
+
+    ans = pthread_create(&tid, NULL, sampler_main, NULL);
+    if (ans)
+        fclose(csv);
+    RET(ans, -1, "unable to create thread (%s)", strerror(ans));
+
+    return 0;
+}
+
+/* soak_stop - ends sampling and reports the outcome
+ *  @return : 0 if no resource growth was detected; -1 otherwise
+ */
+int32_t
+soak_stop(void)
+{
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_join(tid, NULL);
+    fclose(csv);
+
+    if (failed) {
+        ERROR("SOAK: FAILED; see CSV telemetry for details");
+        return -1;
+    }
+
+    INFO("SOAK: passed (baseline %.0f cycles/s, %ldKB RSS, %ld fds, "
+         "%ld threads, %ld timers)", base_rate, base.rss_kb, base.fds,
+         base.threads, base.timers);
+
+    return 0;
+}
@@ -19,7 +19,7 @@
 
 #include <string.h>     /* memset        */
 #include <portaudio.h>  /* portaudio API */
-#include <math.h>       /* sin           */
+#include <math.h>       /* sin, pow      */
 
 #ifndef M_PI
 #define M_PI 3.14159265
@@ -28,6 +28,14 @@
 #include "sound.h"
 #include "util.h"
 
+/* fixed point representation of a position in the pattern:    *
+ * 7 integer bits (128 pattern bits) and 25 fractional bits     */
+#define PAT_FRAC_BITS   25
+#define PAT_ONE         (1U << PAT_FRAC_BITS)
+
+/* tag on a published pattern buffer index that was not yet played */
+#define PAT_FRESH       0x80
+
 /******************************************************************************
  **************************** INTERNAL STRUCTURES *****************************
  ******************************************************************************/
@@ -36,6 +44,29 @@ static int32_t  pa_initialized = 0; /* was portaudio initialized already? */
 static float    tone_freq;          /* buzzer tone frequency              */
 static PaStream *stream = NULL;     /* output audio stream                */
 
+/* XO-CHIP audio pattern, in a form suitable for box filtering:            *
+ *  bit[k] : level of the k-th pattern bit (two periods, for wraparound)   *
+ *  cum[k] : sum of bit[0 ... k-1]                                         *
+ * Triple buffered: the core thread fills pat_back and swaps it for        *
+ * pat_mid (tagged PAT_FRESH); the audio thread swaps pat_front for a      *
+ * fresh pat_mid at the start of a period. Neither thread ever touches     *
+ * the buffer the other one owns, so no period is ever generated from a    *
+ * half-written pattern.                                                   */
+static struct {
+    float bit[2 * PATTERN_BITS];
+    float cum[2 * PATTERN_BITS + 1];
+} pat_buf[3];
+
+static uint8_t  pat_back  = 0;      /* buffer owned by the core thread    */
+static uint8_t  pat_mid   = 1;      /* last published buffer | PAT_FRESH  */
+static uint8_t  pat_front = 2;      /* buffer owned by the audio thread   */
+static uint8_t  pat_on    = 0;      /* pattern replaces the sin tone      */
+static uint32_t pat_phase = 0;      /* playback position [bits, Q7.25]    */
+static uint32_t pat_step;           /* position increment per sample      */
+static uint8_t  pat_pitch;          /* pitch register value               */
+static double   speed = 1.0;        /* emulated / nominal rate            */
+static uint8_t  muted = 0;          /* output silence (unfocused)         */
+
 /******************************************************************************
  ****************************** HELPER FUNCTIONS ******************************
  ******************************************************************************/
@@ -103,6 +134,85 @@ sin_samplegen(const void                     *input,
     return 0;
 }
 
+/* pattern_samplegen - XO-CHIP audio pattern sample generator
+ *  @output      : output audio sample buffer
+ *  @frame_count : number of samples requested
+ *
+ * The 128-bit pattern is played back at a rate set by the pitch register,
+ * which may be higher than Fs. Each output sample is the average of the
+ * pattern over the interval [phase, phase + step), obtained as the difference
+ * of two points on the (piecewise linear) running sum of the pattern. This
+ * box filter suppresses most of the aliasing that plain bit sampling causes.
+ * There are no transcendental calls per sample; the loop only does table
+ * lookups and fused multiply-adds.
+ */
+static void
+pattern_samplegen(float *output, uint64_t frame_count)
+{
+    const float *bit;                           /* pattern levels      */
+    const float *cum;                           /* running sum         */
+    uint32_t    step  = __atomic_load_n(&pat_step, __ATOMIC_RELAXED);
+    uint32_t    phase = pat_phase;
+    float       scale = 2.0f * PAT_ONE / step;  /* avg -> [-1; 1] */
+
+    /* pick up a newly loaded pattern only between periods */
+    if (__atomic_load_n(&pat_mid, __ATOMIC_ACQUIRE) & PAT_FRESH)
+        pat_front = __atomic_exchange_n(&pat_mid, pat_front, __ATOMIC_ACQ_REL)
+                  & ~PAT_FRESH;
+
+    bit = pat_buf[pat_front].bit;
+    cum = pat_buf[pat_front].cum;
+
+    for (size_t i = 0; i < frame_count; i++) {
+        uint64_t end = (uint64_t) phase + step;             /* < 256 bits */
+        uint32_t i0  = phase >> PAT_FRAC_BITS;
+        uint32_t i1  = end   >> PAT_FRAC_BITS;
+        float    f0  = (phase & (PAT_ONE - 1)) * (1.0f / PAT_ONE);
+        float    f1  = (end   & (PAT_ONE - 1)) * (1.0f / PAT_ONE);
+        float    s0  = cum[i0] + bit[i0] * f0;
+        float    s1  = cum[i1] + bit[i1] * f1;
+
+        output[i] = (s1 - s0) * scale - 1.0f;
+        phase     = (uint32_t) end;
+    }
+
+    pat_phase = phase;
+}
+
+/* samplegen - audio engine callback; dispatches to the active generator
+ *  @input       : input audio sample buffer (N/A)
+ *  @output      : output audio sample buffer (configured as float[])
+ *  @frame_count : number of samples requested
+ *  @time_info   : expected output time for the first generated sample
+ *  @status_flag : callback status bitfield
+ *  @user_data   : user provided data (N/A)
+ *
+ *  @return : 0 if output generation successful
+ */
+static int32_t
+samplegen(const void                     *input,
+          void                           *output,
+          uint64_t                       frame_count,
+          const PaStreamCallbackTimeInfo *time_info,
+          PaStreamCallbackFlags          status_flags,
+          void                           *user_data)
+{
+    /* keep the stream going (and ST in sync with it), but silent */
+    if (__atomic_load_n(&muted, __ATOMIC_RELAXED)) {
+        memset(output, 0, frame_count * sizeof(float));
+        return 0;
+    }
+
+    /* use XO-CHIP audio pattern once the ROM has loaded one */
+    if (__atomic_load_n(&pat_on, __ATOMIC_ACQUIRE)) {
+        pattern_samplegen((float *) output, frame_count);
+        return 0;
+    }
+
+    return sin_samplegen(input, output, frame_count, time_info,
+                         status_flags, user_data);
+}
+
 /******************************************************************************
  ************************* PUBLIC API IMPLEMENTATION **************************
  ******************************************************************************/
@@ -123,6 +233,9 @@ init_audio(int32_t dev_idx, float _tone_freq)
     /* save buzzer tone frequency in global private storage */
     tone_freq = _tone_freq;
 
+    /* XO-CHIP default pitch */
+    set_audio_pitch(PATTERN_PITCH);
+
     /* it's highly unlikely for this to be skipped                            *
      * we keep the check in case we might want list_audio_devs() to be called *
      * in states prior to init_audio() that do not lead to critical failures  */
@@ -158,7 +271,7 @@ init_audio(int32_t dev_idx, float _tone_freq)
             Fs,                             /* sampling rate              */
             paFramesPerBufferUnspecified,   /* variable number of samples */
             paNoFlag,                       /* no extra options           */
-            sin_samplegen,                  /* audio sample generator     */
+            samplegen,                      /* audio sample generator     */
             NULL);                          /* no user data               */
     RET(ans != paNoError, -1, "unable to open audio stream (%s)",
         Pa_GetErrorText(ans));
@@ -269,3 +382,71 @@ stop_playback(void)
     return 0;
 }
 
+
+/* set_audio_pattern - loads an XO-CHIP audio pattern (F002)
+ *  @pattern : 16 bytes (128 1-bit samples, MSB first)
+ *
+ * From this point on, the buzzer plays the pattern instead of the sin tone.
+ */
+void
+set_audio_pattern(const uint8_t *pattern)
+{
+    uint8_t back = pat_back;    /* buffer being filled */
+    float   sum = 0.0f;         /* running sum         */
+
+    /* expand bits to levels; two periods so that reads never wrap */
+    for (size_t i = 0; i < 2 * PATTERN_BITS; i++) {
+        pat_buf[back].bit[i] = (pattern[(i % PATTERN_BITS) / 8]
+                                >> (7 - i % 8)) & 0x01;
+        pat_buf[back].cum[i] = sum;
+        sum += pat_buf[back].bit[i];
+    }
+    pat_buf[back].cum[2 * PATTERN_BITS] = sum;
+
+    /* publish; an unplayed pattern in pat_mid is simply superseded */
+    pat_back = __atomic_exchange_n(&pat_mid, back | PAT_FRESH,
+                                   __ATOMIC_ACQ_REL) & ~PAT_FRESH;
+    __atomic_store_n(&pat_on, 1, __ATOMIC_RELEASE);
+}
+
+/* set_audio_pitch - sets the XO-CHIP audio pattern playback rate (FX3A)
+ *  @pitch : pitch register value
+ *
+ * The pattern is played at 4000 * 2^((pitch - 64) / 48) bits per second of
+ * emulated time (see set_audio_speed()).
+ */
+void
+set_audio_pitch(uint8_t pitch)
+{
+    double rate = 4000.0 * pow(2.0, (pitch - PATTERN_PITCH) / 48.0) * speed;
+
+    pat_pitch = pitch;
+    __atomic_store_n(&pat_step, (uint32_t) (rate / Fs * PAT_ONE),
+                     __ATOMIC_RELAXED);
+}
+
+/* set_audio_speed - resamples the audio pattern to a changed emulation rate
+ *  @_speed : emulated time per host time (e.g.: 1.001 = 0.1% fast)
+ *
+ * Pattern playback stays in step with the emulated machine when its clock
+ * is adjusted to the display refresh rate. The buzzer tone is not affected.
+ *
+ * NOTE: must be called from the same thread as set_audio_pitch()
+ */
+void
+set_audio_speed(double _speed)
+{
+    speed = _speed;
+    set_audio_pitch(pat_pitch);
+}
+
+/* set_audio_muted - silences or unsilences the output
+ *  @_muted : 1 to output silence instead of the buzzer / pattern
+ *
+ * Playback is otherwise unaffected; it still starts and stops with ST.
+ */
+void
+set_audio_muted(uint8_t _muted)
+{
+    __atomic_store_n(&muted, _muted, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>     /* memset        */
+#include "stats.h"
+#include "system.h"
+#include "tsc.h"
+#include "util.h"
+
+#define FRAME_NS    (1000000000UL / TIMER_HZ)   /* host time per frame */
+#define REGIONS     256                         /* in-ROM timing regions */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* accumulated measurements over a number of frames */
+struct frame_acc {
+    uint64_t frames;                    /* number of closed frames    */
+    uint64_t late;                      /* frames that missed budget  */
+    uint64_t cycles;                    /* executed cycles            */
+    uint64_t budget;                    /* expected cycles            */
+    uint64_t dropped;                   /* cycles lost to preemption  */
+    uint64_t busy_ns[STATS_SECTIONS];   /* host time per section      */
+    uint64_t max_busy_ns;               /* busiest frame host time    */
+};
+
+/* in-ROM timing region, delimited by the 02NN / 03NN debug opcodes */
+struct region {
+    uint64_t count;                     /* completed begin / end pairs */
+    uint64_t cycles;                    /* total emulated cycles       */
+    uint64_t min_cycles;                /* shortest pair               */
+    uint64_t max_cycles;                /* longest pair                */
+    uint64_t ns;                        /* total host time             */
+    uint64_t begin_cycle;               /* cycle of pending begin      */
+    uint64_t begin_ns;                  /* host time of pending begin  */
+    uint8_t  open;                      /* begin not yet matched       */
+};
+
+static uint8_t   enabled = 0;           /* stats collection enabled    */
+static uint16_t  frequency;             /* CPU frequency               */
+static uint16_t  interval;              /* rolling summary period [s]  */
+static uint64_t  t0;                    /* start of first frame        */
+static uint64_t  last_now;              /* most recent timestamp       */
+static __thread uint64_t nested_ns;     /* render time inside core     */
+static uint8_t   frame_lock = 0;        /* serializes frame closing    */
+
+static uint64_t  frame_idx;             /* index of current frame      */
+static uint64_t  frame_cycles;          /* cycles in current frame     */
+static uint64_t  frame_dropped;         /* dropped in current frame    */
+static uint64_t  frame_busy[STATS_SECTIONS];
+
+static struct frame_acc window;         /* since last rolling summary   */
+static struct frame_acc total;          /* since start                 */
+static uint64_t         load_hist[101]; /* per-frame load histogram [%] */
+static struct region    regions[REGIONS];   /* indexed by NN           */
+static uint64_t         unmatched;      /* ends without a begin         */
+
+static const char *section_names[STATS_SECTIONS] = {
+    [STATS_CORE]   = "core",
+    [STATS_RENDER] = "render",
+    [STATS_FRAME]  = "frame",
+    [STATS_EVENTS] = "events",
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* region_print - prints the totals of all in-ROM timing regions
+ */
+static void
+region_print(void)
+{
+    uint8_t header = 0;     /* table header printed */
+
+    for (size_t i = 0; i < REGIONS; i++) {
+        struct region *r = &regions[i];
+
+        if (!r->count)
+            continue;
+
+        if (!header++)
+            INFO("In-ROM timing regions (02NN / 03NN):");
+
+        INFO("    region %02lx: n=%lu cycles avg=%.1f min=%lu max=%lu "
+             "host avg=%.2fus", i, r->count, (double) r->cycles / r->count,
+             r->min_cycles, r->max_cycles, r->ns / 1e3 / r->count);
+    }
+
+    if (unmatched)
+        WAR("%lu region ends had no matching begin", unmatched);
+}
+
+/* frame_budget - calculates the number of cycles expected in a frame
+ *  @idx : frame index
+ *
+ *  @return : number of cycles
+ *
+ * frequency / 60 is rarely an integer; distributing the remainder evenly
+ * across frames avoids reporting every third frame as late at e.g. 200Hz.
+ */
+static inline uint64_t
+frame_budget(uint64_t idx)
+{
+    uint16_t freq;      /* CPU frequency (see stats_retune()) */
+
+    freq = __atomic_load_n(&frequency, __ATOMIC_RELAXED);
+
+    return (idx + 1) * freq / TIMER_HZ - idx * freq / TIMER_HZ;
+}
+
+/* acc_add - adds the current frame to an accumulator
+ *  @acc     : accumulator
+ *  @budget  : expected cycles in current frame
+ *  @late    : 1 if current frame missed its budget
+ *  @busy_ns : total host time spent in current frame
+ */
+static void
+acc_add(struct frame_acc *acc, uint64_t budget, uint8_t late, uint64_t busy_ns)
+{
+    acc->frames++;
+    acc->late    += late;
+    acc->cycles  += frame_cycles;
+    acc->budget  += budget;
+    acc->dropped += frame_dropped;
+
+    for (size_t i = 0; i < STATS_SECTIONS; i++)
+        acc->busy_ns[i] += frame_busy[i];
+
+    if (busy_ns > acc->max_busy_ns)
+        acc->max_busy_ns = busy_ns;
+}
+
+/* acc_print - prints a summary of accumulated measurements
+ *  @acc : accumulator
+ */
+static void
+acc_print(struct frame_acc *acc)
+{
+    uint64_t busy = 0;      /* total host time */
+
+    if (!acc->frames)
+        return;
+
+    for (size_t i = 0; i < STATS_SECTIONS; i++)
+        busy += acc->busy_ns[i];
+
+    INFO("frames=%lu late=%lu (%.1f%%) cycles/frame=%.1f/%.1f dropped=%lu "
+         "core=%.1fus render=%.1fus frame=%.1fus events=%.1fus "
+         "load=%.1f%% (max %.1f%%)",
+         acc->frames, acc->late, 100.0 * acc->late / acc->frames,
+         (double) acc->cycles / acc->frames,
+         (double) acc->budget / acc->frames, acc->dropped,
+         acc->busy_ns[STATS_CORE]   / 1e3 / acc->frames,
+         acc->busy_ns[STATS_RENDER] / 1e3 / acc->frames,
+         acc->busy_ns[STATS_FRAME]  / 1e3 / acc->frames,
+         acc->busy_ns[STATS_EVENTS] / 1e3 / acc->frames,
+         100.0 * busy / acc->frames / FRAME_NS,
+         100.0 * acc->max_busy_ns / FRAME_NS);
+}
+
+/* frame_close - finalizes the current frame and starts the next one
+ */
+static void
+frame_close(void)
+{
+    uint64_t budget;        /* expected cycles            */
+    uint64_t busy = 0;      /* total host time            */
+    uint8_t  late;          /* frame missed its budget    */
+    size_t   load;          /* host load [%]              */
+
+    for (size_t i = 0; i < STATS_SECTIONS; i++)
+        busy += frame_busy[i];
+
+    /* allow one cycle of slack for CPU timer phase relative to frame */
+    budget = frame_budget(frame_idx);
+    late   = frame_cycles + 1 < budget || frame_dropped;
+
+    acc_add(&window, budget, late, busy);
+    acc_add(&total,  budget, late, busy);
+
+    load = 100 * busy / FRAME_NS;
+    load_hist[load > 100 ? 100 : load]++;
+
+    /* reset per-frame counters */
+    frame_idx++;
+    frame_cycles  = 0;
+    frame_dropped = 0;
+    memset(frame_busy, 0, sizeof(frame_busy));
+
+    /* rolling summary */
+    if (window.frames >= interval * TIMER_HZ) {
+        acc_print(&window);
+        memset(&window, 0, sizeof(window));
+    }
+}
+
+/* frame_advance - closes all frames that ended before a given time
+ *  @now : current time [ns]
+ */
+static void
+frame_advance(uint64_t now)
+{
+    while ((now - t0) / FRAME_NS > frame_idx)
+        frame_close();
+}
+
+/* hist_percentile - determines a percentile of per-frame host load
+ *  @p : percentile [0-100]
+ *
+ *  @return : host load [%]
+ */
+static size_t
+hist_percentile(double p)
+{
+    uint64_t seen = 0;      /* frames below current bucket */
+
+    for (size_t i = 0; i < 101; i++) {
+        seen += load_hist[i];
+        if (seen >= p / 100 * total.frames)
+            return i;
+    }
+
+    return 100;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* stats_init - enables per-frame cycle budget accounting
+ *  @freq      : CPU frequency
+ *  @_interval : rolling summary period [s]
+ *
+ *  @return : 0 if everything went well
+ */
+int32_t
+stats_init(uint16_t freq, uint16_t _interval)
+{
+    RET(!freq, -1, "CPU frequency 0 not allowed");
+
+    frequency = freq;
+    interval  = _interval;
+    enabled   = 1;
+    t0        = stats_now();
+    last_now  = t0;
+
+    return 0;
+}
+
+/* stats_now - returns a timestamp for host time accounting
+ *  @return : monotonic time [ns] or 0 if stats collection is disabled
+ */
+uint64_t
+stats_now(void)
+{
+    return enabled ? tsc_ns() : 0;
+}
+
+/* stats_add - accounts host time spent in a section
+ *  @section : STATS_* section
+ *  @start   : timestamp of section start (see stats_now())
+ *
+ *  @return : timestamp of section end (can be used as start of next section)
+ *
+ * Renders that happen during instruction execution (i.e.: lazy rendering)
+ * are accounted as render time and excluded from the enclosing core time.
+ * Sections may be timed on any thread (e.g.: the UI thread pumping events
+ * and presenting in vsync mode); nesting is tracked per thread.
+ *
+ * NOTE: frame_lock is taken since stats_dropped() may close the frame (and
+ *       reset frame_busy) from a preempting callback at any time
+ */
+uint64_t
+stats_add(uint8_t section, uint64_t start)
+{
+    uint64_t now;           /* current time */
+    uint64_t elapsed;       /* section time */
+
+    if (!enabled)
+        return 0;
+
+    now     = stats_now();
+    elapsed = now - start;
+
+    if (section == STATS_RENDER) {
+        nested_ns += elapsed;
+    } else {
+        if (section == STATS_CORE)
+            elapsed -= nested_ns < elapsed ? nested_ns : elapsed;
+        nested_ns = 0;
+    }
+
+    while (__atomic_test_and_set(&frame_lock, __ATOMIC_ACQUIRE))
+        ;
+
+    frame_busy[section] += elapsed;
+    last_now = now;
+
+    __atomic_clear(&frame_lock, __ATOMIC_RELEASE);
+
+    return now;
+}
+
+/* stats_cycles - accounts executed cycles in the current frame
+ *  @n : number of cycles
+ *
+ * Frame boundaries are determined based on the most recent timestamp. All
+ * frames that went by without any cycles being executed are closed as late.
+ */
+void
+stats_cycles(uint32_t n)
+{
+    if (!enabled)
+        return;
+
+    while (__atomic_test_and_set(&frame_lock, __ATOMIC_ACQUIRE))
+        ;
+
+    frame_advance(last_now);
+    frame_cycles += n;
+
+    __atomic_clear(&frame_lock, __ATOMIC_RELEASE);
+}
+
+/* stats_dropped - accounts a cycle that was abandoned due to preemption
+ *
+ * NOTE: this may be called concurrently with the preempted callback; frames
+ *       are closed here only if that callback is not doing it already, so
+ *       that a run of abandoned cycles is still reported as late frames
+ */
+void
+stats_dropped(void)
+{
+    if (!enabled)
+        return;
+
+    __atomic_add_fetch(&frame_dropped, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_test_and_set(&frame_lock, __ATOMIC_ACQUIRE))
+        return;
+
+    frame_advance(stats_now());
+
+    __atomic_clear(&frame_lock, __ATOMIC_RELEASE);
+}
+
+/* stats_retune - changes the CPU frequency that frames are budgeted for
+ *  @freq : CPU frequency
+ *
+ * Used by the --auto-freq governor; applies starting with the current frame.
+ */
+void
+stats_retune(uint16_t freq)
+{
+    __atomic_store_n(&frequency, freq, __ATOMIC_RELAXED);
+}
+
+/* stats_region - records an in-ROM timing region boundary
+ *  @id    : region (NN of 02NN / 03NN)
+ *  @end   : 1 if the region ends here, 0 if it begins
+ *  @cycle : current emulated cycle
+ *
+ * Regions are recorded even if frame budget accounting is disabled. A begin
+ * that is not matched by an end is superseded by the next begin, so that
+ * regions exited early (e.g.: via a jump) can be restarted.
+ */
+void
+stats_region(uint8_t id, uint8_t end, uint64_t cycle)
+{
+    struct region *r   = &regions[id];      /* timed region */
+    uint64_t      now  = tsc_ns();          /* host time    */
+    uint64_t      span;                     /* pair cycles  */
+
+    if (!end) {
+        r->begin_cycle = cycle;
+        r->begin_ns    = now;
+        r->open        = 1;
+        return;
+    }
+
+    if (!r->open) {
+        unmatched++;
+        return;
+    }
+
+    span = cycle - r->begin_cycle;
+
+    r->min_cycles  = r->count && r->min_cycles < span ? r->min_cycles : span;
+    r->max_cycles  = r->max_cycles > span ? r->max_cycles : span;
+    r->cycles     += span;
+    r->ns         += now - r->begin_ns;
+    r->count      += 1;
+    r->open        = 0;
+}
+
+/* stats_report - prints the end-of-run cycle budget report
+ */
+void
+stats_report(void)
+{
+    region_print();
+
+    if (!enabled || !total.frames)
+        return;
+
+    INFO("Frame budget report (%hu Hz, %.2f cycles per frame):",
+         frequency, (double) frequency / TIMER_HZ);
+    acc_print(&total);
+
+    for (size_t i = 0; i < STATS_SECTIONS; i++)
+        INFO("    %-6s %.3fs", section_names[i], total.busy_ns[i] / 1e9);
+
+    INFO("    load p50=%lu%% p99=%lu%% -> headroom at p99: %ld%%",
+         hist_percentile(50), hist_percentile(99),
+         100 - (int64_t) hist_percentile(99));
+}
@@ -21,15 +21,21 @@
 #include <unistd.h>     /* read, close                  */
 #include <string.h>     /* memset, memmove              */
 #include <sys/stat.h>   /* fstat                        */
-#include <sys/mman.h>   /* m[un]map                     */
-#include <arpa/inet.h>  /* ntohs, htons                 */
-#include <time.h>       /* time, timer_{create,settime} */
-#include <stdlib.h>     /* [s]random                    */
+#include <time.h>       /* time, timer_*, nanosleep     */
+#include <stdlib.h>     /* calloc, free, abs            */
 #include <signal.h>     /* sigval                       */
-#include <SDL2/SDL.h>   /* SDL_PollEvent                */
+#include <pthread.h>    /* pthread_*                    */
+#include <SDL2/SDL.h>   /* SDL_{Wait,Poll}Event*        */
 #include <portaudio.h>  /* portaudio                    */
 
 #include "system.h"
+#include "ir.h"
+#include "slab.h"
+#include "optab.h"
+#include "stats.h"
+#include "tsc.h"
+#include "input.h"
+#include "evdev.h"
 #include "display.h"
 #include "sound.h"
 #include "util.h"
@@ -38,20 +44,79 @@
  **************************** INTERNAL STRUCTURES *****************************
  ******************************************************************************/
 
-static void              *ram;              /* system RAM                 */
-static uint16_t          stack[16];         /* system stack (out-of-RAM)  */
-static struct chip8_regs regs = { 0 };      /* system registers           */
+static struct chip8_vm   main_vm;           /* interactive machine        */
 static timer_t           cpu_timerid;       /* cpu timer                  */
 static timer_t           delay_timerid;     /* delay timer                */
 static timer_t           sound_timerid;     /* sound timer                */
-static uint16_t          font_offset;       /* font sprites offset in RAM */
 static uint16_t          ref_interval;      /* screen refresh interval    */
-static uint8_t           new_shift;         /* use new shift operations   */
 static uint8_t           lazy_render;       /* lazy_render                */
+static uint8_t           evdev;             /* keys from evdev, not SDL   */
 static uint8_t           quit = 0;          /* breaks main system loop    */
+static pthread_mutex_t   timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t          cpu_freq;          /* nominal CPU frequency      */
+static uint8_t           uncapped;          /* CPU loop instead of timer  */
+static pthread_t         cpu_tid;           /* CPU loop thread            */
+static struct slab       *ram_slab;         /* RAM of all machines        */
+static struct slab       *vm_slab;          /* batch machine states       */
+static pthread_once_t    slab_once = PTHREAD_ONCE_INIT;
+
+/* vsync mode: the UI thread presents the most recent complete frame once  *
+ * per display refresh and retunes the emulated clock to match it. Frames  *
+ * are handed over through a triple buffer; frame_mid is exchanged by both *
+ * threads and carries FRAME_FRESH if it holds a frame not yet presented.  */
+#define FRAME_FRESH         0x04        /* frame_mid flag: not presented    */
+#define VSYNC_MAX_SKEW_PPM  5000        /* max clock adjustment (0.5%)      */
+#define VSYNC_PHASE_PPM     1000        /* adjustment per frame of lag      */
+#define VSYNC_EPS_PPM       20          /* smallest change worth applying   */
+
+static uint8_t           vsync;             /* present once per refresh   */
+static uint8_t           frame_buf[3][32 * 64]; /* published frames       */
+static uint8_t           frame_back  = 0;   /* written by CPU thread      */
+static uint8_t           frame_mid   = 1;   /* exchanged (| FRAME_FRESH)  */
+static uint8_t           frame_front = 2;   /* presented by UI thread     */
+static int32_t           target_ppm  = 0;   /* clock offset (UI -> CPU)   */
+static int32_t           speed_ppm   = 0;   /* clock offset in effect     */
+static uint64_t          emu_ns      = 0;   /* emulated time (CPU -> UI)  */
+
+/* auto-freq mode: the CPU rate is lowered while the ROM spends most of     *
+ * its cycles polling DT or waiting for a key and is raised back as soon as *
+ * those waits get short (see governor_step()). DT and ST are unaffected.   */
+#define GOV_MIN_FREQ        60          /* lowest CPU rate [Hz]             */
+#define GOV_WINDOW_DIV      4           /* load measurements per second     */
+#define GOV_TARGET_LOAD     0.70        /* busy fraction to settle at       */
+#define GOV_MAX_LOAD        0.90        /* busy fraction for full rate      */
+#define GOV_MAX_DROP        0.85        /* largest decrease per measurement */
+#define DT_POLL_GAP         4           /* max cycles between polling FX07s */
+
+static uint8_t           auto_freq;         /* adapt CPU rate to ROM load */
+static uint16_t          run_freq;          /* CPU rate in effect         */
+static uint64_t          frame_cycle = 0;   /* next frame boundary (CPU)  */
+
+/* background mode: while the window is hidden or minimized, the CPU thread *
+ * parks itself at a frame boundary, with DT and ST frozen, so that nothing *
+ * is executed or rendered until the UI thread unparks it (see bg_park()).  */
+enum {
+    BG_RUN = 0,     /* window visible; running       */
+    BG_PARK_REQ,    /* UI thread asked CPU to park   */
+    BG_PARKED,      /* CPU timer and DT / ST stopped */
+};
 
-/* key state */
-static uint8_t key_state[16] = { [ 0 ... 15 ] = 0 };
+static uint8_t           bg_state  = BG_RUN; /* BG_* (UI <-> CPU)         */
+static uint8_t           bg_redraw = 0;     /* refresh after unparking    */
+static struct timespec   bg_dt;             /* DT time left when parked   */
+static struct timespec   bg_st;             /* ST time left when parked   */
+
+/* superinstruction kinds (see exec_fused()) */
+enum {
+    FUSE_UNK = 0,   /* sequence not predecoded yet     */
+    FUSE_NONE,      /* no known sequence at address    */
+    FUSE_DRAW,      /* ANNN + DXYN                     */
+    FUSE_LOOP,      /* 7XKK + skip + 1NNN              */
+    FUSE_DTWAIT,    /* FX07 + skip + 1NNN              */
+    FUSE_LOAD2,     /* 6XKK + 6XKK                     */
+    FUSE_SKJP,      /* skip + 1NNN                     */
+    FUSE_MAX,
+};
 
 /* key map (chip8 key -> SDL keycode) *
  *        1 2 3 C  |  1 2 3 4         *
@@ -101,37 +166,408 @@ static const uint8_t font_sprites[] = {
  ****************************** HELPER FUNCTIONS ******************************
  ******************************************************************************/
 
-/* update_keystate - updates key_state with currently pressed keys
+/* update_keystate - reports keys pressed since the previous call
+ *  @vm     : machine
  *  @return : index in key_state of newly pressed key (if any)
  *            or someting in the range [0x10; 0xff] (if none)
  *
  * NOTE: if more than one keys are newly pressed, only the one with the lowest
- *       index in key_map will be reported (via return); otherwise, all key
- *       state changes will be reflected in key_state
- * NOTE: this is supposed to be a lazy state update, invoked when encountering
- *       specific instructions (i.e.: EX9E, EXA1, FX0A) to avoid tanking the
- *       performance
+ *       index in key_map will be reported (via return)
+ * NOTE: key_state itself is updated by apply_input() at batch boundaries; a
+ *       key that was pressed and released in between calls is still reported
  */
 static uint8_t
-update_keystate(void)
+update_keystate(struct chip8_vm *vm)
 {
-    uint8_t       ret = 0xff;   /* return value                     */
-    const uint8_t *new_state;   /* SDL key state internal structure */
+    uint8_t ret = vm->key_edges ? __builtin_ctz(vm->key_edges) : 0xff;
+
+    vm->key_edges = 0;
+    return ret;
+}
 
-    /* get key state via SDL (points to internal SDL structure) */
-    new_state = SDL_GetKeyboardState(NULL);
+/* apply_input - applies all input events that have become visible
+ *  @vm : machine
+ *
+ * Events are stamped by the UI thread with a batch boundary and are consumed
+ * only at batch boundaries. As a result, the cycle at which a key state
+ * change is observed by the ROM does not depend on host scheduling.
+ */
+static void
+apply_input(struct chip8_vm *vm)
+{
+    struct input_event ev;      /* key state change */
 
-    /* for each mapped key */
-    for (size_t i = 0; i < sizeof(key_state); i++) {
-        /* first newly pressed key */
-        if (!key_state[i] && new_state[key_map[i]] && ret == 0xff)
-            ret = i;
+    while (!input_pop(&vm->input_q, vm->cycles, &ev)) {
+        if (ev.down && !vm->key_state[ev.key])
+            vm->key_edges |= 1 << ev.key;
 
-        /* update state for current key */
-        key_state[i] = new_state[key_map[i]];
+        vm->key_state[ev.key] = ev.down;
     }
+}
 
-    return ret;
+/* fetch - reads an instruction from RAM in host byte order
+ *  @vm   : machine
+ *  @addr : instruction address
+ *
+ *  @return : instruction
+ *
+ * NOTE: an instruction at 0xfff wraps around to the start of RAM
+ */
+static inline uint16_t
+fetch(struct chip8_vm *vm, uint16_t addr)
+{
+    return vm->ram[addr] << 8 | vm->ram[(addr + 1) & 0x0fff];
+}
+
+/* fuse_invalidate - discards predecoded sequences overlapping a RAM write
+ *  @vm   : machine
+ *  @addr : start of written region
+ *  @len  : size of written region [bytes]
+ *
+ * Any superinstruction (at most 3 instructions, i.e. 6 bytes) that starts
+ * up to 5 bytes before the written region may contain modified code.
+ */
+static inline void
+fuse_invalidate(struct chip8_vm *vm, uint16_t addr, uint16_t len)
+{
+    uint16_t start = addr > 5 ? addr - 5 : 0;
+    uint16_t end   = addr + len < RAM_SZ ? addr + len : RAM_SZ;
+
+    memset(vm->fuse_map + start, FUSE_UNK, end - start);
+}
+
+/* journal_write - records a RAM write in the write journal
+ *  @vm   : machine
+ *  @addr : start of written region
+ *  @len  : size of written region [bytes]
+ *
+ * Regions that run past the end of RAM wrap around to its start.
+ */
+static inline void
+journal_write(struct chip8_vm *vm, uint16_t addr, uint16_t len)
+{
+    uint16_t first = addr / DIRTY_BLK_SZ;               /* first block */
+    uint16_t last  = (addr + len - 1) / DIRTY_BLK_SZ;   /* last block  */
+
+    for (uint16_t b = first; len && b <= last; b++)
+        vm->dirty_ram |= 1UL << (b % 64);
+}
+
+/* invalidate_code - discards all cached translations of overwritten code
+ *  @vm   : machine
+ *  @addr : start of written region
+ *  @len  : size of written region [bytes]
+ *
+ * Regions that run past the end of RAM wrap around to its start.
+ */
+static inline void
+invalidate_code(struct chip8_vm *vm, uint16_t addr, uint16_t len)
+{
+    uint16_t wrap = addr + len > RAM_SZ ? addr + len - RAM_SZ : 0;
+
+    if (vm->fuse_map) {
+        fuse_invalidate(vm, addr, len);
+        fuse_invalidate(vm, 0, wrap);
+    }
+    if (vm->ir_cache) {
+        ir_invalidate(vm->ir_cache, addr, len);
+        ir_invalidate(vm->ir_cache, 0, wrap);
+    }
+}
+
+/* timed_refresh - refreshes the display, accounting the time spent doing it
+ *  @vm : machine
+ */
+static inline void
+timed_refresh(struct chip8_vm *vm)
+{
+    uint64_t t = stats_now();   /* render start time */
+
+    refresh_display(vm->pixels);
+    stats_add(STATS_RENDER, t);
+}
+
+/* timer_span - converts a number of 60Hz timer ticks to host time
+ *  @ticks : number of ticks
+ *
+ *  @return : host time until the last tick
+ *
+ * In vsync mode, emulated time may run up to 0.5% faster or slower than
+ * host time (see vsync_pace()).
+ */
+static inline struct timespec
+timer_span(uint8_t ticks)
+{
+    uint64_t ns = ticks * 1000000000UL * 1000000
+                / (TIMER_HZ * (1000000 + speed_ppm));
+
+    return (struct timespec) {
+        .tv_sec  = ns / 1000000000UL,
+        .tv_nsec = ns % 1000000000UL,
+    };
+}
+
+/* timer_ticks - reads the Delay Timer counter from its host timer
+ *  @return : number of 60Hz ticks until DT expires (0 on error)
+ */
+static uint8_t
+timer_ticks(void)
+{
+    int32_t           ans;          /* answer                         */
+    struct itimerspec interval;     /* Delay Timer remaining interval */
+
+    /* get remaining time until DT expires */
+    ans = timer_gettime(delay_timerid, &interval);
+    RET(ans, 0, "unable to query timer (%s)", strerror(errno));
+
+    /* get DT counter value from remaining timespan */
+    return (interval.it_value.tv_sec + interval.it_value.tv_nsec / 1e9)
+         * TIMER_HZ * (1000000 + speed_ppm) / 1e6;
+}
+
+/* frame_publish - hands the current screen state over to the UI thread
+ *  @vm : machine
+ */
+static void
+frame_publish(struct chip8_vm *vm)
+{
+    memcpy(frame_buf[frame_back], vm->pixels, sizeof(vm->pixels));
+    frame_back = __atomic_exchange_n(&frame_mid, frame_back | FRAME_FRESH,
+                                     __ATOMIC_ACQ_REL) & ~FRAME_FRESH;
+}
+
+/* frame_acquire - retrieves the most recently published screen state
+ *  @return : logical screen state (64x32 bytes)
+ *
+ * If no new frame was published since the last call, the same one is
+ * returned again.
+ */
+static const uint8_t *
+frame_acquire(void)
+{
+    if (__atomic_load_n(&frame_mid, __ATOMIC_RELAXED) & FRAME_FRESH)
+        frame_front = __atomic_exchange_n(&frame_mid, frame_front,
+                                          __ATOMIC_ACQ_REL) & ~FRAME_FRESH;
+
+    return frame_buf[frame_front];
+}
+
+/* cpu_retime - rearms the CPU timer
+ *  @freq : CPU rate [Hz]
+ *  @ppm  : clock offset
+ *
+ *  @return : 0 if the timer was rearmed
+ *
+ * NOTE: the timer must not be rearmed after sys_stop() disarmed it; the
+ *       check of quit and the rearm happen under timer_lock, as do the
+ *       store of quit and the disarm in sys_stop()
+ */
+static int32_t
+cpu_retime(uint16_t freq, int32_t ppm)
+{
+    uint64_t          ns;           /* CPU timer period */
+    struct itimerspec interval;     /* CPU timer        */
+    int32_t           ans = -1;     /* answer           */
+
+    /* uncapped mode runs without the CPU timer (see cpu_loop()) */
+    if (uncapped)
+        return 0;
+
+    ns = 1000000000UL * 1000000 / ((uint64_t) freq * (1000000 + ppm));
+    interval.it_value.tv_sec     = ns / 1000000000UL;
+    interval.it_value.tv_nsec    = ns % 1000000000UL;
+    interval.it_interval         = interval.it_value;
+
+    pthread_mutex_lock(&timer_lock);
+    if (!__atomic_load_n(&quit, __ATOMIC_RELAXED)) {
+        ans = timer_settime(cpu_timerid, 0, &interval, NULL);
+        if (ans)
+            ERROR("unable to rearm timer (%s)", strerror(errno));
+    }
+    pthread_mutex_unlock(&timer_lock);
+
+    return ans ? -1 : 0;
+}
+
+/* speed_apply - retunes the CPU timer to the requested clock offset
+ *
+ * Called on the CPU thread at frame boundaries, so that DT / ST conversions
+ * and audio pattern playback always agree with the current CPU rate.
+ */
+static void
+speed_apply(void)
+{
+    int32_t ppm = __atomic_load_n(&target_ppm, __ATOMIC_RELAXED);
+
+    if (ppm == speed_ppm || cpu_retime(run_freq, ppm))
+        return;
+
+    speed_ppm = ppm;
+    set_audio_speed(1.0 + ppm / 1e6);
+}
+
+/* bg_unpark - resumes execution after bg_park()
+ *
+ * Called on whichever thread notices that the window is visible again; the
+ * CPU timer is disarmed at this point, so nothing else touches the timers.
+ */
+static void
+bg_unpark(void)
+{
+    struct itimerspec dt = { .it_value = bg_dt };   /* DT remainder */
+    struct itimerspec st = { .it_value = bg_st };   /* ST remainder */
+    int32_t           ans;                          /* answer       */
+
+    ans = timer_settime(delay_timerid, 0, &dt, NULL);
+    ALERT(ans, "unable to rearm delay timer (%s)", strerror(errno));
+
+    if (st.it_value.tv_sec || st.it_value.tv_nsec) {
+        ans = timer_settime(sound_timerid, 0, &st, NULL);
+        ALERT(ans, "unable to rearm sound timer (%s)", strerror(errno));
+
+        start_playback();
+    }
+
+    /* lazy rendering would leave the restored window blank until DXYN */
+    __atomic_store_n(&bg_redraw, 1, __ATOMIC_RELAXED);
+
+    cpu_retime(run_freq, speed_ppm);
+}
+
+/* bg_park - stops execution while the window is not visible
+ *
+ * Called on the CPU thread at a frame boundary, after the UI thread asked
+ * for it. The CPU timer is disarmed and DT / ST are frozen, keeping their
+ * remaining time; the buzzer is silenced. If the window became visible again
+ * in the meantime, execution is resumed right away.
+ */
+static void
+bg_park(void)
+{
+    struct itimerspec off = { 0 };          /* timer disarmer */
+    struct itimerspec old;                  /* time left      */
+    uint8_t           state = BG_PARK_REQ;  /* expected state */
+    int32_t           ans;                  /* answer         */
+
+    ans = timer_settime(cpu_timerid, 0, &off, NULL);
+    RET(ans, , "unable to disarm cpu timer (%s)", strerror(errno));
+
+    ans = timer_settime(delay_timerid, 0, &off, &old);
+    ALERT(ans, "unable to disarm delay timer (%s)", strerror(errno));
+    bg_dt = ans ? (struct timespec) { 0 } : old.it_value;
+
+    ans = timer_settime(sound_timerid, 0, &off, &old);
+    ALERT(ans, "unable to disarm sound timer (%s)", strerror(errno));
+    bg_st = ans ? (struct timespec) { 0 } : old.it_value;
+
+    stop_playback();
+
+    /* NOTE: the UI thread takes over once BG_PARKED is visible */
+    if (!__atomic_compare_exchange_n(&bg_state, &state, BG_PARKED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        bg_unpark();
+}
+
+/* bg_enter - asks the CPU thread to park; called on the UI thread
+ */
+static void
+bg_enter(void)
+{
+    uint8_t state = BG_RUN;     /* expected state */
+
+    __atomic_compare_exchange_n(&bg_state, &state, BG_PARK_REQ, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* bg_leave - undoes bg_enter(); called on the UI thread
+ */
+static void
+bg_leave(void)
+{
+    if (__atomic_exchange_n(&bg_state, BG_RUN, __ATOMIC_ACQ_REL) == BG_PARKED)
+        bg_unpark();
+}
+
+/* governor_step - adapts the CPU rate to the ROM's load
+ *  @vm : machine
+ *
+ * Called on the CPU thread at frame boundaries. Every 1/GOV_WINDOW_DIV
+ * seconds, the fraction of cycles that were not spent polling DT or waiting
+ * in FX0A is measured. The rate is scaled so that this fraction settles at
+ * GOV_TARGET_LOAD, decreasing gradually but going back to full speed as soon
+ * as the ROM is nearly never waiting (i.e.: it may be running behind).
+ */
+static void
+governor_step(struct chip8_vm *vm)
+{
+    static uint64_t win_cycles = 0;     /* cycles at window start      */
+    static uint64_t win_idle   = 0;     /* idle cycles at window start */
+    uint64_t        total;              /* cycles in window            */
+    double          busy;               /* busy fraction of cycles     */
+    double          rate;               /* scaled CPU rate             */
+    uint16_t        floor;              /* lowest CPU rate             */
+    uint16_t        next;               /* new CPU rate                */
+
+    total = vm->cycles - win_cycles;
+    if (total < run_freq / GOV_WINDOW_DIV)
+        return;
+
+    /* idle cycles are accounted at the end of each poll; may overlap */
+    busy = 1.0 - (double) (vm->idle_cycles - win_idle) / total;
+    busy = busy < 0 ? 0 : busy;
+
+    win_cycles = vm->cycles;
+    win_idle   = vm->idle_cycles;
+
+    if (busy >= GOV_MAX_LOAD)
+        rate = cpu_freq;
+    else {
+        rate = run_freq * busy / GOV_TARGET_LOAD;
+        rate = rate < run_freq * GOV_MAX_DROP ? run_freq * GOV_MAX_DROP : rate;
+    }
+
+    floor = cpu_freq < GOV_MIN_FREQ ? cpu_freq : GOV_MIN_FREQ;
+    next  = rate < floor    ? floor
+          : rate > cpu_freq ? cpu_freq
+          : rate;
+
+    /* changes under 1% are not worth rearming the timer */
+    if (next == run_freq ||
+        (next != cpu_freq && abs(next - run_freq) * 100 < run_freq))
+        return;
+
+    if (cpu_retime(next, speed_ppm))
+        return;
+
+    /* frames stay 1/60s long; the next boundary is placed accordingly */
+    run_freq          = next;
+    vm->batch_cycles  = run_freq / TIMER_HZ ? run_freq / TIMER_HZ : 1;
+    stats_retune(run_freq);
+}
+
+/* dt_poll - accounts cycles spent in a DT polling loop
+ *  @vm  : machine
+ *  @val : DT value that was just read by FX07
+ *
+ * DT changes at most once per frame. Reading the same value at the same
+ * address again within a few cycles means that the ROM is spinning on it,
+ * so all cycles since the previous read were wasted.
+ *
+ * NOTE: kept out of line so that ins_FX07() stays within the inline limit
+ */
+static void __attribute__((noinline))
+dt_poll(struct chip8_vm *vm, uint8_t val)
+{
+    if (vm->regs.PC == vm->dt_poll_pc && val == vm->dt_poll_val &&
+        vm->cycles - vm->dt_poll_cycle <= DT_POLL_GAP)
+    {
+        vm->idle_cycles += vm->cycles - vm->dt_poll_cycle;
+        vm->idle_loop    = vm->cycles - vm->dt_poll_cycle;
+    }
+
+    vm->dt_poll_pc    = vm->regs.PC;
+    vm->dt_poll_val   = val;
+    vm->dt_poll_cycle = vm->cycles;
 }
 
 /******************************************************************************
@@ -139,396 +575,459 @@ update_keystate(void)
  ******************************************************************************/
 
 /* 00E0 - clear screen
+ *  @vm : machine
  */
 static inline void
-ins_00E0(void)
+ins_00E0(struct chip8_vm *vm)
 {
+    memset(vm->pixels, 0x00, sizeof(vm->pixels));
+    vm->dirty |= DIRTY_SCREEN;
+
+    /* in vsync mode, only the UI thread renders */
+    if (vm->headless || vsync)
+        return;
+
     clear_screen();
 
     /* if employing lazy rendering, force a screen refresh right now */
     if (lazy_render)
-        refresh_display();
+        timed_refresh(vm);
 }
 
 /* 00EE - return from subroutine
+ *  @vm : machine
+ *
+ * NOTE: the stack pointer wraps around on underflow
  */
 static inline void
-ins_00EE(void)
+ins_00EE(struct chip8_vm *vm)
 {
-    regs.PC = stack[--regs.SP];
+    vm->regs.SP = (vm->regs.SP - 1) & 0x0f;
+    vm->regs.PC = vm->stack[vm->regs.SP];
 }
 
 /* 1NNN - jump to address NNN
+ *  @vm  : machine
  *  @nnn : destination address
  */
 static inline void
-ins_1NNN(uint16_t nnn)
+ins_1NNN(struct chip8_vm *vm, uint16_t nnn)
 {
-    regs.PC = nnn;
+    vm->regs.PC = nnn;
 }
 
 /* 2NNN - call subroutine at NNN
+ *  @vm  : machine
  *  @nnn : address of subroutine
+ *
+ * NOTE: the stack pointer wraps around on overflow
  */
 static inline void
-ins_2NNN(uint16_t nnn)
+ins_2NNN(struct chip8_vm *vm, uint16_t nnn)
 {
-    stack[regs.SP++] = regs.PC;
-    regs.PC = nnn;
+    vm->stack[vm->regs.SP] = vm->regs.PC;
+    vm->regs.SP = (vm->regs.SP + 1) & 0x0f;
+    vm->regs.PC = nnn;
 }
 
 /* 3XKK - skip next ins if Vx equals KK
+ *  @vm : machine
  *  @x  : register index
  *  @kk : value for comparison
  */
 static inline void
-ins_3XKK(uint8_t x, uint8_t kk)
+ins_3XKK(struct chip8_vm *vm, uint8_t x, uint8_t kk)
 {
-    regs.PC += 2 * (regs.V[x] == kk);
+    vm->regs.PC += 2 * (vm->regs.V[x] == kk);
 }
 
 /* 4XKK - skip next ins if Vx does not equal KK
+ *  @vm : machine
  *  @x  : register index
  *  @kk : value for comparison
  */
 static inline void
-ins_4XKK(uint8_t x, uint8_t kk)
+ins_4XKK(struct chip8_vm *vm, uint8_t x, uint8_t kk)
 {
-    regs.PC += 2 * (regs.V[x] != kk);
+    vm->regs.PC += 2 * (vm->regs.V[x] != kk);
 }
 
 /* 5XY0 - skip next inst if Vx equals Vy
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  */
 static inline void
-ins_5XY0(uint8_t x, uint8_t y)
+ins_5XY0(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.PC += 2 * (regs.V[x] == regs.V[y]);
+    vm->regs.PC += 2 * (vm->regs.V[x] == vm->regs.V[y]);
 }
 
 /* 6XKK - set value of VX register to KK
+ *  @vm : machine
  *  @x  : register index
  *  @nn : new register value
  */
 static inline void
-ins_6XKK(uint8_t x, uint8_t kk)
+ins_6XKK(struct chip8_vm *vm, uint8_t x, uint8_t kk)
 {
-    regs.V[x] = kk;
+    vm->regs.V[x] = kk;
 }
 
 /* 7XNN - add KK to Vx
+ *  @vm : machine
  *  @x  : register index
  *  @nn : added value
  */
 static inline void
-ins_7XKK(uint8_t x, uint8_t kk)
+ins_7XKK(struct chip8_vm *vm, uint8_t x, uint8_t kk)
 {
-    regs.V[x] += kk;
+    vm->regs.V[x] += kk;
 }
 
 /* 8XY0 - copy value of Vy into Vx
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  */
 static inline void
-ins_8XY0(uint8_t x, uint8_t y)
+ins_8XY0(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.V[x] = regs.V[y];
+    vm->regs.V[x] = vm->regs.V[y];
 }
 
 /* 8XY1 - load Vx OR Vy into Vx
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  *
  * NOTE: must clear Vf (quirk)
  */
 static inline void
-ins_8XY1(uint8_t x, uint8_t y)
+ins_8XY1(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.V[x] |= regs.V[y];
-    regs.VF = 0x00;
+    vm->regs.V[x] |= vm->regs.V[y];
+    vm->regs.VF = 0x00;
 }
 
 /* 8XY2 - load Vx AND Vy into Vx
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  *
  * NOTE: must clear Vf (quirk)
  */
 static inline void
-ins_8XY2(uint8_t x, uint8_t y)
+ins_8XY2(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.V[x] &= regs.V[y];
-    regs.VF = 0x00;
+    vm->regs.V[x] &= vm->regs.V[y];
+    vm->regs.VF = 0x00;
 }
 
 /* 8XY3 - load Vx XOR Vy into Vx
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  *
  * NOTE: must clear Vf (quirk)
  */
 static inline void
-ins_8XY3(uint8_t x, uint8_t y)
+ins_8XY3(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.V[x] ^= regs.V[y];
-    regs.VF = 0x00;
+    vm->regs.V[x] ^= vm->regs.V[y];
+    vm->regs.VF = 0x00;
 }
 
 /* 8XY4 - add Vx and Vy into Vx; VF = carry
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  */
 static inline void
-ins_8XY4(uint8_t x, uint8_t y)
+ins_8XY4(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
     uint8_t Vx, Vy; /* backup in case of register collision */
 
-    Vx = regs.V[x];
-    Vy = regs.V[y];
+    Vx = vm->regs.V[x];
+    Vy = vm->regs.V[y];
 
-    regs.VF = (Vx + Vy) > 0xff;
-    regs.V[x] = Vx + Vy;
+    vm->regs.VF = (Vx + Vy) > 0xff;
+    vm->regs.V[x] = Vx + Vy;
 }
 
 /* 8XY5 - subtract Vy from Vx into Vx; VF = NOT borrow
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  */
 static inline void
-ins_8XY5(uint8_t x, uint8_t y)
+ins_8XY5(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
     uint8_t Vx, Vy; /* backup in case of register collision */
 
-    Vx = regs.V[x];
-    Vy = regs.V[y];
+    Vx = vm->regs.V[x];
+    Vy = vm->regs.V[y];
 
-    regs.VF = Vx > Vy;
-    regs.V[x] = Vx - Vy;
+    vm->regs.VF = Vx > Vy;
+    vm->regs.V[x] = Vx - Vy;
 }
 
 /* 8XY6 - copy Vy into Vx and shift Vx right by 1; VF = popped bit
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  *
  * NOTE: may prove incompatible with CHIP-48 or SUPER-CHIP programs
  *       copying Vy into Vx is ignored in these architectures
  *       see the `--new-shift | -n` option for compatibility
  */
 static inline void
-ins_8XY6(uint8_t x, uint8_t y)
+ins_8XY6(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
     uint8_t Vy;     /* backup in case of register collision */
 
     /* use new implementation of shift operations */
-    if (new_shift)
+    if (vm->new_shift)
         y = x;
 
-    Vy = regs.V[y];
+    Vy = vm->regs.V[y];
 
     /* in case Vx == Vf, carry overrides shifted value */
-    regs.V[x] = Vy >> 1;
-    regs.VF = Vy & 0x01;
+    vm->regs.V[x] = Vy >> 1;
+    vm->regs.VF = Vy & 0x01;
 }
 
 /* 8XY7 - subtract Vx from Vy into Vx; VF = NOT borrow
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  */
 static inline void
-ins_8XY7(uint8_t x, uint8_t y)
+ins_8XY7(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
     uint8_t Vx, Vy; /* backup in case of register collision */
 
-    Vx = regs.V[x];
-    Vy = regs.V[y];
+    Vx = vm->regs.V[x];
+    Vy = vm->regs.V[y];
 
-    regs.VF = Vy > Vx;
-    regs.V[x] = Vy - Vx;
+    vm->regs.VF = Vy > Vx;
+    vm->regs.V[x] = Vy - Vx;
 }
 
 /* 8XYE - copy Vy into Vx and shift Vx left by 1; VF = popped bit
- *  @x : register index
- *  @y : register index
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
  *
  * NOTE: may prove incompatible with CHIP-48 or SUPER-CHIP programs
  *       copying Vy into Vx is ignored in these architectures
  *       see the `--new-shift | -n` option for compatibility
  */
 static inline void
-ins_8XYE(uint8_t x, uint8_t y)
+ins_8XYE(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
     uint8_t Vy;     /* backup in case of register collision */
 
     /* use new implementation of shift operations */
-    if (new_shift)
+    if (vm->new_shift)
         y = x;
 
-    Vy = regs.V[y];
+    Vy = vm->regs.V[y];
 
     /* in case Vx == Vf, carry overrides shifted value */
-    regs.V[x] = Vy << 1;
-    regs.VF = (Vy & 0x80) >> 7;
+    vm->regs.V[x] = Vy << 1;
+    vm->regs.VF = (Vy & 0x80) >> 7;
 }
 
 /* 9XY0 - skip next inst if Vx does not equal Vy
+ *  @vm : machine
  *  @x : register index
  *  @y : register index
  */
 
 static inline void
-ins_9XY0(uint8_t x, uint8_t y)
+ins_9XY0(struct chip8_vm *vm, uint8_t x, uint8_t y)
 {
-    regs.PC += 2 * (regs.V[x] != regs.V[y]);
+    vm->regs.PC += 2 * (vm->regs.V[x] != vm->regs.V[y]);
 }
 /* ANNN - set value of I register
+ *  @vm  : machine
  *  @nnn : new register value
  */
 static inline void
-ins_ANNN(uint16_t nnn)
+ins_ANNN(struct chip8_vm *vm, uint16_t nnn)
 {
-    regs.I = nnn;
+    vm->regs.I = nnn;
 }
 
 /* BNNN - jump to address NNN + V0
+ *  @vm  : machine
  *  @nnn : destination address
  */
 static inline void
-ins_BNNN(uint16_t nnn)
+ins_BNNN(struct chip8_vm *vm, uint16_t nnn)
 {
-    regs.PC = (nnn + regs.V[0]) & 0x0fff;
+    vm->regs.PC = (nnn + vm->regs.V[0]) & 0x0fff;
 }
 
 /* CXKK - load a random value AND KK into Vx
+ *  @vm : machine
  *  @x  : register index
  *  @kk : bit mask
  */
 static inline void
-ins_CXKK(uint8_t x, uint8_t kk)
+ins_CXKK(struct chip8_vm *vm, uint8_t x, uint8_t kk)
 {
-    regs.V[x] = random() & kk;
+    /* xorshift64; each machine has its own reproducible sequence */
+    vm->rng ^= vm->rng << 13;
+    vm->rng ^= vm->rng >> 7;
+    vm->rng ^= vm->rng << 17;
+
+    vm->regs.V[x] = vm->rng & kk;
 }
 
 /* DXYN - display at (Vx, Vy) an N-byte sprite starting at I; VF = collision
- *  @x : register index
- *  @y : register index
- *  @n : size of sprite [bytes]
+ *  @vm : machine
+ *  @x  : register index
+ *  @y  : register index
+ *  @n  : size of sprite [bytes]
  *
  * The value of individual pixels is XORed.
  * A pixel deactivation marks a collision.
  */
 static inline void
-ins_DXYN(uint8_t x, uint8_t y, uint8_t n)
+ins_DXYN(struct chip8_vm *vm, uint8_t x, uint8_t y, uint8_t n)
 {
-    regs.VF = display_sprite(regs.V[x], regs.V[y], ram + regs.I, n);
+    uint8_t *src = vm->ram + vm->regs.I;    /* sprite data                */
+    uint8_t wrapped[16];                    /* sprite data past end of RAM */
+
+    /* sprite runs past the end of RAM; wrap around to its start */
+    if (unlikely(vm->regs.I + n > RAM_SZ)) {
+        for (size_t i = 0; i < n; i++)
+            wrapped[i] = vm->ram[(vm->regs.I + i) & 0x0fff];
+        src = wrapped;
+    }
+
+    vm->regs.VF = display_sprite(vm->pixels, vm->regs.V[x], vm->regs.V[y],
+                                 src, n);
+    vm->dirty  |= DIRTY_SCREEN;
 
     /* if employing lazy rendering, force a screen refresh right now */
-    if (lazy_render)
-        refresh_display();
+    if (lazy_render && !vm->headless && !vsync)
+        timed_refresh(vm);
 }
 
 /* EX9E - skip next ins if the Vx key is pressed
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_EX9E(uint8_t x)
+ins_EX9E(struct chip8_vm *vm, uint8_t x)
 {
-    /* lazy keystate update */
-    update_keystate();
+    /* key presses observed here are no longer new for FX0A */
+    update_keystate(vm);
 
-    regs.PC += 2 * key_state[regs.V[x]];
+    vm->keys_polled |= 1 << (vm->regs.V[x] & 0x0f);
+    vm->regs.PC     += 2 * vm->key_state[vm->regs.V[x] & 0x0f];
 }
 
 /* EXA1 - skip next ins if the Vx key is not pressed
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_EXA1(uint8_t x)
+ins_EXA1(struct chip8_vm *vm, uint8_t x)
 {
-    /* lazy keystate update */
-    update_keystate();
+    /* key presses observed here are no longer new for FX0A */
+    update_keystate(vm);
 
-    regs.PC += 2 * !key_state[regs.V[x]];
+    vm->keys_polled |= 1 << (vm->regs.V[x] & 0x0f);
+    vm->regs.PC     += 2 * !vm->key_state[vm->regs.V[x] & 0x0f];
 }
 
 /* FX07 - store DT to Vx
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX07(uint8_t x)
+ins_FX07(struct chip8_vm *vm, uint8_t x)
 {
-    int32_t ans;                    /* answer                         */
-    struct itimerspec interval;     /* Delay Timer remaining interval */
-
-    /* clear Vx in preparation for a sudden abort in case of error */
-    regs.V[x] = 0;
+    /* DT is ticked at frame boundaries (see vm_frame()) */
+    vm->regs.V[x] = vm->headless ? vm->regs.DT : timer_ticks();
 
-    /* get remaining time until DT expires */
-    ans = timer_gettime(delay_timerid, &interval);
-    RET(ans, , "unable to query timer (%s)", strerror(errno));
-
-    /* get DT counter value from remaining timespan */
-    regs.V[x] = interval.it_value.tv_sec  * 60 +
-                interval.it_value.tv_nsec * 60 / 1e9;
+    dt_poll(vm, vm->regs.V[x]);
 }
 
 /* FX0A - wait for key press; store its code into Vx
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  *
  * NOTE: this instruction is blocking!
  */
 static inline void
-ins_FX0A(uint8_t x)
+ins_FX0A(struct chip8_vm *vm, uint8_t x)
 {
-    regs.V[x] = update_keystate();
+    vm->key_waited = 1;
+    vm->regs.V[x]  = update_keystate(vm);
 
     /* repeat this instruction if no new key press registered */
-    if (regs.V[x] > 0x0f)
-        regs.PC -= 2;
+    if (vm->regs.V[x] > 0x0f) {
+        vm->regs.PC -= 2;
+        vm->idle_cycles++;
+        vm->idle_loop = 1;
+    }
 }
 
 /* FX15 - load DT from Vx
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX15(uint8_t x)
+ins_FX15(struct chip8_vm *vm, uint8_t x)
 {
     int32_t           ans;          /* answer               */
     struct itimerspec interval = {  /* Delay Timer interval */
-        .it_value = {                   /* initial timer expiration @60Hz */
-            .tv_sec  = regs.V[x] / 60,
-            .tv_nsec = regs.V[x] % 60 * 1e9 / 60,
-        },
+        .it_value    = timer_span(vm->regs.V[x]),   /* @60Hz */
         .it_interval = {                /* no subsequent expiration */
             .tv_sec  = 0,
             .tv_nsec = 0,
         },
     };
 
+    if (vm->headless) {
+        vm->regs.DT = vm->regs.V[x];
+        return;
+    }
+
     /* arm timer */
     ans = timer_settime(delay_timerid, 0, &interval, NULL);
     RET(ans, , "unable to arm timer (%s)", strerror(errno));
 }
 
 /* FX18 - load ST from Vx
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX18(uint8_t x)
+ins_FX18(struct chip8_vm *vm, uint8_t x)
 {
     int32_t           ans;          /* answer               */
     struct itimerspec interval = {  /* Sound Timer interval */
-        .it_value = {                   /* initial timer expiration @60Hz */
-            .tv_sec  = regs.V[x] / 60,
-            .tv_nsec = regs.V[x] % 60 * 1e9 / 60,
-        },
+        .it_value    = timer_span(vm->regs.V[x]),   /* @60Hz */
         .it_interval = {                /* no subsequent expiration */
             .tv_sec  = 0,
             .tv_nsec = 0,
         },
     };
 
+    vm->sound_used |= !!vm->regs.V[x];
+
+    /* no audio output; ST is only kept for the sake of machine state */
+    if (vm->headless) {
+        vm->regs.ST = vm->regs.V[x];
+        return;
+    }
+
     /* arm timer */
     ans = timer_settime(sound_timerid, 0, &interval, NULL);
     RET(ans, , "unable to arm timer (%s)", strerror(errno));
@@ -538,265 +1037,901 @@ ins_FX18(uint8_t x)
     RET(ans, , "unable to start playback");
 }
 
+/* F002 - load XO-CHIP audio pattern from 16 bytes at address I
+ *  @vm : machine
+ */
+static inline void
+ins_F002(struct chip8_vm *vm)
+{
+    uint8_t pattern[PATTERN_BITS / 8];  /* audio pattern */
+
+    for (size_t i = 0; i < sizeof(pattern); i++)
+        pattern[i] = vm->ram[(vm->regs.I + i) & 0x0fff];
+
+    vm->sound_used = 1;
+
+    if (!vm->headless)
+        set_audio_pattern(pattern);
+}
+
+/* FX3A - set XO-CHIP audio pattern playback pitch to Vx
+ *  @vm : machine
+ *  @x  : register index
+ */
+static inline void
+ins_FX3A(struct chip8_vm *vm, uint8_t x)
+{
+    if (!vm->headless)
+        set_audio_pitch(vm->regs.V[x]);
+}
+
 /* FX1E - add Vx to I; set VF if I overflows
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX1E(uint8_t x)
+ins_FX1E(struct chip8_vm *vm, uint8_t x)
 {
-    regs.I += regs.V[x];
-    regs.VF = regs.I > 0x0fff;
-    regs.I &= 0x0fff;
+    vm->regs.I += vm->regs.V[x];
+    vm->regs.VF = vm->regs.I > 0x0fff;
+    vm->regs.I &= 0x0fff;
 }
 
 /* FX29 - load address of digit in Vx to I
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX29(uint8_t x)
+ins_FX29(struct chip8_vm *vm, uint8_t x)
 {
-    regs.I = font_offset + 5 * (regs.V[x] & 0x0f);
+    vm->regs.I = vm->font_offset + 5 * (vm->regs.V[x] & 0x0f);
 }
 
 /* FX33 - store BCD representation of Vx at address I
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  */
 static inline void
-ins_FX33(uint8_t x)
+ins_FX33(struct chip8_vm *vm, uint8_t x)
 {
-    uint8_t *_ram = (uint8_t *) ram;
+    vm->ram[(vm->regs.I + 0) & 0x0fff] = (vm->regs.V[x] / 100) % 10;
+    vm->ram[(vm->regs.I + 1) & 0x0fff] = (vm->regs.V[x] /  10) % 10;
+    vm->ram[(vm->regs.I + 2) & 0x0fff] = (vm->regs.V[x] /   1) % 10;
 
-    _ram[regs.I + 0] = (regs.V[x] / 100) % 10;
-    _ram[regs.I + 1] = (regs.V[x] /  10) % 10;
-    _ram[regs.I + 2] = (regs.V[x] /   1) % 10;
+    /* self-modifying code may have overwritten cached translations */
+    invalidate_code(vm, vm->regs.I, 3);
+    journal_write(vm, vm->regs.I, 3);
 }
 
 /* FX55 - store V0-x at address I
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  *
  * NOTE: I must be incremented (quirk)
+ * NOTE: writes past the end of RAM wrap around to its start
  */
 static inline void
-ins_FX55(uint8_t x)
+ins_FX55(struct chip8_vm *vm, uint8_t x)
 {
-    memmove(ram + regs.I, regs.V, x + 1);
-    regs.I += x + 1;
+    if (likely(vm->regs.I + x < RAM_SZ)) {
+        memmove(vm->ram + vm->regs.I, vm->regs.V, x + 1);
+    } else {
+        for (size_t i = 0; i <= x; i++)
+            vm->ram[(vm->regs.I + i) & 0x0fff] = vm->regs.V[i];
+    }
+
+    invalidate_code(vm, vm->regs.I, x + 1);
+    journal_write(vm, vm->regs.I, x + 1);
+    vm->regs.I = (vm->regs.I + x + 1) & 0x0fff;
 }
 
 /* FX65 - load V0-x from address I
- *  @x : register index
+ *  @vm : machine
+ *  @x  : register index
  *
  * NOTE: I must be incremented (quirk)
+ * NOTE: reads past the end of RAM wrap around to its start
  */
 static inline void
-ins_FX65(uint8_t x)
+ins_FX65(struct chip8_vm *vm, uint8_t x)
 {
-    memmove(regs.V, ram + regs.I, x + 1);
-    regs.I += x + 1;
+    if (likely(vm->regs.I + x < RAM_SZ)) {
+        memmove(vm->regs.V, vm->ram + vm->regs.I, x + 1);
+    } else {
+        for (size_t i = 0; i <= x; i++)
+            vm->regs.V[i] = vm->ram[(vm->regs.I + i) & 0x0fff];
+    }
+
+    vm->regs.I = (vm->regs.I + x + 1) & 0x0fff;
 }
 
 /******************************************************************************
- ********************************* INTERNALS **********************************
+ ****************************** SUPERINSTRUCTIONS *****************************
  ******************************************************************************/
 
-/* consume_ins - executes one instruction and updates internal state
- *  @data : user data (if any)
+/* skip_taken - evaluates the condition of a conditional skip instruction
+ *  @vm  : machine
+ *  @ins : one of 3XKK, 4XKK, 5XY0, 9XY0
  *
- * NOTE: this is registered as a callback to a POSIX interval timer.
+ *  @return : 1 if the next instruction would be skipped
  */
-static void
-consume_ins(union sigval data)
+static inline uint8_t
+skip_taken(struct chip8_vm *vm, uint16_t ins)
 {
-    static   size_t     cycle = 0;          /* cycle count          */
-    static   uint64_t   rbp = 0;            /* first call frame RBP */
-    register uint64_t   _rbp asm("rbp");    /* current RBP          */
-    uint16_t            ins;                /* fetched instruction  */
-    SDL_Event           ev;                 /* SDL event            */
-    struct itimerspec   interval = { 0 };   /* timer disarmer       */
-    int32_t             ans;                /* answer               */
-    uint16_t            nnn;                /* ls 3 nibbles         */
-    uint8_t             kk;                 /* ls 2 nibbles         */
-    uint8_t             n;                  /* ls 1 nibble          */
-    uint8_t             x;                  /* Vx reg index         */
-    uint8_t             y;                  /* Vy reg index         */
-
-    /* process SDL events (interested only in quit event) */
-    while (SDL_PollEvent(&ev)) {
-        switch (ev.type) {
-            case SDL_QUIT:
-                /* disarm CPU timer; don't care about the rest */
-                ans = timer_settime(cpu_timerid, 0, &interval, NULL);
-                DIE(ans, "unable to disarm timer (%s)", strerror(errno));
-
-                /* set quit condition */
-                quit = 1;
-        }
+    uint8_t x  = (ins & 0x0f00) >> 8;
+    uint8_t y  = (ins & 0x00f0) >> 4;
+    uint8_t kk = ins & 0x00ff;
+
+    switch ((ins & 0xf000) >> 12) {
+        case 0x3:
+            return vm->regs.V[x] == kk;
+        case 0x4:
+            return vm->regs.V[x] != kk;
+        case 0x5:
+            return vm->regs.V[x] == vm->regs.V[y];
+        default:    /* 0x9 */
+            return vm->regs.V[x] != vm->regs.V[y];
     }
+}
 
-    /* initialize reference RBP (once) */
-    if (unlikely(!rbp))
-        rbp = _rbp;
+/* is_skip - checks if an instruction is a register-based conditional skip
+ *  @ins : instruction
+ *
+ *  @return : 1 if ins is one of 3XKK, 4XKK, 5XY0, 9XY0
+ */
+static inline uint8_t
+is_skip(uint16_t ins)
+{
+    switch ((ins & 0xf000) >> 12) {
+        case 0x3:
+        case 0x4:
+            return 1;
+        case 0x5:
+        case 0x9:
+            return (ins & 0x000f) == 0x0;
+        default:
+            return 0;
+    }
+}
 
-    /* more than one call frame means that we've preempted ourselves */
-    if (rbp != _rbp) {
-        WAR("CPU frequency may be too high (rbp=%#lx, _rbp=%#lx)", rbp, _rbp);
+/* fuse_decode - identifies the superinstruction starting at a given address
+ *  @vm   : machine
+ *  @addr : address of the first instruction in the sequence
+ *
+ *  @return : FUSE_* kind (FUSE_NONE if no known sequence matches)
+ *
+ * Triples are matched before pairs so that e.g. a 3XKK + 1NNN pair that is
+ * part of a counted loop is executed as a whole.
+ */
+static uint8_t
+fuse_decode(struct chip8_vm *vm, uint16_t addr)
+{
+    uint16_t i0, i1, i2;    /* instruction sequence */
+
+    /* sequence would run off the end of RAM */
+    if (addr > RAM_SZ - 6)
+        return FUSE_NONE;
+
+    i0 = fetch(vm, addr);
+    i1 = fetch(vm, addr + 2);
+    i2 = fetch(vm, addr + 4);
+
+    /* 7XKK + skip + 1NNN : counted loop */
+    if ((i0 & 0xf000) == 0x7000 && is_skip(i1) && (i2 & 0xf000) == 0x1000)
+        return FUSE_LOOP;
+
+    /* FX07 + skip on Vx + 1NNN : delay timer wait */
+    if ((i0 & 0xf0ff) == 0xf007 && is_skip(i1)
+    &&  (i1 & 0x0f00) == (i0 & 0x0f00) && (i2 & 0xf000) == 0x1000)
+        return FUSE_DTWAIT;
+
+    /* ANNN + DXYN : sprite draw */
+    if ((i0 & 0xf000) == 0xa000 && (i1 & 0xf000) == 0xd000)
+        return FUSE_DRAW;
+
+    /* 6XKK + 6XKK : register initialization chain */
+    if ((i0 & 0xf000) == 0x6000 && (i1 & 0xf000) == 0x6000)
+        return FUSE_LOAD2;
+
+    /* skip + 1NNN : conditional jump */
+    if (is_skip(i0) && (i1 & 0xf000) == 0x1000)
+        return FUSE_SKJP;
+
+    return FUSE_NONE;
+}
+
+/* exec_fused - executes the superinstruction at PC (if any)
+ *  @vm     : machine
+ *  @return : number of cycles consumed by the sequence
+ *            0 if no superinstruction was executed
+ *
+ * Each superinstruction has the same effect as executing its components one
+ * by one. The caller is responsible for accounting the returned number of
+ * cycles so that the emulated CPU frequency is not altered.
+ */
+static uint8_t
+exec_fused(struct chip8_vm *vm)
+{
+    uint16_t pc = vm->regs.PC;  /* address of first instruction */
+    uint16_t i0, i1, i2;    /* instruction sequence         */
+    uint8_t  kind;          /* superinstruction kind        */
+
+    /* lazily predecode the sequence at PC */
+    kind = vm->fuse_map[pc];
+    if (unlikely(kind == FUSE_UNK))
+        kind = vm->fuse_map[pc] = fuse_decode(vm, pc);
+    if (kind == FUSE_NONE)
+        return 0;
+
+    vm->fuse_hits[kind]++;
+
+    i0 = fetch(vm, pc);
+    i1 = fetch(vm, pc + 2);
+
+    switch (kind) {
+        case FUSE_DRAW:
+            vm->regs.PC = pc + 4;
+            ins_ANNN(vm, i0 & 0x0fff);
+            ins_DXYN(vm, (i1 & 0x0f00) >> 8, (i1 & 0x00f0) >> 4, i1 & 0x000f);
+            return 2;
+        case FUSE_LOOP:
+        case FUSE_DTWAIT:
+            i2 = fetch(vm, pc + 4);
+
+            /* PC past the first instruction, as it would be when executed *
+             * alone (FX07 records it for idle loop detection)             */
+            vm->regs.PC = pc + 2;
+
+            if (kind == FUSE_LOOP)
+                ins_7XKK(vm, (i0 & 0x0f00) >> 8, i0 & 0x00ff);
+            else
+                ins_FX07(vm, (i0 & 0x0f00) >> 8);
+
+            /* skip over the jump; the jump itself is never executed */
+            if (skip_taken(vm, i1)) {
+                vm->regs.PC = pc + 6;
+                return 2;
+            }
+
+            ins_1NNN(vm, i2 & 0x0fff);
+            return 3;
+        case FUSE_LOAD2:
+            vm->regs.PC = pc + 4;
+            ins_6XKK(vm, (i0 & 0x0f00) >> 8, i0 & 0x00ff);
+            ins_6XKK(vm, (i1 & 0x0f00) >> 8, i1 & 0x00ff);
+            return 2;
+        case FUSE_SKJP:
+            /* skip over the jump; only the skip itself was executed */
+            if (skip_taken(vm, i0)) {
+                vm->regs.PC = pc + 4;
+                return 1;
+            }
+
+            ins_1NNN(vm, i1 & 0x0fff);
+            return 2;
+    }
+
+    return 0;
+}
+
+/* fuse_report - prints superinstruction execution counts
+ *  @vm : machine
+ */
+static void
+fuse_report(struct chip8_vm *vm)
+{
+    static const char *names[FUSE_MAX] = {
+        [FUSE_DRAW]   = "ANNN+DXYN",
+        [FUSE_LOOP]   = "7XKK+skip+1NNN",
+        [FUSE_DTWAIT] = "FX07+skip+1NNN",
+        [FUSE_LOAD2]  = "6XKK+6XKK",
+        [FUSE_SKJP]   = "skip+1NNN",
+    };
+
+    DEBUG("Superinstruction hits:");
+    for (size_t i = FUSE_DRAW; i < FUSE_MAX; i++)
+        DEBUG("    %-16s %lu", names[i], vm->fuse_hits[i]);
+}
+
+/******************************************************************************
+ ********************************* INTERNALS **********************************
+ ******************************************************************************/
+
+/* unknown_ins - accounts an instruction that could not be decoded
+ *  @vm  : machine
+ *  @ins : instruction (host byte order)
+ *
+ * Headless machines (e.g.: when fuzzing) only count these; logging each one
+ * would otherwise take up most of the execution time. Kept out of line so
+ * that the error path does not bloat the dispatch code.
+ */
+static void __attribute__((cold, noinline))
+unknown_ins(struct chip8_vm *vm, uint16_t ins)
+{
+    vm->bad_ins++;
+
+    if (!vm->headless)
+        ERROR("unknown instruction %04hx", ins);
+}
+
+/* debug_ins - executes an instruction of the timing debug extension
+ *  @vm  : machine
+ *  @ins : instruction (host byte order)
+ *  @op  : decoded instruction
+ *
+ * 01X0 / 01X1 store the low 32 bits of the emulated cycle counter / host
+ * monotonic clock [ns] in VX..VX+3 (big endian, register indices wrap
+ * around). 02NN / 03NN mark the beginning / end of timing region NN; totals
+ * are reported on exit. Unless enabled, these are unknown instructions, as
+ * on any other interpreter. Kept out of line so that the dispatch code of
+ * the timed routines is not affected.
+ */
+static void __attribute__((noinline))
+debug_ins(struct chip8_vm *vm, uint16_t ins, struct opcode op)
+{
+    uint32_t val;   /* value stored in VX */
+
+    if (!vm->debug_ops) {
+        unknown_ins(vm, ins);
         return;
     }
 
-    /* fetch instruction and change byte order to match host's */
-    ins = ntohs(*(uint16_t *)(ram + regs.PC));
-    regs.PC += 2;
+    switch (op.op) {
+        case OP_01X0:
+            val = vm->cycles;
+            break;
+        case OP_01X1:
+            val = tsc_ns();
+            break;
+        default:
+            stats_region(op.kk, op.op == OP_03NN, vm->cycles);
+            return;
+    }
 
-    /* get easy access to potential instructions parameters */
-    nnn = ins & 0x0fff;
-    kk  = ins & 0x00ff;
-    n   = ins & 0x000f;
-    x   = (ins & 0x0f00) >> 8;
-    y   = (ins & 0x00f0) >> 4;
+    for (size_t i = 0; i < 4; i++)
+        vm->regs.V[(op.y + i) & 0x0f] = val >> (24 - 8 * i);
+}
 
-    /* start decoding the instruction by class (first nibble) */
-    switch ((ins & 0xf000) >> 12) {
-        case 0x0:
-            switch (ins) {
-                case 0x00e0:    /* CLS */
-                    ins_00E0();
-                    break;
-                case 0x00ee:    /* RET */
-                    ins_00EE();
-                    break;
-                default:
-                    RET(1, , "unknown instruction %04hx", ins);
-            }
+/* opcode -> handler and pre-extracted operands; generated at build time */
+static const struct opcode optab[0x10000] = {
+#include "optab.inc"
+};
+
+/* exec_ins - decodes and executes one instruction
+ *  @vm  : machine
+ *  @ins : instruction (host byte order)
+ *
+ * Decoding is a single load from optab; the handler index is dense, so the
+ * switch below compiles to one indirect jump.
+ */
+static void
+exec_ins(struct chip8_vm *vm, uint16_t ins)
+{
+    struct opcode op = optab[ins];      /* decoded instruction */
+
+    switch (op.op) {
+        case OP_00E0:   /* CLS */
+            ins_00E0(vm);
             break;
-        case 0x1:   /* JP addr */
-            ins_1NNN(nnn);
+        case OP_00EE:   /* RET */
+            ins_00EE(vm);
             break;
-        case 0x2:   /* CALL addr */
-            ins_2NNN(nnn);
+        case OP_01X0:   /* CYC Vx (debug) */
+        case OP_01X1:   /* NSEC Vx (debug) */
+        case OP_02NN:   /* BEGIN byte (debug) */
+        case OP_03NN:   /* END byte (debug) */
+            debug_ins(vm, ins, op);
             break;
-        case 0x3:   /* SE Vx, byte */
-            ins_3XKK(x, kk);
+        case OP_1NNN:   /* JP addr */
+            ins_1NNN(vm, ins & 0x0fff);
             break;
-        case 0x4:   /* SNE Vx, byte */
-            ins_4XKK(x, kk);
+        case OP_2NNN:   /* CALL addr */
+            ins_2NNN(vm, ins & 0x0fff);
             break;
-        case 0x5:
-            switch (ins & 0x000f) {
-                case 0x0:   /* SE Vx, Vy */
-                    ins_5XY0(x, y);
-                    break;
-                default:
-                    RET(1, , "unknown instruction %04hx", ins);
-            }
+        case OP_3XKK:   /* SE Vx, byte */
+            ins_3XKK(vm, op.x, op.kk);
             break;
-        case 0x6:   /* LD Vx, byte */
-            ins_6XKK(x, kk);
+        case OP_4XKK:   /* SNE Vx, byte */
+            ins_4XKK(vm, op.x, op.kk);
             break;
-        case 0x7:   /* ADD Vx, byte */
-            ins_7XKK(x, kk);
+        case OP_5XY0:   /* SE Vx, Vy */
+            ins_5XY0(vm, op.x, op.y);
             break;
-        case 0x8:
-            switch (ins & 0x000f) {
-                case 0x0:   /* LD Vx, Vy */
-                    ins_8XY0(x, y);
-                    break;
-                case 0x1:   /* OR Vx, Vy */
-                    ins_8XY1(x, y);
-                    break;
-                case 0x2:   /* AND Vx, Vy */
-                    ins_8XY2(x, y);
-                    break;
-                case 0x3:   /* XOR Vx, Vy */
-                    ins_8XY3(x, y);
-                    break;
-                case 0x4:   /* ADD Vx, Vy */
-                    ins_8XY4(x, y);
-                    break;
-                case 0x5:   /* SUB Vx, Vy */
-                    ins_8XY5(x, y);
-                    break;
-                case 0x6:   /* SHR Vx, Vy */
-                    ins_8XY6(x, y);
-                    break;
-                case 0x7:   /* SUBN Vx, Vy */
-                    ins_8XY7(x, y);
-                    break;
-                case 0xe:   /* SHL Vx, Vy */
-                    ins_8XYE(x, y);
-                    break;
-                default:
-                    RET(1, , "unknown instruction %04hx", ins);
-            }
+        case OP_6XKK:   /* LD Vx, byte */
+            ins_6XKK(vm, op.x, op.kk);
             break;
-        case 0x9:
-            switch (ins & 0x000f) {
-                case 0x0:   /* SNE Vx, Vy */
-                    ins_9XY0(x, y);
-                    break;
-                default:
-                    RET(1, , "unknown instruction %04hx", ins);
-            }
+        case OP_7XKK:   /* ADD Vx, byte */
+            ins_7XKK(vm, op.x, op.kk);
             break;
-        case 0xa:   /* LD I, addr */
-            ins_ANNN(nnn);
+        case OP_8XY0:   /* LD Vx, Vy */
+            ins_8XY0(vm, op.x, op.y);
             break;
-        case 0xb:   /* JP V0, addr */
-            ins_BNNN(nnn);
+        case OP_8XY1:   /* OR Vx, Vy */
+            ins_8XY1(vm, op.x, op.y);
             break;
-        case 0xc:   /* RND Vx, byte */
-            ins_CXKK(x, kk);
+        case OP_8XY2:   /* AND Vx, Vy */
+            ins_8XY2(vm, op.x, op.y);
             break;
-        case 0xd:   /* DRW Vx, Vy, nibble */
-            ins_DXYN(x, y, n);
+        case OP_8XY3:   /* XOR Vx, Vy */
+            ins_8XY3(vm, op.x, op.y);
             break;
-        case 0xe:
-            switch (ins & 0x00ff) {
-                case 0x9e:  /* SKP Vx */
-                    ins_EX9E(x);
-                    break;
-                case 0xa1:  /* SKNP Vx */
-                    ins_EXA1(x);
-                    break;
-                default:
-                    RET(1, , "unknown instruction %04hx", ins);
-            }
+        case OP_8XY4:   /* ADD Vx, Vy */
+            ins_8XY4(vm, op.x, op.y);
             break;
-        case 0xf:
-            switch (ins & 0x00ff) {
-                case 0x07:  /* LD Vx, DT */
-                    ins_FX07(x);
-                    break;
-                case 0x0a:  /* LD Vx, K */
-                    ins_FX0A(x);
-                    break;
-                case 0x15:  /* LD DT, Vx */
-                    ins_FX15(x);
-                    break;
-                case 0x18:  /* LD ST, Vx */
-                    ins_FX18(x);
-                    break;
-                case 0x1e:  /* ADD I, Vx */
-                    ins_FX1E(x);
-                    break;
-                case 0x29:  /* LD F, Vx */
-                    ins_FX29(x);
+        case OP_8XY5:   /* SUB Vx, Vy */
+            ins_8XY5(vm, op.x, op.y);
+            break;
+        case OP_8XY6:   /* SHR Vx, Vy */
+            ins_8XY6(vm, op.x, op.y);
+            break;
+        case OP_8XY7:   /* SUBN Vx, Vy */
+            ins_8XY7(vm, op.x, op.y);
+            break;
+        case OP_8XYE:   /* SHL Vx, Vy */
+            ins_8XYE(vm, op.x, op.y);
+            break;
+        case OP_9XY0:   /* SNE Vx, Vy */
+            ins_9XY0(vm, op.x, op.y);
+            break;
+        case OP_ANNN:   /* LD I, addr */
+            ins_ANNN(vm, ins & 0x0fff);
+            break;
+        case OP_BNNN:   /* JP V0, addr */
+            ins_BNNN(vm, ins & 0x0fff);
+            break;
+        case OP_CXKK:   /* RND Vx, byte */
+            ins_CXKK(vm, op.x, op.kk);
+            break;
+        case OP_DXYN:   /* DRW Vx, Vy, nibble */
+            ins_DXYN(vm, op.x, op.y, op.kk & 0x0f);
+            break;
+        case OP_EX9E:   /* SKP Vx */
+            ins_EX9E(vm, op.x);
+            break;
+        case OP_EXA1:   /* SKNP Vx */
+            ins_EXA1(vm, op.x);
+            break;
+        case OP_F002:   /* AUDIO (XO-CHIP) */
+            ins_F002(vm);
+            break;
+        case OP_FX07:   /* LD Vx, DT */
+            ins_FX07(vm, op.x);
+            break;
+        case OP_FX0A:   /* LD Vx, K */
+            ins_FX0A(vm, op.x);
+            break;
+        case OP_FX15:   /* LD DT, Vx */
+            ins_FX15(vm, op.x);
+            break;
+        case OP_FX18:   /* LD ST, Vx */
+            ins_FX18(vm, op.x);
+            break;
+        case OP_FX1E:   /* ADD I, Vx */
+            ins_FX1E(vm, op.x);
+            break;
+        case OP_FX29:   /* LD F, Vx */
+            ins_FX29(vm, op.x);
+            break;
+        case OP_FX33:   /* LD B, Vx */
+            ins_FX33(vm, op.x);
+            break;
+        case OP_FX3A:   /* PITCH Vx (XO-CHIP) */
+            ins_FX3A(vm, op.x);
+            break;
+        case OP_FX55:   /* LD [I], Vx */
+            ins_FX55(vm, op.x);
+            break;
+        case OP_FX65:   /* LD Vx, [I] */
+            ins_FX65(vm, op.x);
+            break;
+        default:
+            unknown_ins(vm, ins);
+            break;
+    }
+}
+
+/* vm_frame - performs the per-frame work at a batch boundary
+ *  @vm : machine
+ *
+ * Headless machines tick their DT and ST counters here, i.e. every
+ * CPU_FREQ/60 cycles, so that their execution is a function of their inputs.
+ */
+static void
+vm_frame(struct chip8_vm *vm)
+{
+    if (vm->headless && vm->cycles) {
+        vm->regs.DT -= !!vm->regs.DT;
+        vm->regs.ST -= !!vm->regs.ST;
+    }
+
+    /* apply key state changes queued by the UI thread */
+    apply_input(vm);
+}
+
+/* idle_skip - fast-forwards a headless machine through an idle loop
+ *  @vm  : machine that just executed a cycle
+ *  @max : largest number of cycles that may be skipped
+ *
+ *  @return : number of skipped cycles
+ *
+ * DT and the key state only change at batch boundaries. Until then, a
+ * repeating FX0A and an FX07 + skip + 1NNN loop polling DT leave the machine
+ * in the same state after every iteration, so whole iterations up to the
+ * next boundary are accounted as executed without running them. The state
+ * at every boundary is the same as if they had been run.
+ */
+static uint64_t
+idle_skip(struct chip8_vm *vm, uint64_t max)
+{
+    uint8_t  len = vm->idle_loop;   /* loop length [cycles]            */
+    uint16_t pc  = vm->regs.PC;     /* next instruction                */
+    uint64_t left;                  /* cycles until next batch boundary */
+
+    vm->idle_loop = 0;
+
+    /* superinstructions are in the middle of their run */
+    if (!vm->skip_idle || vm->stall || (len != 1 && len != 3))
+        return 0;
+
+    /* FX07 was just executed; the rest of the loop must follow */
+    if (len == 3 && (!is_skip(fetch(vm, pc)) ||
+                     fetch(vm, pc + 2) != (0x1000 | ((pc - 2) & 0x0fff))))
+        return 0;
+
+    left  = (vm->batch_cycles - vm->cycles % vm->batch_cycles)
+          % vm->batch_cycles;
+    left  = left < max ? left : max;
+    left -= left % len;
+
+    vm->cycles      += left;
+    vm->idle_cycles += left;
+
+    return left;
+}
+
+/* journal_copy - copies the journaled state from one machine to another
+ *  @dst    : destination machine
+ *  @src    : source machine
+ *  @blocks : RAM blocks to copy (bitmap)
+ *  @flags  : DIRTY_* state to copy
+ *
+ * The resources and engine selection of @dst are kept. Pending input events
+ * are always copied; there are usually few of them.
+ */
+static void
+journal_copy(struct chip8_vm       *dst,
+             const struct chip8_vm *src,
+             uint64_t              blocks,
+             uint8_t               flags)
+{
+    uint8_t         *ram       = dst->ram;       /* own RAM                */
+    uint8_t         *fuse_map  = dst->fuse_map;  /* own superinstructions  */
+    size_t          *fuse_hits = dst->fuse_hits; /* own hit counters       */
+    struct ir_cache *ir_cache  = dst->ir_cache;  /* own IR blocks          */
+    uint8_t         fuse       = dst->fuse;      /* own engine selection   */
+    size_t          off;                         /* RAM block offset       */
+
+    for (; blocks; blocks &= blocks - 1) {
+        off = __builtin_ctzl(blocks) * DIRTY_BLK_SZ;
+        memcpy(ram + off, src->ram + off, DIRTY_BLK_SZ);
+    }
+
+    if (flags & DIRTY_SCREEN)
+        memcpy(dst->pixels, src->pixels, sizeof(dst->pixels));
+
+    /* everything up to the screen is registers, counters and pointers */
+    if (flags & DIRTY_REGS) {
+        memcpy(dst, src, offsetof(struct chip8_vm, pixels));
+
+        dst->ram       = ram;
+        dst->fuse_map  = fuse_map;
+        dst->fuse_hits = fuse_hits;
+        dst->ir_cache  = ir_cache;
+        dst->fuse      = fuse;
+    }
+
+    dst->input_q.head = src->input_q.head;
+    dst->input_q.tail = src->input_q.tail;
+    for (uint32_t i = src->input_q.head; i != src->input_q.tail; i++)
+        dst->input_q.ev[i % INPUT_QUEUE_SZ] =
+            src->input_q.ev[i % INPUT_QUEUE_SZ];
+}
+
+/* slab_init - creates the allocators of machine states and RAM (once)
+ *
+ * Never destroyed; memory of freed machines is recycled instead.
+ */
+static void
+slab_init(void)
+{
+    ram_slab = slab_create(RAM_SZ);
+    vm_slab  = slab_create(sizeof(struct chip8_vm));
+}
+
+/* exec_cycle - executes one CPU cycle worth of instructions
+ *  @vm : machine
+ *
+ * Superinstructions and IR blocks execute multiple instructions at once and
+ * leave the machine stalled for the remainder of their cycles. On headless
+ * machines, none is started if it may span a batch boundary, so that the
+ * state at every boundary is the same as with the switch interpreter alone.
+ */
+static void
+exec_cycle(struct chip8_vm *vm)
+{
+    uint64_t left;      /* cycles until next batch boundary */
+    uint16_t ins;       /* fetched instruction              */
+
+    /* this cycle was already executed as part of a superinstruction */
+    if (vm->stall) {
+        vm->stall--;
+        return;
+    }
+
+    /* skips and sequential execution may run past the end of RAM */
+    vm->regs.PC &= 0x0fff;
+
+    /* try executing multiple instructions at once */
+    left = vm->headless ? vm->batch_cycles - vm->cycles % vm->batch_cycles
+                        : UINT8_MAX;
+
+    if (vm->ir_cache)
+        vm->stall = ir_exec(vm->ir_cache, vm->ram, &vm->regs, left);
+    if (!vm->stall && vm->fuse && left >= 3)
+        vm->stall = exec_fused(vm);
+    if (vm->stall) {
+        vm->stall--;
+        return;
+    }
+
+    /* fetch instruction and change byte order to match host's */
+    ins = fetch(vm, vm->regs.PC);
+    vm->regs.PC += 2;
+
+    exec_ins(vm, ins);
+}
+
+/* consume_ins - executes one instruction and updates internal state
+ *  @data : user data (if any)
+ *
+ * NOTE: this is registered as a callback to a POSIX interval timer.
+ */
+static void
+consume_ins(union sigval data)
+{
+    static   uint64_t   rbp = 0;            /* first call frame RBP */
+    register uint64_t   _rbp asm("rbp");    /* current RBP          */
+    struct chip8_vm     *vm = &main_vm;     /* interactive machine  */
+    uint64_t            t;                  /* section start time   */
+
+    /* expirations already queued when sys_stop() disarmed the timer */
+    if (unlikely(__atomic_load_n(&quit, __ATOMIC_RELAXED)))
+        return;
+
+    /* initialize reference RBP (once) */
+    if (unlikely(!rbp))
+        rbp = _rbp;
+
+    /* more than one call frame means that we've preempted ourselves *
+     * (only timer expirations can preempt; see cpu_loop())         */
+    if (!uncapped && rbp != _rbp) {
+        WAR("CPU frequency may be too high (rbp=%#lx, _rbp=%#lx)", rbp, _rbp);
+        stats_dropped();
+        return;
+    }
+
+    t = stats_now();
+
+    /* NOTE: not a multiple of batch_cycles once the governor changed it */
+    if (vm->cycles == frame_cycle) {
+        vm_frame(vm);
+
+        if (vsync) {
+            frame_publish(vm);
+            speed_apply();
+        }
+        if (auto_freq)
+            governor_step(vm);
+
+        /* window hidden / minimized; this is the last cycle until shown */
+        if (unlikely(__atomic_load_n(&bg_state, __ATOMIC_ACQUIRE)
+                     == BG_PARK_REQ))
+            bg_park();
+        if (unlikely(__atomic_load_n(&bg_redraw, __ATOMIC_RELAXED))) {
+            __atomic_store_n(&bg_redraw, 0, __ATOMIC_RELAXED);
+            if (!vsync)
+                timed_refresh(vm);
+        }
+
+        /* NOTE: read by the UI thread when stamping input events */
+        __atomic_store_n(&frame_cycle, vm->cycles + vm->batch_cycles,
+                         __ATOMIC_RELAXED);
+    }
+
+    t = stats_add(STATS_FRAME, t);
+
+    exec_cycle(vm);
+
+    t = stats_add(STATS_CORE, t);
+
+    /* every so often, force display update to avoid artifacts */
+    if (!lazy_render && !vsync && (vm->cycles % ref_interval == 0))
+        timed_refresh(vm);
+
+    /* NOTE: read by the UI thread when pacing */
+    __atomic_store_n(&vm->cycles, vm->cycles + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&emu_ns, emu_ns + 1000000000UL / run_freq,
+                     __ATOMIC_RELAXED);
+
+    stats_cycles(1);
+}
+
+/* cpu_loop - executes instructions back to back, without the CPU timer
+ *  @arg : unused
+ *
+ *  @return : NULL
+ *
+ * Runs on its own thread in uncapped mode, for as long as the machine runs.
+ * DT, ST and the display still follow host time. While the window is hidden
+ * execution is parked as usual (see bg_park()); the loop only polls for it
+ * to be resumed.
+ */
+static void *
+cpu_loop(void *arg)
+{
+    struct timespec ts = { .tv_nsec = 1000000000UL / TIMER_HZ };
+
+    while (!__atomic_load_n(&quit, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(&bg_state, __ATOMIC_ACQUIRE) == BG_PARKED) {
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        consume_ins((union sigval) { .sival_ptr = NULL });
+    }
+
+    return NULL;
+}
+
+/* push_key - forwards a key state change to the interactive machine
+ *  @key  : chip8 key index
+ *  @down : 1 if pressed, 0 if released
+ *
+ * The change is stamped with the next frame boundary, i.e. the first cycle
+ * at which the core is guaranteed to poll the input queue after the event
+ * was received. Boundaries are one 60Hz frame apart at the CPU rate in
+ * effect (see governor_step()). Called only by the producer of the input
+ * queue: the UI thread or, with evdev input, the evdev thread.
+ */
+static void
+push_key(uint8_t key, uint8_t down)
+{
+    struct chip8_vm   *vm = &main_vm;       /* interactive machine */
+    uint64_t          visible;              /* stamp               */
+
+    visible = __atomic_load_n(&frame_cycle, __ATOMIC_RELAXED);
+
+    input_push(&vm->input_q, visible, key, down);
+}
+
+/* handle_event - processes one SDL event on the UI thread
+ *  @ev : SDL event
+ *
+ * Key state changes are forwarded to the core via the input queue, unless
+ * keys are read directly from evdev devices.
+ */
+static void
+handle_event(SDL_Event *ev)
+{
+    switch (ev->type) {
+        case SDL_QUIT:
+            sys_stop();
+            break;
+        case SDL_WINDOWEVENT:
+            switch (ev->window.event) {
+                case SDL_WINDOWEVENT_HIDDEN:
+                case SDL_WINDOWEVENT_MINIMIZED:
+                    bg_enter();
                     break;
-                case 0x33:  /* LD B, Vx */
-                    ins_FX33(x);
+                case SDL_WINDOWEVENT_SHOWN:
+                case SDL_WINDOWEVENT_EXPOSED:
+                case SDL_WINDOWEVENT_RESTORED:
+                case SDL_WINDOWEVENT_MAXIMIZED:
+                    bg_leave();
                     break;
-                case 0x55:  /* LD [I], Vx */
-                    ins_FX55(x);
+                case SDL_WINDOWEVENT_FOCUS_LOST:
+                    set_audio_muted(1);
                     break;
-                case 0x65:  /* LD Vx, [I] */
-                    ins_FX65(x);
+                case SDL_WINDOWEVENT_FOCUS_GAINED:
+                    set_audio_muted(0);
                     break;
             }
             break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            /* ignore auto-repeat; the key is already down */
+            if (ev->key.repeat || evdev)
+                break;
+
+            for (size_t i = 0; i < sizeof(key_map) / sizeof(*key_map); i++)
+                if (key_map[i] == ev->key.keysym.scancode)
+                    push_key(i, ev->type == SDL_KEYDOWN);
+            break;
     }
+}
 
-    /* every so often, force display update to avoid artifacts */
-    if (!lazy_render && (cycle++ % ref_interval == 0))
-        refresh_display();
+/* vsync_pace - matches the emulated clock to the display refresh rate
+ *  @relock : presents were interrupted (e.g.: window minimized)
+ *
+ * Called on the UI thread after every present. The refresh period is tracked
+ * as a moving average; if it is within 0.5% of 60Hz, the CPU clock (and with
+ * it DT, ST and audio pattern playback) is scaled by the same ratio, so that
+ * each refresh shows exactly one new emulated frame. A proportional term on
+ * the number of frames emulated ahead of (or behind) presents keeps the two
+ * in phase. Displays too far from 60Hz are presented to at the nominal rate.
+ */
+static void
+vsync_pace(uint8_t relock)
+{
+    static uint64_t last     = 0;   /* previous present time [ns]    */
+    static double   period   = 0;   /* average refresh period [ns]   */
+    static uint64_t presents = 0;   /* refreshes since lock          */
+    static double   frame0   = -1;  /* emulated frames at lock       */
+    struct timespec ts;             /* current time                  */
+    uint64_t        now;            /* current time [ns]             */
+    uint64_t        dt;             /* time since previous present   */
+    double          frames;         /* emulated 60Hz frames so far   */
+    double          ratio;          /* refresh rate / 60Hz           */
+    int32_t         ppm;            /* clock offset                  */
+
+    /* emulated and presented frames are counted anew */
+    if (relock)
+        frame0 = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now  = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    dt   = now - last;
+    last = now;
+
+    frames = (double) __atomic_load_n(&emu_ns, __ATOMIC_RELAXED)
+           * TIMER_HZ / 1e9;
+
+    /* first sample; assume a 60Hz display until measured otherwise */
+    if (!period) {
+        period = 1e9 / TIMER_HZ;
+        return;
+    }
+
+    /* missed refreshes (e.g.: window dragged) count, but are not averaged */
+    if (dt < period / 2 || dt > period * 3 / 2)
+        presents += dt / period + 0.5;
+    else {
+        period += (dt - period) / 32;
+        presents++;
+    }
+
+    ratio = 1e9 / TIMER_HZ / period;
+    if (ratio < 1 - VSYNC_MAX_SKEW_PPM / 1e6 ||
+        ratio > 1 + VSYNC_MAX_SKEW_PPM / 1e6)
+    {
+        frame0 = -1;
+        ppm    = 0;
+    } else {
+        if (frame0 < 0) {
+            frame0   = frames;
+            presents = 0;
+        }
+
+        ppm = (ratio - 1) * 1e6
+            - (frames - frame0 - presents) * VSYNC_PHASE_PPM;
+        ppm = ppm < -VSYNC_MAX_SKEW_PPM ? -VSYNC_MAX_SKEW_PPM
+            : ppm >  VSYNC_MAX_SKEW_PPM ?  VSYNC_MAX_SKEW_PPM
+            : ppm;
+    }
+
+    /* NOTE: target_ppm is only written by this thread */
+    if (abs(ppm - target_ppm) >= VSYNC_EPS_PPM || !ppm)
+        __atomic_store_n(&target_ppm, ppm, __ATOMIC_RELAXED);
 }
 
 /* delay_timeout - callback for the 60Hz sound timer expiration
@@ -817,27 +1952,371 @@ sound_timeout(union sigval data)
  ************************* PUBLIC API IMPLEMENTATION **************************
  ******************************************************************************/
 
-/* init_system - allocates system RAM, maps ROM, initializes font sprites
+/* read_rom - reads a ROM file into a buffer
+ *  @path : path to ROM file
+ *  @buf  : destination buffer
+ *  @max  : size of destination buffer [bytes]
+ *
+ *  @return : size of ROM [bytes] or -1 on error
+ */
+int32_t
+read_rom(const char *path, uint8_t *buf, size_t max)
+{
+    int32_t     fd;             /* ROM file descriptor */
+    struct stat statbuf;        /* fstat result buffer */
+    ssize_t     ans;            /* answer              */
+    int32_t     ret = -1;       /* function status     */
+
+    /* open ROM file */
+    fd = open(path, O_RDONLY);
+    RET(fd == -1, -1, "unable to open ROM %s (%s)", path, strerror(errno));
+
+    /* determine ROM size */
+    ans = fstat(fd, &statbuf);
+    GOTO(ans == -1, clean_fd, "unable to stat ROM (%s)", strerror(errno));
+    GOTO(statbuf.st_size > max, clean_fd, "ROM is too large");
+
+    /* read contents of ROM */
+    ans = read(fd, buf, statbuf.st_size);
+    GOTO(ans == -1, clean_fd, "unable to read ROM (%s)", strerror(errno));
+    GOTO(ans != statbuf.st_size, clean_fd, "unable to fully read ROM");
+
+    ret = ans;
+
+clean_fd:
+    /* close ROM file */
+    close(fd);
+
+    return ret;
+}
+
+/* vm_init - allocates system RAM and initializes font sprites
+ *  @vm        : machine
+ *  @freq      : number of instructions executed per second
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @engines   : ENGINE_* flags
+ *  @seed      : CXKK pseudo-RNG seed
+ *
+ *  @return : 0 if everything went well
+ *
+ * The machine is headless until told otherwise. All headless machines that
+ * are initialized, loaded and fed the same inputs have the same state after
+ * each cycle, regardless of the selected execution engines.
+ */
+int32_t
+vm_init(struct chip8_vm *vm,
+        uint16_t        freq,
+        uint16_t        font_off,
+        uint8_t         new_shift,
+        uint8_t         engines,
+        uint64_t        seed)
+{
+    memset(vm, 0, sizeof(*vm));
+
+    RET(!freq, -1, "CPU frequency 0 not allowed");
+    RET(font_off + sizeof(font_sprites) > RAM_SZ, -1,
+        "font sprites do not fit in RAM");
+
+    vm->font_offset  = font_off;
+    vm->new_shift    = new_shift;
+    vm->headless     = 1;
+    vm->batch_cycles = freq / TIMER_HZ ? freq / TIMER_HZ : 1;
+
+    /* xorshift state must never be 0 */
+    vm->rng = seed * 2 + 1;
+
+    /* the first checkpoint must copy everything */
+    vm->dirty_ram = ~0UL;
+    vm->dirty     = DIRTY_ALL;
+
+    /* allocate emulated system RAM (zeroed out); machines are numerous *
+     * in batch modes, so RAM images share huge pages                   */
+    pthread_once(&slab_once, slab_init);
+    RET(!ram_slab, -1, "unable to create RAM allocator");
+
+    vm->ram = slab_alloc(ram_slab);
+    RET(!vm->ram, -1, "unable to allocate RAM");
+
+    /* copy font sprites into RAM */
+    memmove(vm->ram + font_off, font_sprites, sizeof(font_sprites));
+
+    /* create superinstruction map */
+    if (engines & ENGINE_FUSE) {
+        vm->fuse      = 1;
+        vm->fuse_map  = calloc(RAM_SZ, sizeof(*vm->fuse_map));
+        vm->fuse_hits = calloc(FUSE_MAX, sizeof(*vm->fuse_hits));
+        GOTO(!vm->fuse_map || !vm->fuse_hits, clean,
+             "unable to allocate superinstruction map");
+    }
+
+    /* create block cache for IR execution */
+    if (engines & ENGINE_IR) {
+        vm->ir_cache = ir_cache_create(new_shift, font_off);
+        GOTO(!vm->ir_cache, clean, "unable to create IR block cache");
+    }
+
+    return 0;
+
+clean:
+    vm_free(vm);
+    return -1;
+}
+
+/* vm_load - copies a ROM into RAM and sets the entry point
+ *  @vm      : machine
+ *  @rom     : ROM contents
+ *  @len     : size of ROM [bytes]
+ *  @rom_off : ROM map offset into RAM [bytes]
+ *
+ *  @return : 0 if everything went well
+ */
+int32_t
+vm_load(struct chip8_vm *vm, const uint8_t *rom, size_t len, uint16_t rom_off)
+{
+    RET(len + rom_off > RAM_SZ, -1, "ROM is too large");
+
+    memmove(vm->ram + rom_off, rom, len);
+    invalidate_code(vm, rom_off, len);
+    journal_write(vm, rom_off, len);
+
+    vm->regs.PC  = rom_off;
+    vm->dirty   |= DIRTY_REGS;
+
+    return 0;
+}
+
+/* vm_run - executes a number of cycles on a headless machine
+ *  @vm : machine
+ *  @n  : number of cycles
+ */
+void
+vm_run(struct chip8_vm *vm, uint64_t n)
+{
+    if (n)
+        vm->dirty |= DIRTY_REGS;
+
+    for (; n; n--) {
+        if (vm->cycles % vm->batch_cycles == 0)
+            vm_frame(vm);
+
+        exec_cycle(vm);
+        vm->cycles++;
+
+        if (unlikely(vm->idle_loop))
+            n -= idle_skip(vm, n - 1);
+    }
+}
+
+/* vm_hash - calculates a hash of the emulated machine state
+ *  @vm : machine
+ *
+ *  @return : 64-bit hash of registers, stack, RAM and screen
+ *
+ * Only state that is visible to the ROM is hashed. Engine specific data
+ * (caches, counters, RNG) is not. Arrays are consumed 8 bytes at a time, in
+ * FNV-1a fashion; since a multiplication only carries towards the high bits,
+ * each round also folds them back down, so that changes in the top byte of
+ * a word are not confined to the top byte of the hash.
+ */
+uint64_t
+vm_hash(struct chip8_vm *vm)
+{
+    uint64_t h = 0xcbf29ce484222325;    /* FNV offset basis */
+    uint64_t w;                         /* hashed word      */
+
+    /* hash a memory region byte by byte */
+#define HASH(ptr, len)                                  \
+    do {                                                \
+        for (size_t _i = 0; _i < (len); _i++)           \
+            h = (h ^ ((uint8_t *) (ptr))[_i])           \
+              * 0x100000001b3;                          \
+    } while (0)
+
+    /* hash a memory region word by word (len must be a multiple of 8) */
+#define HASH64(ptr, len)                                \
+    do {                                                \
+        for (size_t _i = 0; _i < (len); _i += 8) {      \
+            memcpy(&w, (uint8_t *) (ptr) + _i, 8);      \
+            h  = (h ^ w) * 0x100000001b3;               \
+            h ^= h >> 29;                               \
+        }                                               \
+    } while (0)
+
+    /* NOTE: struct chip8_regs has padding; hash fields individually */
+    HASH64(vm->regs.V, sizeof(vm->regs.V));
+    HASH(&vm->regs.I,  sizeof(vm->regs.I));
+    HASH(&vm->regs.DT, sizeof(vm->regs.DT));
+    HASH(&vm->regs.ST, sizeof(vm->regs.ST));
+    HASH(&vm->regs.PC, sizeof(vm->regs.PC));
+    HASH(&vm->regs.SP, sizeof(vm->regs.SP));
+    HASH64(vm->stack,  sizeof(vm->stack));
+    HASH64(vm->ram,    RAM_SZ);
+    HASH64(vm->pixels, sizeof(vm->pixels));
+
+#undef HASH64
+#undef HASH
+
+    return h;
+}
+
+/* vm_restore - resets a machine to the state of another one
+ *  @vm   : machine
+ *  @snap : snapshot (e.g.: a machine that was just initialized)
+ *
+ * The engines and resources of @vm are kept; all of its cached translations
+ * are discarded. This is much cheaper than initializing a new machine.
+ */
+void
+vm_restore(struct chip8_vm *vm, const struct chip8_vm *snap)
+{
+    uint8_t         *ram       = vm->ram;       /* own RAM                */
+    uint8_t         *fuse_map  = vm->fuse_map;  /* own superinstructions  */
+    size_t          *fuse_hits = vm->fuse_hits; /* own hit counters       */
+    struct ir_cache *ir_cache  = vm->ir_cache;  /* own IR blocks          */
+    uint8_t         fuse       = vm->fuse;      /* own engine selection   */
+
+    memcpy(vm, snap, sizeof(*vm));
+    memcpy(ram, snap->ram, RAM_SZ);
+
+    vm->ram       = ram;
+    vm->fuse_map  = fuse_map;
+    vm->fuse_hits = fuse_hits;
+    vm->ir_cache  = ir_cache;
+    vm->fuse      = fuse;
+
+    /* the next checkpoint must copy everything */
+    vm->dirty_ram = ~0UL;
+    vm->dirty     = DIRTY_ALL;
+
+    invalidate_code(vm, 0, RAM_SZ);
+}
+
+/* vm_checkpoint - brings the checkpoint of a machine up to date
+ *  @vm : machine
+ *  @cp : checkpoint (a machine initialized with vm_init())
+ *
+ * Only the RAM blocks, screen and registers written since the previous
+ * checkpoint are copied; the first checkpoint after vm_init() or
+ * vm_restore() copies everything. Each machine has a single write journal,
+ * so @cp must be the only checkpoint taken of @vm.
+ */
+void
+vm_checkpoint(struct chip8_vm *vm, struct chip8_vm *cp)
+{
+    journal_copy(cp, vm, vm->dirty_ram, vm->dirty);
+
+    vm->dirty_ram = 0;
+    vm->dirty     = 0;
+}
+
+/* vm_rollback - returns a machine to the state of its checkpoint
+ *  @vm : machine
+ *  @cp : checkpoint (see vm_checkpoint())
+ *
+ * Only what the machine wrote since the checkpoint is copied back and only
+ * the cached translations of overwritten RAM blocks are discarded. The
+ * checkpoint remains valid, so that it can be rolled back to repeatedly.
+ */
+void
+vm_rollback(struct chip8_vm *vm, const struct chip8_vm *cp)
+{
+    uint64_t dirty_ram = vm->dirty_ram;     /* blocks to restore */
+
+    journal_copy(vm, cp, dirty_ram, vm->dirty);
+
+    for (uint64_t b = dirty_ram; b; b &= b - 1)
+        invalidate_code(vm, __builtin_ctzl(b) * DIRTY_BLK_SZ, DIRTY_BLK_SZ);
+
+    vm->dirty_ram = 0;
+    vm->dirty     = 0;
+}
+
+/* vm_alloc - allocates a machine state from the huge page arenas
+ *  @return : zeroed machine (see vm_init()) or NULL on error
+ *
+ * Meant for batch and search workloads that keep many machines around.
+ * States are cache line aligned, so the hot registers at their start share
+ * a line with nothing else, and are packed densely like their RAM images.
+ */
+struct chip8_vm *
+vm_alloc(void)
+{
+    pthread_once(&slab_once, slab_init);
+    RET(!vm_slab, NULL, "unable to create machine allocator");
+
+    return slab_alloc(vm_slab);
+}
+
+/* vm_release - frees a machine obtained from vm_alloc()
+ *  @vm : machine (may be NULL)
+ *
+ * Resources held by the machine must have been released via vm_free().
+ */
+void
+vm_release(struct chip8_vm *vm)
+{
+    if (vm)
+        slab_free(vm_slab, vm);
+}
+
+/* vm_free - releases all resources held by a machine
+ *  @vm : machine
+ */
+void
+vm_free(struct chip8_vm *vm)
+{
+    if (vm->ram)
+        slab_free(ram_slab, vm->ram);
+    if (vm->ir_cache)
+        ir_cache_destroy(vm->ir_cache);
+
+    free(vm->fuse_map);
+    free(vm->fuse_hits);
+
+    vm->ram       = NULL;
+    vm->ir_cache  = NULL;
+    vm->fuse_map  = NULL;
+    vm->fuse_hits = NULL;
+}
+
+/* init_system - initializes the interactive machine and loads the ROM
+ *  @freq          : number of instructions executed per second
  *  @rom_off       : ROM map offset into RAM [bytes]
  *  @_font_offset  : font sprites offset into RAM [bytes]
  *  @rom_path      : path to ROM file
  *  @_ref_interval : screen refresh interval
+ *  @_new_shift    : use new implementation of shift operations
  *  @_lazy_render  : lazy redering, rather than at specific intervals
+ *  @_fuse         : execute common instruction sequences as one
+ *  @_ir           : execute straight-line code as optimized IR blocks
+ *  @_vsync        : present once per display refresh, from the UI thread
+ *  @_auto_freq    : lower the CPU rate while the ROM is waiting
+ *  @_debug_ops    : enable the timing debug extension (01X0 - 03NN)
+ *  @_evdev        : read keys from evdev devices instead of SDL
+ *  @_uncapped     : run the CPU as fast as possible, not at @freq
  *
- *  @return : starting address of the system RAM
+ *  @return : 0 if everything went well
  */
 int32_t
-init_system(uint16_t rom_off,
+init_system(uint16_t freq,
+            uint16_t rom_off,
             uint16_t _font_offset,
             char     *rom_path,
             uint16_t _ref_interval,
             uint8_t  _new_shift,
-            uint8_t  _lazy_render)
+            uint8_t  _lazy_render,
+            uint8_t  _fuse,
+            uint8_t  _ir,
+            uint8_t  _vsync,
+            uint8_t  _auto_freq,
+            uint8_t  _debug_ops,
+            uint8_t  _evdev,
+            uint8_t  _uncapped)
 {
-    int32_t           fd;           /* ROM file descriptor */
-    struct stat       statbuf;      /* fstat result buffer */
-    ssize_t           ans;          /* answer              */
-    int32_t           ret = -1;     /* function status     */
+    uint8_t           rom[RAM_SZ];  /* ROM contents        */
+    int32_t           len;          /* ROM size            */
+    int32_t           ans;          /* answer              */
     struct sigevent   ev = {        /* notification method */
         .sigev_notify            = SIGEV_THREAD,    /* handle in (this) thread */
         .sigev_value.sival_ptr   = NULL,            /* argument for handler    */
@@ -845,20 +2324,26 @@ init_system(uint16_t rom_off,
         .sigev_notify_attributes = NULL,            /* new thread attributes   */
     };
 
-    /* seed pseudo-RNG */
-    srandom(time(NULL));
-
-    /* store font offset in global static storage */
-    font_offset = _font_offset;
-
     /* store refresh interval in global static storage */
     ref_interval = _ref_interval;
 
-    /* store shift instruction flavor in global static storage */
-    new_shift = _new_shift;
-
     /* store lazy rendering preference in global static storage */
     lazy_render = _lazy_render;
+    vsync       = _vsync;
+    auto_freq   = _auto_freq;
+    evdev       = _evdev;
+    uncapped    = _uncapped;
+    cpu_freq    = freq;
+    run_freq    = freq;
+
+    /* create the machine; CXKK is seeded from the current time */
+    ans = vm_init(&main_vm, freq, _font_offset, _new_shift,
+                  (_fuse ? ENGINE_FUSE : 0) | (_ir ? ENGINE_IR : 0),
+                  time(NULL));
+    RET(ans, -1, "unable to initialize machine");
+
+    main_vm.headless  = 0;
+    main_vm.debug_ops = _debug_ops;
 
     /* create CPU, sound, delay timers */
     ans = timer_create(CLOCK_MONOTONIC, &ev, &cpu_timerid);
@@ -874,45 +2359,20 @@ init_system(uint16_t rom_off,
     ans = timer_create(CLOCK_MONOTONIC, &ev, &delay_timerid);
     RET(ans, -1, "unable to create delay timer (%s)", strerror(errno));
 
-    /* open ROM file */
-    fd = open(rom_path, O_RDONLY);
-    RET(fd == -1, -1, "unable to open ROM (%s)", strerror(errno));
-
-    /* determine ROM size */
-    ans = fstat(fd, &statbuf);
-    GOTO(ans == -1, clean_fd, "unable to stat ROM (%s)", strerror(errno));
-    GOTO(statbuf.st_size + rom_off > RAM_SZ, clean_fd, "ROM is too large");
-
-    /* allocate emulated system RAM */
-    ram = mmap(NULL, RAM_SZ, PROT_READ | PROT_WRITE,
-               MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
-    GOTO(ram == MAP_FAILED, clean_fd, "unable to allocate RAM (%s)",
-         strerror(errno));
-
-    /* zero out emulated system RAM before proceeding */
-    memset(ram, 0x00, RAM_SZ);
-
     /* read contents of ROM into RAM */
-    ans = read(fd, ram + rom_off, statbuf.st_size);
-    GOTO(ans == -1, clean_ram, "unable to read ROM (%s)", strerror(errno));
-    GOTO(ans != statbuf.st_size, clean_ram, "unable to fully read ROM");
+    len = read_rom(rom_path, rom, sizeof(rom));
+    GOTO(len == -1, clean_vm, "unable to read ROM");
 
-    /* copy font sprites into RAM */
-    memmove(ram + font_offset, font_sprites, sizeof(font_sprites));
+    ans = vm_load(&main_vm, rom, len, rom_off);
+    GOTO(ans, clean_vm, "unable to load ROM");
 
-    /* everything went well; bypass emultated system RAM cleanup */
-    ret = 0;
-    goto clean_fd;
+    return 0;
 
-clean_ram:
+clean_vm:
     /* reclaim emulated system RAM */
-    munmap(ram, RAM_SZ);
-    ram = NULL;
-clean_fd:
-    /* close ROM file */
-    close(fd);
+    vm_free(&main_vm);
 
-    return ret;
+    return -1;
 }
 
 /* sys_start - begins execution of the loaded ROM
@@ -925,6 +2385,10 @@ int32_t
 sys_start(uint16_t freq, uint16_t pc)
 {
     int32_t           ans;          /* answer              */
+    SDL_Event         ev;           /* SDL event           */
+    uint32_t          keys[16];     /* key_map (evdev)     */
+    uint8_t           relock = 0;   /* vsync lock was lost */
+    uint64_t          t;            /* section start time  */
     struct itimerspec interval = {  /* CPU timout interval */
         .it_value = {                   /* initial timer expiration  */
             .tv_sec  = 0,
@@ -937,20 +2401,114 @@ sys_start(uint16_t freq, uint16_t pc)
     };
 
     /* set initial PC register value */
-    regs.PC = pc;
+    main_vm.regs.PC = pc;
 
-    /* arm timer */
-    ans = timer_settime(cpu_timerid, 0, &interval, NULL);
-    RET(ans, -1, "unable to arm timer (%s)", strerror(errno));
+    /* the evdev thread becomes the (only) producer of input events */
+    if (evdev) {
+        for (size_t i = 0; i < sizeof(keys) / sizeof(*keys); i++)
+            keys[i] = key_map[i];
 
-    /* staying busy while CPU timer callback is idle                  *
-     * NOTE: -O2 optimizes this busy loop in a retarded way.          *
-     *       the check is done once at entry, then it jumps in place. *
-     *       the loop's BB must contain at least one instruction to   *
-     *       force the recheck of quit's value.                       */
-    while (!quit)
-        asm volatile("nop");
+        ans = evdev_start(keys, sizeof(keys) / sizeof(*keys), push_key);
+        RET(ans, -1, "unable to start evdev input");
+    }
+
+    /* arm timer (or start the CPU loop in its stead) */
+    if (uncapped) {
+        ans = pthread_create(&cpu_tid, NULL, cpu_loop, NULL);
+        if (ans)
+            ERROR("unable to create CPU thread (%s)", strerror(ans));
+    } else {
+        ans = timer_settime(cpu_timerid, 0, &interval, NULL);
+        if (ans)
+            ERROR("unable to arm timer (%s)", strerror(errno));
+    }
+    if (ans) {
+        if (evdev)
+            evdev_stop();
+        return -1;
+    }
+
+    /* the calling thread becomes the UI thread; events are waited for with *
+     * a timeout so that quitting via the timer thread is noticed too       */
+    while (!__atomic_load_n(&quit, __ATOMIC_RELAXED) && !vsync) {
+        if (SDL_WaitEventTimeout(&ev, 100)) {
+            t = stats_now();
+            handle_event(&ev);
+            stats_add(STATS_EVENTS, t);
+        }
+    }
+
+    /* in vsync mode, presenting blocks until the next display refresh */
+    while (!__atomic_load_n(&quit, __ATOMIC_RELAXED) && vsync) {
+        t = stats_now();
+        while (SDL_PollEvent(&ev))
+            handle_event(&ev);
+        t = stats_add(STATS_EVENTS, t);
+
+        /* presents may not block while minimized; wait for events instead */
+        if (__atomic_load_n(&bg_state, __ATOMIC_RELAXED) != BG_RUN) {
+            if (SDL_WaitEventTimeout(&ev, 100)) {
+                t = stats_now();
+                handle_event(&ev);
+                stats_add(STATS_EVENTS, t);
+            }
+            relock = 1;
+            continue;
+        }
+
+        refresh_display(frame_acquire());
+        stats_add(STATS_RENDER, t);
+        vsync_pace(relock);
+        relock = 0;
+    }
+
+    if (uncapped)
+        pthread_join(cpu_tid, NULL);
+    if (evdev)
+        evdev_stop();
+
+    /* emulated time advances by 1/run_freq per cycle */
+    if (auto_freq && emu_ns)
+        INFO("auto-freq: %.0f Hz on average (%hu Hz nominal), "
+             "%.1f%% of cycles idle", main_vm.cycles * 1e9 / emu_ns, cpu_freq,
+             100.0 * main_vm.idle_cycles / main_vm.cycles);
+
+    /* show how often each superinstruction was hit */
+    if (main_vm.fuse)
+        fuse_report(&main_vm);
+    if (main_vm.ir_cache)
+        ir_report(main_vm.ir_cache);
 
     return 0;
 }
 
+/* sys_stop - stops the interactive machine and ends sys_start()
+ *
+ * May be called from any thread.
+ */
+void
+sys_stop(void)
+{
+    struct itimerspec interval = { 0 };     /* timer disarmer */
+    int32_t           ans;                  /* answer         */
+
+    /* set quit condition first, so that the timer is not rearmed by a *
+     * concurrent cpu_retime() (see there)                             */
+    pthread_mutex_lock(&timer_lock);
+    __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+
+    /* disarm CPU timer; don't care about the rest */
+    ans = timer_settime(cpu_timerid, 0, &interval, NULL);
+    pthread_mutex_unlock(&timer_lock);
+    DIE(ans, "unable to disarm timer (%s)", strerror(errno));
+}
+
+/* sys_cycles - returns the number of cycles executed so far
+ *
+ * May be called from any thread.
+ */
+uint64_t
+sys_cycles(void)
+{
+    return __atomic_load_n(&main_vm.cycles, __ATOMIC_RELAXED);
+}
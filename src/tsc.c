@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>       /* clock_gettime */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>      /* __get_cpuid   */
+#include <x86intrin.h>  /* __rdtsc       */
+#endif
+
+#include "tsc.h"
+#include "util.h"
+
+#define TSC_MIN_HZ      100000000UL     /* slowest plausible TSC */
+#define TSC_MAX_HZ      10000000000UL   /* fastest plausible TSC */
+#define CALIB_TRIES     5               /* clock reads per edge  */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* TSC to CLOCK_MONOTONIC conversion; ns = base_ns + (tsc - base_tsc) * mult *
+ * >> 32. mult is 0 until calibration succeeds (i.e.: clock_gettime is used) */
+static uint64_t base_tsc;       /* TSC at calibration start           */
+static uint64_t base_ns;        /* monotonic time at calibration start */
+static uint64_t mult;           /* ns per TSC tick (32.32 fixed point) */
+static uint64_t hz;             /* calibrated TSC frequency            */
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* clock_ns - reads the monotonic clock
+ *  @return : time [ns]
+ */
+static inline uint64_t
+clock_ns(void)
+{
+    struct timespec ts;     /* current time */
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* invariant_tsc - checks that the TSC ticks at a constant rate
+ *  @return : 1 if the TSC is invariant (CPUID.80000007H:EDX[8])
+ *
+ * An invariant TSC is not affected by frequency scaling or C-states and is
+ * synchronized across cores, so readings from any thread are comparable.
+ */
+static uint8_t
+invariant_tsc(void)
+{
+    uint32_t eax, ebx, ecx, edx;    /* CPUID output */
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return 0;
+
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return !!(edx & (1 << 8));
+}
+
+/* clock_pair - reads the TSC and the monotonic clock at the same instant
+ *  @tsc : TSC value (output)
+ *
+ *  @return : monotonic time [ns]
+ *
+ * The TSC is read between two clock reads; the tightest of a few attempts
+ * is used and the TSC is assigned the midpoint of its clock reads.
+ */
+static uint64_t
+clock_pair(uint64_t *tsc)
+{
+    uint64_t best = UINT64_MAX;     /* tightest clock read window */
+    uint64_t ns   = 0;              /* midpoint of best window    */
+    uint64_t t0, t1, c;             /* current attempt            */
+
+    for (size_t i = 0; i < CALIB_TRIES; i++) {
+        t0 = clock_ns();
+        c  = __rdtsc();
+        t1 = clock_ns();
+
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            ns   = t0 + (t1 - t0) / 2;
+            *tsc = c;
+        }
+    }
+
+    return ns;
+}
+#endif
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* tsc_init - calibrates the TSC against the monotonic clock
+ *
+ * Blocks for TSC_CALIB_NS. Until (and unless) calibration succeeds,
+ * tsc_ns() falls back to clock_gettime(). Both share the same epoch, so
+ * timestamps taken before and after calibration can be compared.
+ */
+void
+tsc_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t tsc0, tsc1;    /* TSC at window edges       */
+    uint64_t ns0, ns1;      /* clock at window edges     */
+    uint64_t freq;          /* measured TSC frequency    */
+
+    if (mult)
+        return;
+
+    if (!invariant_tsc()) {
+        WAR("TSC is not invariant; timestamps come from clock_gettime()");
+        return;
+    }
+
+    ns0 = clock_pair(&tsc0);
+    while (clock_ns() - ns0 < TSC_CALIB_NS)
+        ;
+    ns1 = clock_pair(&tsc1);
+
+    freq = (unsigned __int128) (tsc1 - tsc0) * 1000000000UL / (ns1 - ns0);
+    if (freq < TSC_MIN_HZ || freq > TSC_MAX_HZ) {
+        WAR("implausible TSC rate (%lu Hz); using clock_gettime()", freq);
+        return;
+    }
+
+    base_tsc = tsc0;
+    base_ns  = ns0;
+    hz       = freq;
+    __atomic_store_n(&mult, (1000000000UL << 32) / freq, __ATOMIC_RELEASE);
+
+    DEBUG("TSC calibrated at %.3f MHz", freq / 1e6);
+#else
+    WAR("no TSC on this architecture; timestamps come from clock_gettime()");
+#endif
+}
+
+/* tsc_ns - returns a timestamp for instrumentation
+ *  @return : monotonic time [ns]
+ *
+ * Costs a few ns with a calibrated TSC, rather than the ~20ns of a vDSO
+ * clock_gettime(). The TSC is not serialized; instructions around the read
+ * may be reordered with it, which is fine at the granularity measured here.
+ */
+uint64_t
+tsc_ns(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t m = __atomic_load_n(&mult, __ATOMIC_ACQUIRE);  /* ns / tick */
+
+    if (likely(m))
+        return base_ns + ((unsigned __int128) (__rdtsc() - base_tsc) * m >> 32);
+#endif
+
+    return clock_ns();
+}
+
+/* tsc_hz - returns the calibrated TSC frequency
+ *  @return : TSC frequency [Hz] or 0 if clock_gettime() is used
+ */
+uint64_t
+tsc_hz(void)
+{
+    return hz;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright © 2022, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of mvemu.chip8.
+ *
+ * mvemu.chip8 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mvemu.chip8 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mvemu.chip8. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>    /* pthread_{create,join} */
+#include <sched.h>      /* sched_yield           */
+#include <stdlib.h>     /* calloc, free          */
+#include <string.h>     /* strerror              */
+#include <errno.h>      /* errno                 */
+
+#include "validate.h"
+#include "ingest.h"
+#include "system.h"
+#include "tsc.h"
+#include "util.h"
+
+#define MAX_RAM_DIFFS   32      /* RAM differences printed per divergence */
+
+/******************************************************************************
+ **************************** INTERNAL STRUCTURES *****************************
+ ******************************************************************************/
+
+/* state hash of a machine at the end of a block (60Hz frame) */
+struct block_hash {
+    uint64_t block;     /* block index  */
+    uint64_t hash;      /* vm_hash()    */
+};
+
+/* single producer, single consumer lock-free hash queue */
+struct hash_ring {
+    struct block_hash slot[VALIDATE_RING_SZ];   /* ring buffer           */
+    uint32_t          head;                     /* next hash to consume  */
+    uint32_t          tail;                     /* next free slot        */
+};
+
+/* machine configuration shared by both engines */
+struct config {
+    uint8_t  *rom;          /* ROM contents                  */
+    int32_t  rom_len;       /* ROM size [bytes]              */
+    uint16_t freq;          /* CPU frequency                 */
+    uint16_t rom_off;       /* ROM map offset into RAM       */
+    uint16_t font_off;      /* font sprites offset into RAM  */
+    uint8_t  new_shift;     /* use new shift operations      */
+};
+
+/* one lockstep run of a ROM */
+struct run {
+    struct chip8_vm  *ref;      /* switch interpreter             */
+    struct chip8_vm  *alt;      /* alternative engine             */
+    struct hash_ring ring;      /* alt -> ref block hashes        */
+    uint64_t         frames;    /* number of blocks to compare    */
+    int64_t          diverged;  /* first diverging block (or -1)  */
+    uint8_t          stop;      /* set by ref on divergence       */
+};
+
+/******************************************************************************
+ ****************************** HELPER FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* vm_prepare - creates a headless machine and loads the ROM into it
+ *  @vm      : machine
+ *  @cfg     : machine configuration
+ *  @engines : ENGINE_* flags
+ *
+ *  @return : 0 if everything went well
+ *
+ * NOTE: both engines use the same RNG seed and receive no input
+ */
+static int32_t
+vm_prepare(struct chip8_vm *vm, struct config *cfg, uint8_t engines)
+{
+    int32_t ans;    /* answer */
+
+    ans = vm_init(vm, cfg->freq, cfg->font_off, cfg->new_shift, engines, 0);
+    RET(ans, -1, "unable to initialize machine");
+
+    ans = vm_load(vm, cfg->rom, cfg->rom_len, cfg->rom_off);
+    if (ans)
+        vm_free(vm);
+    RET(ans, -1, "unable to load ROM");
+
+    return 0;
+}
+
+/* alt_main - runs the alternative engine, publishing a hash per block
+ *  @arg : struct run
+ *
+ *  @return : NULL
+ */
+static void *
+alt_main(void *arg)
+{
+    struct run *run = arg;  /* lockstep run */
+    uint32_t   tail = 0;    /* own index    */
+
+    for (uint64_t b = 0; b < run->frames; b++) {
+        vm_run(run->alt, run->alt->batch_cycles);
+
+        /* wait for a free slot unless reference has already given up */
+        while (tail - __atomic_load_n(&run->ring.head, __ATOMIC_ACQUIRE)
+               == VALIDATE_RING_SZ) {
+            if (__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+                return NULL;
+            sched_yield();
+        }
+
+        run->ring.slot[tail % VALIDATE_RING_SZ] = (struct block_hash) {
+            .block = b,
+            .hash  = vm_hash(run->alt),
+        };
+
+        __atomic_store_n(&run->ring.tail, ++tail, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+            break;
+    }
+
+    return NULL;
+}
+
+/* ref_main - runs the switch interpreter, checking each published hash
+ *  @arg : struct run
+ *
+ *  @return : NULL
+ */
+static void *
+ref_main(void *arg)
+{
+    struct run        *run = arg;   /* lockstep run  */
+    struct block_hash bh;           /* alt state     */
+    uint64_t          hash;         /* ref state     */
+    uint32_t          head = 0;     /* own index     */
+
+    for (uint64_t b = 0; b < run->frames; b++) {
+        vm_run(run->ref, run->ref->batch_cycles);
+        hash = vm_hash(run->ref);
+
+        /* the alternative engine never stops on its own before the end */
+        while (head == __atomic_load_n(&run->ring.tail, __ATOMIC_ACQUIRE))
+            sched_yield();
+
+        bh = run->ring.slot[head % VALIDATE_RING_SZ];
+        __atomic_store_n(&run->ring.head, ++head, __ATOMIC_RELEASE);
+
+        if (bh.hash != hash) {
+            run->diverged = bh.block;
+            __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* print_diff - prints the differences between two machines
+ *  @ref : reference machine
+ *  @alt : alternative machine
+ */
+static void
+print_diff(struct chip8_vm *ref, struct chip8_vm *alt)
+{
+    size_t ram_diffs = 0;   /* differing RAM bytes    */
+    size_t px_diffs  = 0;   /* differing screen bytes */
+
+    /* print a register if it differs */
+#define REG_DIFF(name, field)                                           \
+    do {                                                                \
+        if (ref->regs.field != alt->regs.field)                         \
+            INFO("    %-4s ref=%#06x alt=%#06x", name,                  \
+                 ref->regs.field, alt->regs.field);                     \
+    } while (0)
+
+    for (size_t i = 0; i < 16; i++) {
+        char name[4] = { 'V', "0123456789ABCDEF"[i] };
+
+        REG_DIFF(name, V[i]);
+    }
+
+    REG_DIFF("I",  I);
+    REG_DIFF("DT", DT);
+    REG_DIFF("ST", ST);
+    REG_DIFF("PC", PC);
+    REG_DIFF("SP", SP);
+
+#undef REG_DIFF
+
+    for (size_t i = 0; i < 16; i++)
+        if (ref->stack[i] != alt->stack[i])
+            INFO("    stack[%lu] ref=%#06x alt=%#06x",
+                 i, ref->stack[i], alt->stack[i]);
+
+    for (size_t i = 0; i < RAM_SZ; i++) {
+        if (ref->ram[i] == alt->ram[i])
+            continue;
+
+        if (ram_diffs++ < MAX_RAM_DIFFS)
+            INFO("    ram[%#05lx] ref=%#04x alt=%#04x",
+                 i, ref->ram[i], alt->ram[i]);
+    }
+    if (ram_diffs > MAX_RAM_DIFFS)
+        INFO("    ... %lu more RAM bytes differ", ram_diffs - MAX_RAM_DIFFS);
+
+    for (size_t i = 0; i < sizeof(ref->pixels); i++)
+        px_diffs += ref->pixels[i] != alt->pixels[i];
+    if (px_diffs)
+        INFO("    %lu screen pixels differ", px_diffs);
+}
+
+/* report_divergence - replays a run to the first diverging cycle
+ *  @cfg     : machine configuration
+ *  @engines : ENGINE_* flags of the alternative engine
+ *  @block   : first block with different end states
+ *
+ * Execution is deterministic, so fresh machines are run up to the last
+ * matching block and then single-stepped until their states differ.
+ */
+static void
+report_divergence(struct config *cfg, uint8_t engines, uint64_t block)
+{
+    struct chip8_vm ref;        /* switch interpreter   */
+    struct chip8_vm alt;        /* alternative engine   */
+    uint16_t        pc = 0;     /* PC before last cycle */
+    int32_t         ans;        /* answer               */
+
+    ans = vm_prepare(&ref, cfg, 0);
+    RET(ans, , "unable to prepare reference machine");
+    ans = vm_prepare(&alt, cfg, engines);
+    GOTO(ans, clean_ref, "unable to prepare alternative machine");
+
+    vm_run(&ref, block * ref.batch_cycles);
+    vm_run(&alt, block * alt.batch_cycles);
+
+    /* NOTE: alt may be stalled mid-block; its state catches up later */
+    for (uint64_t i = 0; i < ref.batch_cycles; i++) {
+        pc = ref.regs.PC;
+
+        vm_run(&ref, 1);
+        vm_run(&alt, 1);
+
+        if (!alt.stall && vm_hash(&ref) != vm_hash(&alt))
+            break;
+    }
+
+    INFO("  first difference after cycle %lu (ref PC was %#05x: %02x%02x)",
+         ref.cycles - 1, pc, ref.ram[pc], ref.ram[(pc + 1) & 0x0fff]);
+    print_diff(&ref, &alt);
+
+    vm_free(&alt);
+clean_ref:
+    vm_free(&ref);
+}
+
+/* validate_rom - runs a ROM on both engines in lockstep
+ *  @cfg     : machine configuration
+ *  @engines : ENGINE_* flags of the alternative engine
+ *  @frames  : number of blocks to compare
+ *
+ *  @return : 0 if no divergence was found; -1 otherwise
+ */
+static int32_t
+validate_rom(struct config *cfg, uint8_t engines, uint64_t frames)
+{
+    struct run      *run;           /* lockstep run      */
+    pthread_t       ref_tid;        /* reference thread  */
+    pthread_t       alt_tid;        /* alternative       */
+    uint64_t        t0, t1;         /* wall clock bounds */
+    int32_t         ans;            /* answer            */
+    int32_t         ret = -1;       /* function status   */
+
+    run = calloc(1, sizeof(*run));
+    RET(!run, -1, "unable to allocate run (%s)", strerror(errno));
+
+    run->frames   = frames;
+    run->diverged = -1;
+
+    /* NOTE: each machine is cache line aligned, so the two threads do not *
+     *       share lines of the hot state                                  */
+    run->ref = vm_alloc();
+    run->alt = vm_alloc();
+    GOTO(!run->ref || !run->alt, clean_run, "unable to allocate machines");
+
+    ans = vm_prepare(run->ref, cfg, 0);
+    GOTO(ans, clean_run, "unable to prepare reference machine");
+    ans = vm_prepare(run->alt, cfg, engines);
+    GOTO(ans, clean_ref, "unable to prepare alternative machine");
+
+    t0 = tsc_ns();
+
+    ans = pthread_create(&alt_tid, NULL, alt_main, run);
+    GOTO(ans, clean_alt, "unable to create thread (%s)", strerror(ans));
+    ans = pthread_create(&ref_tid, NULL, ref_main, run);
+    if (ans) {
+        /* let the alternative engine give up */
+        __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(alt_tid, NULL);
+    }
+    GOTO(ans, clean_alt, "unable to create thread (%s)", strerror(ans));
+
+    pthread_join(ref_tid, NULL);
+    pthread_join(alt_tid, NULL);
+
+    t1 = tsc_ns();
+
+    if (run->diverged == -1) {
+        INFO("  %lu blocks (%lu cycles) identical in %.3fs",
+             frames, frames * run->ref->batch_cycles,
+             (t1 - t0) / 1e9);
+        ret = 0;
+    } else {
+        ERROR("  divergence in block %ld (cycles %lu-%lu)", run->diverged,
+              run->diverged * run->ref->batch_cycles,
+              (run->diverged + 1) * run->ref->batch_cycles - 1);
+        report_divergence(cfg, engines, run->diverged);
+    }
+
+clean_alt:
+    vm_free(run->alt);
+clean_ref:
+    vm_free(run->ref);
+clean_run:
+    vm_release(run->alt);
+    vm_release(run->ref);
+    free(run);
+
+    return ret;
+}
+
+/******************************************************************************
+ ************************* PUBLIC API IMPLEMENTATION **************************
+ ******************************************************************************/
+
+/* validate_roms - checks an execution engine against the switch interpreter
+ *  @roms      : paths to ROM files
+ *  @n         : number of ROM files
+ *  @engines   : ENGINE_* flags of the alternative engine
+ *  @freq      : CPU frequency
+ *  @rom_off   : ROM map offset into RAM [bytes]
+ *  @font_off  : font sprites offset into RAM [bytes]
+ *  @new_shift : use new implementation of shift operations
+ *  @frames    : number of 60Hz blocks to compare per ROM
+ *
+ *  @return : 0 if all ROMs executed identically on both engines
+ *
+ * Each ROM is run on two headless machines, each on its own thread. After
+ * every block of CPU_FREQ/60 cycles, the alternative engine passes a hash of
+ * its state to the reference via a lock-free queue. The first mismatch stops
+ * both and the differences in machine state are printed.
+ *
+ * ROM files are loaded ahead of time by the ingest pipeline, so validation
+ * order follows I/O completion order rather than the order of @roms.
+ */
+int32_t
+validate_roms(char     **roms,
+              uint32_t n,
+              uint8_t  engines,
+              uint16_t freq,
+              uint16_t rom_off,
+              uint16_t font_off,
+              uint8_t  new_shift,
+              uint64_t frames)
+{
+    struct ingest    *ing;          /* ROM ingest pipeline  */
+    struct rom_image img;           /* loaded ROM           */
+    struct config    cfg = {        /* machine config       */
+        .freq      = freq,
+        .rom_off   = rom_off,
+        .font_off  = font_off,
+        .new_shift = new_shift,
+    };
+    uint32_t         seen   = 0;    /* ROMs handed over     */
+    uint32_t         failed = 0;    /* diverging ROMs       */
+
+    RET(!engines, -1, "no alternative engine selected");
+
+    ing = ingest_start(roms, n);
+    RET(!ing, -1, "unable to start ROM ingest");
+
+    while (!ingest_next(ing, &img)) {
+        INFO("Validating %s", img.path);
+        seen++;
+
+        cfg.rom     = img.data;
+        cfg.rom_len = img.len;
+
+        failed += cfg.rom_len == -1 || validate_rom(&cfg, engines, frames);
+
+        ingest_release(ing, &img);
+    }
+
+    ingest_stop(ing);
+
+    /* ROMs that were never handed over count as failed */
+    failed += n - seen;
+    INFO("%u/%u ROMs identical", n - failed, n);
+
+    return failed ? -1 : 0;
+}